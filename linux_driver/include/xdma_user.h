@@ -6,7 +6,7 @@
 * This file contains the data required for the interface between the 
 * base DMA driver (xdma) and the application-specific drivers, for example,
 #ifdef V6_TRD
-* the XAUI driver (xaui) and the Raw Data driver (xrawdata).
+* the Raw Data driver (xrawdata), which also drives the XAUI path.
 #else
 * the Gigabit Ethernet driver (xgbeth) and the Block Data driver 
 * (xblockdata).
@@ -73,6 +73,11 @@
 * If the registration process is successful, a handle is returned which
 * should be used in all other function calls to xdma.
 *
+* When more than one board is present, DmaNumBoards() returns how many were
+* probed, and each one is registered with separately, by its probe order -
+* <pre> Handle = DmaRegisterBoard(int Board, int Engine, int Bar, UserPtrs * uptr, int PktSize); </pre>
+* DmaRegister() is the same as DmaRegisterBoard() on board 0.
+*
 * To unregister itself from xdma, the application-specific driver does the
 * following, while passing the handle it received after registration -
 * <pre> DmaUnregister(Handle); </pre>
@@ -108,6 +113,14 @@
 * driver even though they are TX packets, since they would need to be
 * freed or re-used as the case may be.
 *
+* Completed packets are normally returned from the interrupt or poll
+* handler. A user driver that runs out of TX buffers can have them
+* returned right away with -
+* <pre> DmaReapPkts(Handle); </pre>
+* which calls UserPutPkt() from the caller's context. DmaSendPkt() never
+* calls back into the user driver, so it may be called with locks held
+* that UserPutPkt() takes.
+*
 * <b> Data Reception </b>
 *
 * The DMA driver needs to set up the complete BD ring with buffers ready
@@ -118,7 +131,27 @@
 * application-specific driver, by invoking the following -
 * <pre> (uptr->UserPutPkt)(Handle, PktBuf * pkts, int NumPkts, privData); </pre>
 * The DMA driver will again invoke UserGetPkt() in order to replenish the
-* used BDs in its BD ring.
+* used BDs in its BD ring. It does so in batches, once enough BDs have been
+* used, rather than after every completed BD.
+*
+* <b> Pre-mapped Buffers </b>
+*
+* Normally, xdma maps each buffer for DMA when it is queued, and unmaps it
+* when it is returned. A user driver that recycles a fixed set of buffers
+* can instead have xdma allocate and map them once, on the board's NUMA
+* node, with -
+* <pre> Pool = DmaPoolCreate(int Board, int NumBufs, uint BufSize, int Dir); </pre>
+* Packets that use a pool buffer set PKT_MAPPED in their flags and its bus
+* address in bufPA, for both DmaSendPkt() and UserGetPkt(). xdma then only
+* syncs these buffers with the device. The pool is freed with -
+* <pre> DmaPoolDestroy(Pool); </pre>
+* after the engines using it have been unregistered.
+*
+* A buffer that is only used once, such as a user page pinned for zero-copy
+* TX, can be mapped for a board with -
+* <pre> DmaMapPage(int Board, struct page * Page, uint Len, int Dir, dma_addr_t * PA); </pre>
+* and queued with PKT_MAPPED like a pool buffer. The user driver unmaps it
+* with DmaUnmapPage() once it has come back through UserPutPkt().
 *
 * <b> Interrupts </b>
 *
@@ -184,6 +217,8 @@ extern "C" {
 #define UNREGISTERING       3           /**< In the process of unregistering */
 /*@}*/
 
+#define MAX_BOARDS          4           /**< Maximum number of boards probed */
+
 /** @name Packet information set/read by the user drivers.
  *  These flags match with the status reported by DMA. Additional flags 
  *  should be assigned from available bits.
@@ -194,6 +229,7 @@ extern "C" {
 #define PKT_ERROR           0x10000000  /**< Error while processing buffer */
 //#define PKT_USER            0x00008000  /**< User information is included */
 #define PKT_UNUSED          0x00004000  /**< Buffer is being returned unused */
+#define PKT_MAPPED          0x00002000  /**< Buffer is from a DmaPool */
 #define PKT_ALL             0x00800000  /**< All fragments must be sent */
 /*@}*/
 
@@ -211,10 +247,12 @@ extern "C" {
  *  be retrieved by the user driver.
  *  - The size of the packet buffer.
  *  - When the user submits a packet for DMA, the flags can be a combination
- *    of PKT_SOP, PKT_EOP and PKT_ALL. PKT_ALL indicates to the DMA driver
- *    that all of the packets in the submitted array must be queued for DMA.
- *    This will usually be done when the queued packets are fragments of a 
- *    larger user packet.
+ *    of PKT_SOP, PKT_EOP, PKT_ALL and PKT_MAPPED. PKT_ALL indicates to the
+ *    DMA driver that all of the packets in the submitted array must be
+ *    queued for DMA. This will usually be done when the queued packets are
+ *    fragments of a larger user packet.
+ *    PKT_MAPPED indicates that the buffer is from a DmaPool, and that
+ *    bufPA holds its bus address.
  *  - When the DMA driver returns a packet to the user driver, the flags can
  *    be a combination of PKT_SOP, PKT_EOP, PKT_ERROR and PKT_UNUSED. 
  *    PKT_UNUSED indicates that the packet buffer is being returned unused
@@ -228,8 +266,21 @@ typedef struct {
     unsigned int   size;          /**< Size of packet buffer */
     unsigned int   flags;         /**< Flags associated with packet */
     unsigned long long userInfo;  /**< User info associated with packet */ 
+    dma_addr_t     bufPA;         /**< Bus address, with PKT_MAPPED */
 } PktBuf;
 
+/** Buffers mapped for DMA once, by DmaPoolCreate(), and kept mapped until
+ *  DmaPoolDestroy(). Buffer i is at bufVA[i] and bus address bufPA[i].
+ */
+typedef struct {
+    struct pci_dev * pdev;        /**< Device the buffers are mapped for */
+    int            dir;           /**< PCI_DMA_TODEVICE or PCI_DMA_FROMDEVICE */
+    int            numBufs;       /**< Number of buffers in the pool */
+    unsigned int   bufSize;       /**< Size of each buffer */
+    unsigned char** bufVA;        /**< Virtual addresses */
+    dma_addr_t*    bufPA;         /**< Bus addresses */
+} DmaPool;
+
 /** User State Information passed between DMA and application-specific 
  *  drivers while changing configuration, and reading state/statistics.
  *  - LinkState can be LINK_UP or LINK_DOWN
@@ -279,8 +330,15 @@ typedef struct {
  *  @{
  */
 void*   DmaRegister     (int engine, int bar, UserPtrs* uptr, int pktsize);
+void*   DmaRegisterBoard(int board, int engine, int bar, UserPtrs* uptr, int pktsize);
+int     DmaNumBoards    (void);
 int     DmaUnregister   (void* handle);
 int     DmaSendPkt      (void* handle, PktBuf* pkts, int numpkts);
+int     DmaReapPkts     (void* handle);
+DmaPool* DmaPoolCreate  (int board, int numbufs, unsigned int bufsize, int dir);
+void    DmaPoolDestroy  (DmaPool* pool);
+int     DmaMapPage      (int board, struct page* pg, unsigned int len, int dir, dma_addr_t* pa);
+void    DmaUnmapPage    (int board, dma_addr_t pa, unsigned int len, int dir);
 /*@}*/
 
 #ifdef __cplusplus
@@ -17,64 +17,164 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <time.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <new>
 
 #include "xpmon_be.h"
 #include "ml605_api.h"
 
 #define RAWDATA_FILENAME    "/dev/ml605_raw_data"
+#define XAUIDATA_FILENAME   "/dev/ml605_xaui_data"
 #define XDMA_FILENAME       "/dev/xdma_stat"
 #define PKTSIZE             4096
 
-/* File pointer for the raw data file */
-static int rawdatafd = -1;
+static const int kTimeOut = 1000;
 
-/* File pointer for the xdma status file */
-static int xdmadatafd = -1;
+/* Handles behind the fd based API and ML605OpenBoard, one per board and
+ * stream or XAUI path, indexed like the device minors. Allocated with
+ * malloc, so the API still links without libstdc++. */
+#define ML605_MAX_HANDLES (ML605_MAX_BOARDS * (ML605_XAUI_STREAM + 1))
+static ML605Handle *board_handles[ML605_MAX_HANDLES];
 
-static const int kTimeOut = 1000;
+static int HandleIndex(int board, int stream) {
+  return stream * ML605_MAX_BOARDS + board;
+}
 
-static const int kSleepUs = 5;
+ML605Handle::ML605Handle() noexcept {
+  Reset();
+}
 
-int ML605Open() {
-  if ((xdmadatafd = open(XDMA_FILENAME, O_RDONLY)) < 0) {
-    printf("Failed open %s\n", XDMA_FILENAME);
-    return xdmadatafd;
+ML605Handle::ML605Handle(int board) {
+  Reset();
+  Open(board);
+}
+
+ML605Handle::ML605Handle(ML605Handle &&other) noexcept {
+  Take(other);
+}
+
+ML605Handle &ML605Handle::operator=(ML605Handle &&other) {
+  if (this != &other) {
+    Close();
+    Take(other);
   }
+  return *this;
+}
 
-  if ((rawdatafd = open(RAWDATA_FILENAME, O_RDWR)) < 0) {
-    printf("Failed open %s\n", RAWDATA_FILENAME);
-    close(xdmadatafd);
+ML605Handle::~ML605Handle() noexcept(false) {
+  Close();
+}
+
+void ML605Handle::Reset() noexcept {
+  board_ = -1;
+  stream_ = 0;
+  rawdatafd_ = -1;
+  xdmadatafd_ = -1;
+  rx_ring_ = NULL;
+  rx_ring_size_ = 0;
+  rx_ring_outstanding_ = 0;
+  status_page_ = NULL;
+}
+
+// Move everything other owns into this handle, which must be closed
+void ML605Handle::Take(ML605Handle &other) noexcept {
+  board_ = other.board_;
+  stream_ = other.stream_;
+  rawdatafd_ = other.rawdatafd_;
+  xdmadatafd_ = other.xdmadatafd_;
+  rx_ring_ = other.rx_ring_;
+  rx_ring_size_ = other.rx_ring_size_;
+  rx_ring_outstanding_ = other.rx_ring_outstanding_;
+  status_page_ = other.status_page_;
+  other.Reset();
+}
+
+int ML605Handle::Open(int board, int stream) {
+  char rawdata_filename[sizeof(RAWDATA_FILENAME) + 8];
+
+  if (IsOpen()) {
+    printf("Open: board %d already open\n", board_);
+    return -EBUSY;
+  }
+  if ((board < 0) || (board >= ML605_MAX_BOARDS) ||
+      (stream < 0) || (stream > ML605_XAUI_STREAM)) {
+    printf("Open: invalid board %d stream %d\n", board, stream);
+    return -EINVAL;
   }
 
+  if (stream == ML605_XAUI_STREAM) {
+    snprintf(rawdata_filename, sizeof(rawdata_filename), "%s%d", XAUIDATA_FILENAME, board);
+  } else if (stream > 0) {
+    // Rx only device of the stream; the board's status stays with stream 0
+    snprintf(rawdata_filename, sizeof(rawdata_filename), "%s%d_%d", RAWDATA_FILENAME, board, stream);
+  } else if (board == 0) {
+    snprintf(rawdata_filename, sizeof(rawdata_filename), "%s", RAWDATA_FILENAME);
+    if ((xdmadatafd_ = open(XDMA_FILENAME, O_RDONLY)) < 0) {
+      printf("Failed open %s\n", XDMA_FILENAME);
+      return xdmadatafd_;
+    }
+  } else {
+    snprintf(rawdata_filename, sizeof(rawdata_filename), "%s%d", RAWDATA_FILENAME, board);
+  }
+
+  // Non-blocking, so every wait happens in ppoll() with a deadline
+  if ((rawdatafd_ = open(rawdata_filename, O_RDWR | O_NONBLOCK)) < 0) {
+    int retval = rawdatafd_;
+    printf("Failed open %s\n", rawdata_filename);
+    if (xdmadatafd_ >= 0) {
+      close(xdmadatafd_);
+    }
+    Reset();
+    return retval;
+  }
+  board_ = board;
+  stream_ = stream;
+
 	// wait until raw data driver is ready
 	sleep(1);
 
-  return rawdatafd;
+  void *ptr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, rawdatafd_, ML605_STATUS_MMAP_OFFSET);
+  if (ptr == MAP_FAILED) {
+    printf("Status page not available, errno=%d. Using ioctl.\n", errno);
+  } else {
+    status_page_ = reinterpret_cast<const ML605Status*>(ptr);
+  }
+
+  return rawdatafd_;
 }
 
-int ML605Close(int fd) {
-  int retval;
+int ML605Handle::Close() {
+  int retval = 0;
 
-  if (fd != rawdatafd) {
-    printf("Close: wrong fd\n");
-    return -EBADF;
+  if (!IsOpen()) {
+    return 0;
   }
 
-  if ((retval = close(rawdatafd)) < 0) {
-    printf("Failed close %s\n", RAWDATA_FILENAME);
-    return retval;
+  if (status_page_ != NULL) {
+    munmap(const_cast<ML605Status*>(status_page_), getpagesize());
+  }
+
+  if (rx_ring_ != NULL) {
+    munmap(rx_ring_, rx_ring_size_);
+  }
+
+  if (close(rawdatafd_) < 0) {
+    printf("Failed close raw data device of board %d\n", board_);
+    retval = -errno;
   }
 
-  if ((retval = close(xdmadatafd)) < 0) {
+  if ((xdmadatafd_ >= 0) && (close(xdmadatafd_) < 0)) {
     printf("Failed close %s\n", XDMA_FILENAME);
-    return retval;
+    retval = -errno;
   }
 
-  return 0;
+  Reset();
+  return retval;
 }
 
 #if 0
@@ -111,13 +211,13 @@ int ML605StartEthernet(int fd) {
   return 0;
 }
 #else
-int ML605StartEthernet(int fd, int flag) {
+int ML605Handle::StartEthernet(int flag) {
   TestCmd testCmd;
   int retval;
 
-  if (fd != rawdatafd) {
-    printf("Start Ethernet: wrong fd\n");
-    return -EBADF;
+  if (xdmadatafd_ < 0) {
+    printf("Start Ethernet: only available on board 0\n");
+    return -ENODEV;
   }
 
 //  testCmd.Engine = 1;
@@ -129,7 +229,7 @@ int ML605StartEthernet(int fd, int flag) {
   switch (flag) {
   case SFP_TX_START:
     // get current SFP state
-    retval = ioctl(xdmadatafd, IGET_TEST_STATE, &testCmd);
+    retval = ioctl(xdmadatafd_, IGET_TEST_STATE, &testCmd);
     if(retval != 0) {
       printf("ML605StartEthernet(): Get SFP state of Eng %d failed\n", testCmd.Engine);
       return retval;
@@ -141,7 +241,7 @@ int ML605StartEthernet(int fd, int flag) {
     }
     // start SFP Tx -> set ENABLE_LOOPBACK (TX_EN) bit
     testCmd.TestMode = testCmd.TestMode | TEST_START | ENABLE_LOOPBACK;
-    retval = ioctl(xdmadatafd, ISTART_TEST, &testCmd);
+    retval = ioctl(xdmadatafd_, ISTART_TEST, &testCmd);
     if(retval != 0) {
       printf("Start SFP Tx of Eng %d failed\n", testCmd.Engine);
       return retval;
@@ -149,7 +249,7 @@ int ML605StartEthernet(int fd, int flag) {
     break;
   case SFP_RX_START:
     // get current SFP state
-    retval = ioctl(xdmadatafd, IGET_TEST_STATE, &testCmd);
+    retval = ioctl(xdmadatafd_, IGET_TEST_STATE, &testCmd);
     if(retval != 0) {
       printf("Get SFP state of Eng %d failed\n", testCmd.Engine);
       return retval;
@@ -161,7 +261,7 @@ int ML605StartEthernet(int fd, int flag) {
     }
     // start SFP Rx -> set ENABLE_PKTCHK (RX_EN) bit
     testCmd.TestMode = testCmd.TestMode | TEST_START | ENABLE_PKTCHK;
-    retval = ioctl(xdmadatafd, ISTART_TEST, &testCmd);
+    retval = ioctl(xdmadatafd_, ISTART_TEST, &testCmd);
     if(retval != 0) {
       printf("Start SFP Rx of Eng %d failed\n", testCmd.Engine);
       return retval;
@@ -175,288 +275,729 @@ int ML605StartEthernet(int fd, int flag) {
 }
 #endif
 
-int ML605Send(int fd, const void *buf, unsigned int len) {
-  int num_wait;
-  int num_pkts;
-  int bytes;
-  int retval;
-  int i;
-  int busy_counter = 0;
+// Deadline timeout_us from now
+static void SetDeadline(struct timeval *deadline, long timeout_us) {
+  gettimeofday(deadline, NULL);
+  deadline->tv_sec += timeout_us / 1000000;
+  deadline->tv_usec += timeout_us % 1000000;
+  if (deadline->tv_usec >= 1000000) {
+    deadline->tv_sec++;
+    deadline->tv_usec -= 1000000;
+  }
+}
 
-  if (fd != rawdatafd) {
-    printf("Send: wrong fd\n");
-    return -EBADF;
+// Microseconds left until deadline, never negative
+static long RemainingUs(const struct timeval *deadline) {
+  struct timeval now;
+  long us;
+
+  gettimeofday(&now, NULL);
+  us = (deadline->tv_sec - now.tv_sec) * 1000000L + (deadline->tv_usec - now.tv_usec);
+  return (us > 0) ? us : 0;
+}
+
+// Sleep in the driver's wait queue until the raw data fd reports events,
+// or remain_us passes. A negative remain_us waits forever.
+int ML605Handle::WaitRawData(short events, long remain_us) {
+  struct timespec ts;
+  struct pollfd pfd;
+
+  pfd.fd = rawdatafd_;
+  pfd.events = events;
+  pfd.revents = 0;
+  if (remain_us >= 0) {
+    ts.tv_sec = remain_us / 1000000;
+    ts.tv_nsec = (remain_us % 1000000) * 1000;
+  }
+  if (ppoll(&pfd, 1, (remain_us >= 0) ? &ts : NULL, NULL) < 0 && errno != EINTR) {
+    return -errno;
+  }
+  if (pfd.revents & (POLLERR | POLLNVAL)) {
+    return -EIO;
   }
+  return 0;
+}
+
+int ML605Handle::Send(const void *buf, unsigned int len) {
+  struct timeval deadline;
+  long remain_us;
+  int bytes;
+  int retval;
+  int wait_retval;
 
-  if ((len <= 0) || (len > 1024*1024) || ((len & 0x00000FFF) != 0)) {
+  if ((len <= 0) || (len > ML605_MAX_XFER_LEN) || ((len & 0x00000FFF) != 0)) {
     printf("Send: Invalid packet length %d. Must be less than 1 MB. Must be multiples of 4096.\n", len);
     return -EINVAL;
   }
 
-  num_wait = 0;
-  while (ML605QueryTxBuf(fd) < static_cast<int>(len)*2) {
-    usleep(1000);
-    ++num_wait;
-    if (num_wait > kTimeOut) {
-      printf("ML605Send timeout > %d ms\n", 1000*kTimeOut/1000);
+  SetDeadline(&deadline, 1000L*kTimeOut);
+
+  // The driver queues all pages of one write() as a single DMA batch.
+  // It may accept fewer bytes than requested, then send the rest once
+  // Tx buffers are free again.
+  retval = 0;
+  while (retval < static_cast<int>(len)) {
+    bytes = write(rawdatafd_, reinterpret_cast<const unsigned char*>(buf)+retval, len-retval);
+    if (bytes > 0) {
+      retval += bytes;
+      continue;
+    }
+    if ((bytes < 0) && (errno != ENOMEM) && (errno != EINTR)) {
+      printf("ML605Send: errno=%d\n", errno);
+      return -errno;    // Other errors, return
+    }
+
+    // Tx buffers full, wait for completions
+    if ((remain_us = RemainingUs(&deadline)) == 0) {
+      printf("ML605Send timeout > %d ms, sent %d of %d bytes\n", 1000*kTimeOut/1000, retval, len);
       return -EFAULT;
     }
+    if ((wait_retval = WaitRawData(POLLOUT, remain_us)) < 0) {
+      printf("ML605Send: wait failed %d\n", wait_retval);
+      return wait_retval;
+    }
   }
 
-//	printf("TxFreeBuf=%d\n", ML605QueryTxBuf(fd));
-
-  num_pkts = len >> 12;
-  bytes = retval = 0;
-  for (i = 0; i < num_pkts; ++i)
-  {
-//		printf("i=%d\n", i);
-    while (busy_counter < kTimeOut) {
-      bytes = write(rawdatafd, reinterpret_cast<const unsigned char*>(buf)+i*PKTSIZE, PKTSIZE);
-		  if (bytes == PKTSIZE) {
-		    break;            // send sucessfully, goto next loop
-		  } else if (bytes >= 0) {
-	      printf("ML605Send: partially send bytes=%d\n", bytes);
-	      //return -EFAULT;   // partially sent, return with error
-	    } else if (errno == EBUSY) {
-        ++busy_counter;   // device busy, try again. Return if busy counter hits.
-        if (busy_counter >= kTimeOut) {
-          printf("ML605Send: device busy\n");
-          return -EBUSY;
-        }
-	    } else {
-        printf("ML605Send: errno=%d\n", errno);
-        return -errno;    // Other errors, return
-	    }
-	    usleep(kSleepUs);
-		}
-		retval += bytes;
-	}
-
 	return retval;
 }
 
-int ML605QueryTxBuf(int fd) {
+// Consistent snapshot of the status page. The driver makes seq odd while
+// it updates the fields, so retry until it is even and unchanged.
+void ML605Handle::ReadStatus(ML605Status *status) {
+  unsigned int seq;
+
+  do {
+    while ((seq = status_page_->seq) & 1) {
+      ;
+    }
+    __sync_synchronize();
+    status->seq = seq;
+    status->timing_status = status_page_->timing_status;
+    status->tx_free_bytes = status_page_->tx_free_bytes;
+    status->rx_bytes = status_page_->rx_bytes;
+    status->tx_seq_no = status_page_->tx_seq_no;
+    status->rx_seq_no = status_page_->rx_seq_no;
+    __sync_synchronize();
+  } while (status_page_->seq != seq);
+}
+
+int ML605Handle::GetStatus(ML605Status *status) {
+  if (status_page_ == NULL) {
+    return -ENODEV;
+  }
+
+  ReadStatus(status);
+  return 0;
+}
+
+int ML605Handle::QueryTxBuf() {
   int num_tx_buf_len = 0;   // available length
-  int ioctl_retval;
-  int busy_counter = 0;
-  int retval = -EFAULT;
+  ML605Status status;
 
-  if (fd != rawdatafd) {
-    printf("Query Tx Buf: wrong fd\n");
-    return -EBADF;
+  if (status_page_ != NULL) {
+    ReadStatus(&status);
+    return status.tx_free_bytes;
   }
 
-  while (busy_counter < kTimeOut) {
-    ioctl_retval = ioctl(fd, RD_CMD_QUERY_TX_BUF, &num_tx_buf_len);
-    if (ioctl_retval == 0) {
-      retval = num_tx_buf_len;    // operation successfully, return
-      break;
-    } else if (errno == EBUSY) {
-      ++busy_counter;       // device busy, try again. Return if busy counter hits.
-      if (busy_counter >= kTimeOut) {
-        retval = -errno;
-        printf("ML605QueryTxBuf failed: device is busy\n");
+  if (ioctl(rawdatafd_, RD_CMD_QUERY_TX_BUF, &num_tx_buf_len) != 0) {
+    printf("ML605QueryTxBuf failed: errno=%d\n", errno);
+    return -errno;
+  }
+
+  return num_tx_buf_len;
+}
+
+int ML605Handle::RecvTimeout(void *buf, unsigned int len, long timeout_us) {
+  return RecvStamped(buf, len, timeout_us, NULL);
+}
+
+// The driver remembers the stamp of the first page each read() returned, so
+// the stamp of buf is fetched right after the first read() that gets data.
+int ML605Handle::RecvStamped(void *buf, unsigned int len, long timeout_us,
+                             unsigned int *timestamp) {
+  struct timeval deadline;
+  long remain_us;
+  int bytes;
+  int retval;
+  int wait_retval;
+
+  if ((len <= 0) || (len > ML605_MAX_XFER_LEN) || ((len & 0x00000FFF) != 0)) {
+    printf("Recv: Invalid packet length %d. Must be less than 1 MB. Must be multiples of 4096.\n", len);
+    return -EINVAL;
+  }
+
+  if (timeout_us >= 0) {
+    SetDeadline(&deadline, timeout_us);
+  }
+
+  // One read() drains every completed page that fits, so a whole sub-frame
+  // normally arrives in a single call. In between, sleep in the driver's
+  // wait queue until myPutRxPkt wakes us.
+  retval = 0;
+  while (retval < static_cast<int>(len)) {
+    bytes = read(rawdatafd_, reinterpret_cast<unsigned char*>(buf)+retval, len-retval);
+    if (bytes > 0) {
+      if ((retval == 0) && (timestamp != NULL) &&
+          (ioctl(rawdatafd_, RD_CMD_GET_READ_STAMP, timestamp) != 0)) {
+        printf("ML605Recv: get timestamp failed: errno=%d\n", errno);
+        return -errno;
       }
-    } else {
-      retval = -errno;      // Other errors, return
-      printf("ML605QueryTxBuf failed: errno=%d\n", errno);
-      break;
+      retval += bytes;
+      continue;
+    }
+    if ((bytes < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+      printf("ML605Recv: errno=%d\n", errno);
+      return -errno;    // Other errors, return
+    }
+
+    if (timeout_us < 0) {
+      remain_us = -1;
+    } else if ((remain_us = RemainingUs(&deadline)) == 0) {
+      break;            // timed out, return what we have
+    }
+    if ((wait_retval = WaitRawData(POLLIN, remain_us)) < 0) {
+      printf("ML605Recv: wait failed %d\n", wait_retval);
+      return wait_retval;
     }
-    usleep(kSleepUs);
   }
 
-  return retval;
+	return retval;
 }
 
-int ML605Recv(int fd, void *buf, unsigned int len) {
-  int num_wait;
-  int num_pkts;
+// One read() is one whole frame in framed mode; in between, sleep until
+// the driver has new data to look at.
+int ML605Handle::RecvFrame(void *buf, unsigned int len, long timeout_us) {
+  struct timeval deadline;
+  long remain_us;
   int bytes;
-  int retval;
-  int i;
-  int busy_counter = 0;  
+  int wait_retval;
 
-  if (fd != rawdatafd) {
-    printf("Recv: wrong fd\n");
-    return -EBADF;
+  if (timeout_us >= 0) {
+    SetDeadline(&deadline, timeout_us);
   }
 
-  if ((len <= 0) || (len > 1024*1024) || ((len & 0x00000FFF) != 0)) {
-    printf("Recv: Invalid packet length %d. Must be less than 1 MB. Must be multiples of 4096.\n", len);
+  for (;;) {
+    bytes = read(rawdatafd_, buf, len);
+    if (bytes > 0) {
+      return bytes;
+    }
+    if ((bytes < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+      printf("ML605RecvFrame: errno=%d\n", errno);
+      return -errno;
+    }
+
+    if (timeout_us < 0) {
+      remain_us = -1;
+    } else if ((remain_us = RemainingUs(&deadline)) == 0) {
+      return 0;
+    }
+    if ((wait_retval = WaitRawData(POLLIN, remain_us)) < 0) {
+      printf("ML605RecvFrame: wait failed %d\n", wait_retval);
+      return wait_retval;
+    }
+  }
+}
+
+int ML605Handle::SetFrameLen(unsigned int frame_len) {
+  int val = static_cast<int>(frame_len);
+
+  if (ioctl(rawdatafd_, RD_CMD_SET_FRAME_LEN, &val) != 0) {
+    printf("ML605SetFrameLen (%u) failed: errno=%d\n", frame_len, errno);
+    return -errno;
+  }
+
+  return 0;
+}
+
+// Same loop as Send, but with the ioctl that pins buf. When no page can be
+// taken, wait for the oldest zero-copy page in flight to come back.
+int ML605Handle::SendZeroCopy(const void *buf, unsigned int len, unsigned long long *done_mark) {
+  struct timeval deadline;
+  ML605TxZeroCopy zc;
+  unsigned long long done;
+  int retval;
+
+  if ((len <= 0) || (len > ML605_MAX_XFER_LEN) || ((len & 0x00000FFF) != 0) ||
+      ((reinterpret_cast<unsigned long>(buf) & 0x00000FFF) != 0)) {
+    printf("SendZeroCopy: Invalid buffer %p length %d. Must be page aligned, less than 1 MB and multiples of 4096.\n", buf, len);
     return -EINVAL;
   }
 
-  num_wait = 0;
-  while (ML605QueryRxBuf(fd) < static_cast<int>(len)) {
-    usleep(1000);
-    ++num_wait;   // timeout feature might be required in future releases
-    if (num_wait > kTimeOut) {
-      printf("ML605Recv timeout > %d ms\n", 1000*kTimeOut/1000);
+  SetDeadline(&deadline, 1000L*kTimeOut);
+
+  retval = 0;
+  while (retval < static_cast<int>(len)) {
+    zc.addr = reinterpret_cast<unsigned long>(buf) + retval;
+    zc.len = len - retval;
+    zc.reserved = 0;
+    if (ioctl(rawdatafd_, RD_CMD_TX_ZERO_COPY, &zc) == 0) {
+      retval += zc.len;
+      if (done_mark != NULL) {
+        *done_mark = zc.done_mark;
+      }
+      continue;
+    }
+    if ((errno != ENOMEM) && (errno != EAGAIN) && (errno != EINTR)) {
+      printf("ML605SendZeroCopy: errno=%d\n", errno);
+      return -errno;
+    }
+
+    if (RemainingUs(&deadline) == 0) {
+      printf("ML605SendZeroCopy timeout > %d ms, sent %d of %d bytes\n", 1000*kTimeOut/1000, retval, len);
       return -EFAULT;
     }
+    // A mark of 0 returns the done count at once; one page more than
+    // that is the oldest page in flight, if any.
+    done = 0;
+    if (ioctl(rawdatafd_, RD_CMD_WAIT_TX_DONE, &done) == 0) {
+      done += PKTSIZE;
+      if (ioctl(rawdatafd_, RD_CMD_WAIT_TX_DONE, &done) == 0) {
+        continue;
+      }
+    }
+    if (errno != EINTR) {
+      printf("ML605SendZeroCopy: wait failed: errno=%d\n", errno);
+      return -errno;
+    }
   }
 
-  num_pkts = len >> 12;
-  bytes = retval = 0;
-//	printf("num_pkts=%d\n", num_pkts);
-  for (i = 0; i < num_pkts; ++i)
-  {
-   // printf("read times=%d\n",i);
-//		printf("buf addr=0x%lx\n", (unsigned long)(buf+i*PKTSIZE));
-    while (busy_counter < kTimeOut) {
-      bytes = read(rawdatafd, reinterpret_cast<unsigned char*>(buf)+i*PKTSIZE, PKTSIZE);
-		  if (bytes == PKTSIZE) {
-		    break;            // send sucessfully, goto next loop
-		  } else if (bytes >= 0) {
-	      printf("ML605Recv: partially receive bytes=%d\n", bytes);
-	      return -EFAULT;   // partially receive, return with error
-	    } else if (errno == EBUSY) {
-        ++busy_counter;   // device busy, try again. Return if busy counter hits.
-        if (busy_counter >= kTimeOut) {
-          printf("ML605Recv: device busy\n");
-          return -EBUSY;
-        }
-	    } else {
-        printf("ML605Recv: errno=%d\n", errno);
-        return -errno;    // Other errors, return
-	    }
-	    usleep(kSleepUs);
-		}		
-		retval += bytes;
-	}
+  return retval;
+}
+
+int ML605Handle::WaitTxDone(unsigned long long done_mark) {
+  unsigned long long done = done_mark;
+
+  while (ioctl(rawdatafd_, RD_CMD_WAIT_TX_DONE, &done) != 0) {
+    if (errno != EINTR) {
+      printf("ML605WaitTxDone failed: errno=%d\n", errno);
+      return -errno;
+    }
+    done = done_mark;
+  }
+
+  return 0;
+}
+
+int ML605Handle::Recv(void *buf, unsigned int len) {
+  int retval;
+
+  retval = RecvTimeout(buf, len, 1000L*kTimeOut);
+  if ((retval >= 0) && (retval < static_cast<int>(len))) {
+    printf("ML605Recv timeout > %d ms, received %d of %d bytes\n", 1000*kTimeOut/1000, retval, len);
+    return -EFAULT;
+  }
 
 	return retval;
 }
 
-int ML605QueryRxBuf(int fd) {
-  int num_rx_buf_len;   // available length
-  int ioctl_retval;
-  int busy_counter = 0;
-  int retval = -EFAULT;
+int ML605Handle::RecvWithTimestamp(void *buf, unsigned int len, unsigned int *timestamp) {
+  int retval;
 
-  if (fd != rawdatafd) {
-    printf("Query Rx Buf: wrong fd\n");
-    return -EBADF;
+  retval = RecvStamped(buf, len, 1000L*kTimeOut, timestamp);
+  if ((retval >= 0) && (retval < static_cast<int>(len))) {
+    printf("ML605Recv timeout > %d ms, received %d of %d bytes\n", 1000*kTimeOut/1000, retval, len);
+    return -EFAULT;
   }
 
-  while (busy_counter < kTimeOut) {
-    ioctl_retval = ioctl(fd, RD_CMD_QUERY_RX_BUF, &num_rx_buf_len);
-    if (ioctl_retval == 0) {
-      retval = num_rx_buf_len;    // operation successfully, return
-      break;
-    } else if (errno == EBUSY) {
-      ++busy_counter;        // device busy, try again. Return if busy counter hits.
-      if (busy_counter >= kTimeOut) {
-        retval = -errno;
-        printf("ML605QueryRxBuf failed: device is busy\n");
-      }
-    } else {
-      retval = -errno;    // Other errors, return
-      printf("ML605QueryRxBuf failed: errno=%d\n", errno);
+  return retval;
+}
+
+// Map the driver's Rx ring. The control area is mapped first to learn the
+// size of the whole ring.
+int ML605Handle::MapRxRing() {
+  void *ptr;
+  size_t map_size;
+
+  ptr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, rawdatafd_,
+             ML605_RX_RING_MMAP_OFFSET);
+  if (ptr == MAP_FAILED) {
+    printf("MapRxRing: mmap control area failed: errno=%d\n", errno);
+    return -errno;
+  }
+  map_size = reinterpret_cast<ML605RxRing*>(ptr)->map_size;
+  munmap(ptr, getpagesize());
+
+  ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, rawdatafd_,
+             ML605_RX_RING_MMAP_OFFSET);
+  if (ptr == MAP_FAILED) {
+    printf("MapRxRing: mmap %u bytes failed: errno=%d\n",
+           static_cast<unsigned>(map_size), errno);
+    return -errno;
+  }
+
+  rx_ring_ = reinterpret_cast<ML605RxRing*>(ptr);
+  rx_ring_size_ = map_size;
+  rx_ring_outstanding_ = 0;
+  return 0;
+}
+
+// Get up to max_pages received pages without copying. pages[i] points into
+// the driver's Rx ring and lens[i] is its valid length. Pages must be given
+// back in order with ML605ReleasePages. Returns the number of pages, 0 if
+// nothing is ready. Do not mix with ML605Recv on the same fd.
+int ML605Handle::RecvZeroCopy(unsigned char **pages, unsigned int *lens, int max_pages) {
+  unsigned long long pos;
+  unsigned long long avail;
+  unsigned char *base;
+  unsigned int slot;
+  unsigned int page;
+  int retval;
+  int i;
+
+  if (max_pages <= 0) {
+    return -EINVAL;
+  }
+
+  if (rx_ring_ == NULL) {
+    if ((retval = MapRxRing()) < 0) {
+      return retval;
+    }
+  }
+
+  pos = rx_ring_->consumer + rx_ring_outstanding_;
+  avail = rx_ring_->producer - pos;
+  if (avail > static_cast<unsigned long long>(max_pages)) {
+    avail = max_pages;
+  }
+  // read producer before the descriptors it covers
+  __sync_synchronize();
+
+  base = reinterpret_cast<unsigned char*>(rx_ring_) + rx_ring_->data_offset;
+  for (i = 0; i < static_cast<int>(avail); ++i, ++pos) {
+    slot = pos % rx_ring_->num_pages;
+    page = rx_ring_->desc[slot].page;
+    if (page >= rx_ring_->num_pages) {
+      printf("RecvZeroCopy: bad page %u in slot %u\n", page, slot);
       break;
     }
-    usleep(kSleepUs);    
+    pages[i] = base + static_cast<size_t>(page) * rx_ring_->page_size;
+    if (lens != NULL) {
+      lens[i] = rx_ring_->desc[slot].len;
+    }
   }
-  
-  return retval;
+  avail = i;
+
+  rx_ring_outstanding_ += avail;
+  return static_cast<int>(avail);
 }
 
-int ML605GetHwCounterMs(int fd) {
+// Give the oldest num_pages pages from ML605RecvZeroCopy back to the driver.
+int ML605Handle::ReleasePages(int num_pages) {
+  if ((rx_ring_ == NULL) || (num_pages < 0) ||
+      (static_cast<unsigned long long>(num_pages) > rx_ring_outstanding_)) {
+    printf("ReleasePages: invalid page count %d\n", num_pages);
+    return -EINVAL;
+  }
+
+  // finish reading the pages before the driver may reuse them
+  __sync_synchronize();
+  rx_ring_->consumer += num_pages;
+  rx_ring_outstanding_ -= num_pages;
+
+  return 0;
+}
+
+int ML605Handle::QueryRxBuf() {
+  int num_rx_buf_len;   // available length
+  ML605Status status;
+
+  if (status_page_ != NULL) {
+    ReadStatus(&status);
+    return status.rx_bytes;
+  }
+
+  if (ioctl(rawdatafd_, RD_CMD_QUERY_RX_BUF, &num_rx_buf_len) != 0) {
+    printf("ML605QueryRxBuf failed: errno=%d\n", errno);
+    return -errno;
+  }
+
+  return num_rx_buf_len;
+}
+
+int ML605Handle::GetHwCounterMs() {
   int num_ms;
-  int retval = -EFAULT;
-  int ioctl_retval;
-  int busy_counter = 0;
+  ML605Status status;
 
-  if (fd != rawdatafd) {
-    printf("Get HW counter: wrong fd\n");
-    return -EBADF;
+  if (status_page_ != NULL) {
+    ReadStatus(&status);
+    return status.timing_status >> 16;
   }
-  
-  while (busy_counter < kTimeOut) {
-    ioctl_retval = ioctl(fd, RD_CMD_GET_COUNTER, &num_ms);
-    if (ioctl_retval == 0) {
-      retval = num_ms >> 16;    // operation successfully, return
-      break;
-    } else if (errno == EBUSY) {
-      ++busy_counter;        // device busy, try again. Return if busy counter hits.
-      if (busy_counter >= kTimeOut) {
-        retval = -errno;
-        printf("ML605GetHwCounterMs failed: device is busy\n");
-      }
-    } else {
-      retval = -errno;    // Other errors, return
-      printf("ML605GetHwCounterMs failed: errno=%d\n", errno);
-      break;
-    }
-    usleep(kSleepUs);
-  }  
 
-  return retval;
+  if (ioctl(rawdatafd_, RD_CMD_GET_COUNTER, &num_ms) != 0) {
+    printf("ML605GetHwCounterMs failed: errno=%d\n", errno);
+    return -errno;
+  }
+
+  return num_ms >> 16;
 }
 
-int ML605GetHwCounters(int fd, int *ptr_counter_ms, int *ptr_counter_50mhz) {
+int ML605Handle::GetHwCounters(int *ptr_counter_ms, int *ptr_counter_50mhz) {
   int num_ms;
-  int retval = -EFAULT;
-  int busy_counter = 0;
-  int ioctl_retval;
+  ML605Status status;
+
+  if (status_page_ != NULL) {
+    ReadStatus(&status);
+    num_ms = status.timing_status;
+  } else if (ioctl(rawdatafd_, RD_CMD_GET_COUNTER, &num_ms) != 0) {
+    printf("ML605GetHwCounters failed: errno=%d\n", errno);
+    return -errno;
+  }
 
-  if (fd != rawdatafd) {
-    printf("Get HW counter: wrong fd\n");
-    return -EBADF;
+  *ptr_counter_ms = num_ms >> 16;
+  *ptr_counter_50mhz = num_ms & 0x0000FFFF;
+  return 0;
+}
+
+int ML605Handle::SetRfCmd(int rf_cmd) {
+  if (ioctl(rawdatafd_, RD_CMD_SET_RF_CMD, &rf_cmd) != 0) {
+    printf("ML605SetRfCmd (0x%x) failed: errno=%d\n", rf_cmd, errno);
+    return -errno;
   }
 
-  while (busy_counter < kTimeOut) {
-    ioctl_retval = ioctl(fd, RD_CMD_GET_COUNTER, &num_ms);
-    if (ioctl_retval == 0) {
-      *ptr_counter_ms = num_ms >> 16;
-      *ptr_counter_50mhz = num_ms & 0x0000FFFF;
-      retval = 0;    // operation successfully, return
-      break;
-    } else if (errno == EBUSY) {
-      ++busy_counter;        // device busy, try again. Return if busy counter hits.
-      if (busy_counter >= kTimeOut) {
-        retval = -errno;
-        printf("ML605GetHwCounters failed: device is busy\n");
-      }
-    } else {
-      retval = -errno;    // Other errors, return
-      printf("ML605GetHwCounters failed: errno=%d\n", errno);
-      break;
+  return 0;
+}
+
+int ML605Handle::SetRfCmdAsync(int rf_cmd) {
+  if (ioctl(rawdatafd_, RD_CMD_SET_RF_CMD_ASYNC, &rf_cmd) != 0) {
+    // A full FIFO is left to the caller, no message
+    if (errno != EAGAIN) {
+      printf("ML605SetRfCmdAsync (0x%x) failed: errno=%d\n", rf_cmd, errno);
     }
-    usleep(kSleepUs);
-  }  
+    return -errno;
+  }
 
-  return retval;
+  return 0;
 }
 
-int ML605SetRfCmd(int fd, int rf_cmd) {
-  int retval = -EFAULT;  
-  int busy_counter = 0;
-  int ioctl_retval;
-  
-  if (fd != rawdatafd) {
-    printf("Set RF command: wrong fd\n");
-    return -EBADF;
+int ML605Handle::RfCmdFence() {
+  while (ioctl(rawdatafd_, RD_CMD_RF_FENCE) != 0) {
+    if (errno != EINTR) {
+      printf("ML605RfCmdFence failed: errno=%d\n", errno);
+      return -errno;
+    }
   }
 
-  while (busy_counter < kTimeOut) {
-    ioctl_retval = ioctl(fd, RD_CMD_SET_RF_CMD, &rf_cmd);
-    if (ioctl_retval == 0) {
-      retval = 0;    // operation successfully, return
-      break;
-    } else if (errno == EBUSY) {
-      ++busy_counter;        // device busy, try again. Return if busy counter hits.
-      if (busy_counter >= kTimeOut) {
-        retval = -errno;
-        printf("ML605SetRfCmd (0x%x) failed: device is busy\n", rf_cmd);
-      }
-    } else {
-      retval = -errno;    // Other errors, return
-      printf("ML605SetRfCmd (0x%x) failed: errno=%d\n", rf_cmd, errno);
-      break;
+  return 0;
+}
+
+int ML605Handle::GetStats(ML605Stats *stats) {
+  if (ioctl(rawdatafd_, RD_CMD_GET_STATS, stats) != 0) {
+    printf("ML605GetStats failed: errno=%d\n", errno);
+    return -errno;
+  }
+
+  return 0;
+}
+
+// Ops that fail are left to the caller, in their result field
+int ML605Handle::Batch(ML605CtlOp *ops, int num_ops) {
+  ML605CtlBatch batch;
+
+  if ((num_ops <= 0) || (num_ops > ML605_MAX_BATCH)) {
+    printf("ML605Batch: Invalid op count %d. Must be 1 to %d.\n", num_ops, ML605_MAX_BATCH);
+    return -EINVAL;
+  }
+
+  batch.ops = reinterpret_cast<unsigned long>(ops);
+  batch.num_ops = num_ops;
+  batch.done = 0;
+  if (ioctl(rawdatafd_, RD_CMD_BATCH, &batch) != 0) {
+    printf("ML605Batch failed: errno=%d\n", errno);
+    return -errno;
+  }
+
+  return 0;
+}
+
+int ML605Handle::SetRxLossy(bool lossy) {
+  int val = lossy ? 1 : 0;
+
+  if (ioctl(rawdatafd_, RD_CMD_SET_RX_LOSSY, &val) != 0) {
+    printf("ML605SetRxLossy (%d) failed: errno=%d\n", val, errno);
+    return -errno;
+  }
+
+  return 0;
+}
+
+// Handle of the board opened on fd, or NULL
+static ML605Handle *FindHandle(int fd, const char *caller) {
+  int i;
+
+  for (i = 0; i < ML605_MAX_HANDLES; ++i) {
+    if ((board_handles[i] != NULL) && (board_handles[i]->fd() == fd)) {
+      return board_handles[i];
     }
-    usleep(kSleepUs);
-  }  
-  
+  }
+  printf("%s: wrong fd\n", caller);
+  return NULL;
+}
+
+ML605Handle *ML605OpenBoard(int board) {
+  return ML605OpenStream(board, 0);
+}
+
+ML605Handle *ML605OpenStream(int board, int stream) {
+  if ((board < 0) || (board >= ML605_MAX_BOARDS) ||
+      (stream < 0) || (stream > ML605_XAUI_STREAM)) {
+    printf("ML605OpenStream: invalid board %d stream %d\n", board, stream);
+    return NULL;
+  }
+  int index = HandleIndex(board, stream);
+  if (board_handles[index] != NULL) {
+    printf("ML605OpenStream: board %d stream %d already open\n", board, stream);
+    return NULL;
+  }
+
+  void *ptr = malloc(sizeof(ML605Handle));
+  if (ptr == NULL) {
+    return NULL;
+  }
+  ML605Handle *handle = new (ptr) ML605Handle();
+  if (handle->Open(board, stream) < 0) {
+    free(ptr);
+    return NULL;
+  }
+  board_handles[index] = handle;
+  return handle;
+}
+
+int ML605CloseBoard(ML605Handle *handle) {
+  int retval;
+
+  if ((handle == NULL) || (handle->board() < 0) ||
+      (board_handles[HandleIndex(handle->board(), handle->stream())] != handle)) {
+    printf("ML605CloseBoard: unknown handle\n");
+    return -EBADF;
+  }
+
+  board_handles[HandleIndex(handle->board(), handle->stream())] = NULL;
+  retval = handle->Close();
+  handle->~ML605Handle();
+  free(handle);
   return retval;
 }
+
+int ML605HandleFd(const ML605Handle *handle) {
+  return (handle != NULL) ? handle->fd() : -EBADF;
+}
+
+int ML605Open() {
+  ML605Handle *handle = ML605OpenBoard(0);
+  return (handle != NULL) ? handle->fd() : -ENODEV;
+}
+
+int ML605Close(int fd) {
+  ML605Handle *handle = FindHandle(fd, "Close");
+  return (handle != NULL) ? ML605CloseBoard(handle) : -EBADF;
+}
+
+int ML605StartEthernet(int fd, int flag) {
+  ML605Handle *handle = FindHandle(fd, "Start Ethernet");
+  return (handle != NULL) ? handle->StartEthernet(flag) : -EBADF;
+}
+
+int ML605Send(int fd, const void *buf, unsigned int len) {
+  ML605Handle *handle = FindHandle(fd, "Send");
+  return (handle != NULL) ? handle->Send(buf, len) : -EBADF;
+}
+
+int ML605SendZeroCopy(int fd, const void *buf, unsigned int len, unsigned long long *done_mark) {
+  ML605Handle *handle = FindHandle(fd, "SendZeroCopy");
+  return (handle != NULL) ? handle->SendZeroCopy(buf, len, done_mark) : -EBADF;
+}
+
+int ML605WaitTxDone(int fd, unsigned long long done_mark) {
+  ML605Handle *handle = FindHandle(fd, "WaitTxDone");
+  return (handle != NULL) ? handle->WaitTxDone(done_mark) : -EBADF;
+}
+
+int ML605Recv(int fd, void *buf, unsigned int len) {
+  ML605Handle *handle = FindHandle(fd, "Recv");
+  return (handle != NULL) ? handle->Recv(buf, len) : -EBADF;
+}
+
+int ML605RecvTimeout(int fd, void *buf, unsigned int len, long timeout_us) {
+  ML605Handle *handle = FindHandle(fd, "Recv");
+  return (handle != NULL) ? handle->RecvTimeout(buf, len, timeout_us) : -EBADF;
+}
+
+int ML605RecvWithTimestamp(int fd, void *buf, unsigned int len, unsigned int *timestamp) {
+  ML605Handle *handle = FindHandle(fd, "Recv");
+  return (handle != NULL) ? handle->RecvWithTimestamp(buf, len, timestamp) : -EBADF;
+}
+
+int ML605SetFrameLen(int fd, unsigned int frame_len) {
+  ML605Handle *handle = FindHandle(fd, "Set frame length");
+  return (handle != NULL) ? handle->SetFrameLen(frame_len) : -EBADF;
+}
+
+int ML605RecvFrame(int fd, void *buf, unsigned int len, long timeout_us) {
+  ML605Handle *handle = FindHandle(fd, "Recv frame");
+  return (handle != NULL) ? handle->RecvFrame(buf, len, timeout_us) : -EBADF;
+}
+
+int ML605RecvZeroCopy(int fd, unsigned char **pages, unsigned int *lens, int max_pages) {
+  ML605Handle *handle = FindHandle(fd, "RecvZeroCopy");
+  return (handle != NULL) ? handle->RecvZeroCopy(pages, lens, max_pages) : -EBADF;
+}
+
+int ML605ReleasePages(int fd, int num_pages) {
+  ML605Handle *handle = FindHandle(fd, "ReleasePages");
+  return (handle != NULL) ? handle->ReleasePages(num_pages) : -EBADF;
+}
+
+int ML605QueryTxBuf(int fd) {
+  ML605Handle *handle = FindHandle(fd, "Query Tx Buf");
+  return (handle != NULL) ? handle->QueryTxBuf() : -EBADF;
+}
+
+int ML605QueryRxBuf(int fd) {
+  ML605Handle *handle = FindHandle(fd, "Query Rx Buf");
+  return (handle != NULL) ? handle->QueryRxBuf() : -EBADF;
+}
+
+int ML605GetHwCounterMs(int fd) {
+  ML605Handle *handle = FindHandle(fd, "Get HW counter");
+  return (handle != NULL) ? handle->GetHwCounterMs() : -EBADF;
+}
+
+int ML605GetHwCounters(int fd, int *ptr_counter_ms, int *ptr_counter_50mhz) {
+  ML605Handle *handle = FindHandle(fd, "Get HW counter");
+  return (handle != NULL) ? handle->GetHwCounters(ptr_counter_ms, ptr_counter_50mhz) : -EBADF;
+}
+
+int ML605SetRfCmd(int fd, int rf_cmd) {
+  ML605Handle *handle = FindHandle(fd, "Set RF command");
+  return (handle != NULL) ? handle->SetRfCmd(rf_cmd) : -EBADF;
+}
+
+int ML605SetRfCmdAsync(int fd, int rf_cmd) {
+  ML605Handle *handle = FindHandle(fd, "Set RF command");
+  return (handle != NULL) ? handle->SetRfCmdAsync(rf_cmd) : -EBADF;
+}
+
+int ML605RfCmdFence(int fd) {
+  ML605Handle *handle = FindHandle(fd, "RF command fence");
+  return (handle != NULL) ? handle->RfCmdFence() : -EBADF;
+}
+
+int ML605SetRxLossy(int fd, int lossy) {
+  ML605Handle *handle = FindHandle(fd, "Set Rx lossy");
+  return (handle != NULL) ? handle->SetRxLossy(lossy != 0) : -EBADF;
+}
+
+int ML605GetStatus(int fd, ML605Status *status) {
+  ML605Handle *handle = FindHandle(fd, "Get status");
+  return (handle != NULL) ? handle->GetStatus(status) : -EBADF;
+}
+
+int ML605GetStats(int fd, ML605Stats *stats) {
+  ML605Handle *handle = FindHandle(fd, "Get stats");
+  return (handle != NULL) ? handle->GetStats(stats) : -EBADF;
+}
+
+int ML605Batch(int fd, ML605CtlOp *ops, int num_ops) {
+  ML605Handle *handle = FindHandle(fd, "Batch");
+  return (handle != NULL) ? handle->Batch(ops, num_ops) : -EBADF;
+}
@@ -2,27 +2,269 @@
 #define ML605_API_H
 
 #define ML605_MAGIC 'M'     /**< Magic number for use in IOCTLs */
-#define ML605_MAX_CMD 4     /**< Total number of IOCTLs */
+#define ML605_MAX_CMD 13    /**< Total number of IOCTLs */
 
 // RD means raw data
 #define RD_CMD_QUERY_TX_BUF   _IOR(ML605_MAGIC, 1, int)
 #define RD_CMD_QUERY_RX_BUF   _IOR(ML605_MAGIC, 2, int)
 #define RD_CMD_GET_COUNTER    _IOR(ML605_MAGIC, 3, int)
 #define RD_CMD_SET_RF_CMD     _IOW(ML605_MAGIC, 4, int)
+#define RD_CMD_SET_RX_LOSSY   _IOW(ML605_MAGIC, 5, int)
+#define RD_CMD_GET_STATS      _IOR(ML605_MAGIC, 6, ML605Stats)
+#define RD_CMD_SET_FRAME_LEN  _IOW(ML605_MAGIC, 7, int)
+#define RD_CMD_GET_READ_STAMP _IOR(ML605_MAGIC, 8, int)
+#define RD_CMD_TX_ZERO_COPY   _IOWR(ML605_MAGIC, 9, ML605TxZeroCopy)
+#define RD_CMD_WAIT_TX_DONE   _IOWR(ML605_MAGIC, 10, unsigned long long)    // blocks
+#define RD_CMD_BATCH          _IOWR(ML605_MAGIC, 11, ML605CtlBatch)
+#define RD_CMD_SET_RF_CMD_ASYNC _IOW(ML605_MAGIC, 12, int)
+#define RD_CMD_RF_FENCE       _IO(ML605_MAGIC, 13)
+
+// Largest single transfer accepted by ML605Send/ML605Recv and by one
+// read()/write() on the raw data device
+#define ML605_MAX_XFER_LEN (1024*1024)
 
 // PCIE SFP start flag
 #define SFP_TX_START 0
 #define SFP_RX_START 1
 
-int ML605Open(void);
+// Zero-copy Rx ring, mapped with mmap() on the raw data device.
+// The mapping starts with the control area below, followed by the Rx pages
+// at data_offset. Rx page i lives at (base + data_offset + i*page_size).
+// An Rx "page" is one DMA buffer; with the driver's buf_pages parameter
+// above 1 it is several system pages long.
+// producer/consumer are free-running counters of filled pages; the slot of
+// counter c is (c % num_pages), and desc[slot] tells which Rx page was
+// filled and with how many bytes. The driver advances producer, the API
+// advances consumer to give pages back to DMA.
+#define ML605_RX_RING_MMAP_OFFSET 0
+
+// timestamp is the HW counter (ms << 16 | 50 MHz count, as in
+// ML605GetHwCounters) sampled when DMA handed the page over.
+typedef struct {
+  unsigned int page;                      // Rx page holding the data
+  unsigned int len;                       // valid bytes in that page
+  unsigned int timestamp;                 // HW counter at completion
+} ML605RxDesc;
+
+typedef struct {
+  volatile unsigned long long producer;   // pages completed by DMA
+  volatile unsigned long long consumer;   // pages released by user
+  unsigned int num_pages;                 // number of Rx pages in the ring
+  unsigned int page_size;                 // size of each Rx page
+  unsigned int data_offset;               // offset of Rx page 0 in mapping
+  unsigned int map_size;                  // total size to mmap()
+  volatile ML605RxDesc desc[];            // filled pages, one per slot
+} ML605RxRing;
+
+// Status page, mapped read-only with mmap() on the raw data device.
+// The driver refreshes it every 100 us. seq is odd while an update is in
+// progress; a reader copies the fields and retries unless it saw the same
+// even seq before and after.
+#define ML605_STATUS_MMAP_OFFSET 0x40000000
+
+typedef struct {
+  volatile unsigned int seq;              // update sequence count
+  volatile unsigned int timing_status;    // HW counter: ms << 16 | 50 MHz count
+  volatile unsigned int tx_free_bytes;    // free Tx buffer space
+  volatile unsigned int rx_bytes;         // received, not yet passed by every reader
+  volatile unsigned int tx_seq_no;        // Tx sequence number
+  volatile unsigned int rx_seq_no;        // Rx sequence number
+} ML605Status;
+
+// Buffer accounting of one direction, since the driver was loaded or the
+// last test was started. Also in /sys/kernel/debug/ml605_raw_data/boardn.
+typedef struct {
+  unsigned long long bufs;                // buffers completed by DMA
+  unsigned long long bytes;               // bytes in them
+  unsigned long long drops;               // tx: not sent, rx: skipped by lossy readers
+  unsigned long long ring_full;           // times no free buffer was left
+  unsigned long long starved_us;          // time spent with no free buffer
+  unsigned int high_water;                // most buffers in use at once
+  unsigned int num_bufs;                  // buffers in all
+} ML605DirStats;
+
+typedef struct {
+  ML605DirStats tx;
+  ML605DirStats rx;
+  unsigned long long errors;              // rx data check failures
+} ML605Stats;
+
+// Zero-copy Tx request. The driver sends straight from the pages of the
+// user buffer, which must stay untouched until the Tx done count (bytes of
+// zero-copy Tx given back by DMA, free-running) reaches done_mark.
+typedef struct {
+  unsigned long long addr;                // in: user buffer, page aligned
+  unsigned int len;                       // in: multiple of 4096, out: bytes queued
+  unsigned int reserved;
+  unsigned long long done_mark;           // out: Tx done count when sent
+} ML605TxZeroCopy;
+
+// One operation of RD_CMD_BATCH. cmd is one of the int valued commands
+// above: RD_CMD_QUERY_TX_BUF, _QUERY_RX_BUF, _GET_COUNTER, _SET_RF_CMD,
+// _SET_RF_CMD_ASYNC, _RF_FENCE, _SET_RX_LOSSY, _GET_READ_STAMP or
+// _SET_FRAME_LEN. val is the value set,
+// or the value returned; result is 0 or -errno.
+typedef struct {
+  unsigned int cmd;
+  int val;
+  int result;
+} ML605CtlOp;
+
+// Runs num_ops ops at ops, in order, in one system call
+#define ML605_MAX_BATCH 16
+typedef struct {
+  unsigned long long ops;                 // in: ML605CtlOp array
+  unsigned int num_ops;                   // in: at most ML605_MAX_BATCH
+  unsigned int done;                      // out: ops run
+} ML605CtlBatch;
+
+// Boards are numbered in xdma probe order. Board 0 is /dev/ml605_raw_data,
+// board n is /dev/ml605_raw_datan. Only board 0 has /dev/xdma_stat.
+#define ML605_MAX_BOARDS 4
+// With the driver loaded with rx_streams > 1, Rx stream s > 0 of board n
+// comes from its own C2S engine into its own device, /dev/ml605_raw_datan_s
+// (minor s * ML605_MAX_BOARDS + n), with its own ring and readers. Stream 0
+// is the board device above. Sends and RF commands on any stream go to
+// the board.
+#define ML605_MAX_STREAMS 4
+// With the driver loaded with xaui=1, the XAUI engine pair of board n is
+// /dev/ml605_xaui_datan (minor ML605_XAUI_STREAM * ML605_MAX_BOARDS + n).
+// Open it as stream ML605_XAUI_STREAM. It sends and receives on its own
+// engines, next to the raw data path. The XAUI registers overlap the HW
+// counter and RF control, so with xaui=1 no device has a HW counter or RF
+// commands: those calls fail with EINVAL.
+#define ML605_XAUI_STREAM ML605_MAX_STREAMS
+
+#ifdef __cplusplus
+// One open board: its device fds and the mappings made on them. The
+// destructor closes it. A handle can be moved but not copied.
+class ML605Handle {
+ public:
+  ML605Handle() noexcept;
+  explicit ML605Handle(int board);    // check IsOpen() afterwards
+  ML605Handle(ML605Handle &&other) noexcept;
+  ML605Handle &operator=(ML605Handle &&other);
+  // Not noexcept: close() is a thread cancellation point
+  ~ML605Handle() noexcept(false);
+
+  int Open(int board, int stream = 0);
+  int Close();
+  bool IsOpen() const noexcept { return rawdatafd_ >= 0; }
+  int board() const noexcept { return board_; }
+  int stream() const noexcept { return stream_; }
+  int fd() const noexcept { return rawdatafd_; }
+
+  int Send(const void *buf, unsigned int len);
+  int SendZeroCopy(const void *buf, unsigned int len, unsigned long long *done_mark);
+  int WaitTxDone(unsigned long long done_mark);
+  int Recv(void *buf, unsigned int len);
+  int RecvTimeout(void *buf, unsigned int len, long timeout_us);
+  int RecvWithTimestamp(void *buf, unsigned int len, unsigned int *timestamp);
+  int RecvFrame(void *buf, unsigned int len, long timeout_us);
+  int SetFrameLen(unsigned int frame_len);
+  int RecvZeroCopy(unsigned char **pages, unsigned int *lens, int max_pages);
+  int ReleasePages(int num_pages);
+  int QueryTxBuf();
+  int QueryRxBuf();
+  int StartEthernet(int flag);
+  int GetHwCounterMs();
+  int GetHwCounters(int *ptr_counter_ms, int *ptr_counter_50mhz);
+  int SetRfCmd(int rf_cmd);
+  int SetRfCmdAsync(int rf_cmd);
+  int RfCmdFence();
+  int SetRxLossy(bool lossy);
+  int GetStatus(ML605Status *status);
+  int GetStats(ML605Stats *stats);
+  int Batch(ML605CtlOp *ops, int num_ops);
+
+ private:
+  ML605Handle(const ML605Handle &) = delete;
+  ML605Handle &operator=(const ML605Handle &) = delete;
+
+  void Reset() noexcept;
+  void Take(ML605Handle &other) noexcept;
+  int WaitRawData(short events, long remain_us);
+  int RecvStamped(void *buf, unsigned int len, long timeout_us,
+                  unsigned int *timestamp);
+  int MapRxRing();
+  void ReadStatus(ML605Status *status);
+
+  int board_;
+  int stream_;
+  int rawdatafd_;                     // raw data device
+  int xdmadatafd_;                    // xdma status device, board 0 only
+  ML605RxRing *rx_ring_;              // zero-copy Rx ring, mapped on demand
+  unsigned long rx_ring_size_;
+  unsigned long long rx_ring_outstanding_;  // pages handed out, not released
+  const ML605Status *status_page_;    // NULL if the driver has none
+};
+
+extern "C" {
+#else
+typedef struct ML605Handle ML605Handle;
+#endif
+
+// fd based API. The fd is that of a board opened with ML605Open or
+// ML605OpenBoard.
+int ML605Open(void);                  // opens board 0
 int ML605Close(int fd);
 int ML605Send(int fd, const void *buf, unsigned int len);
+// Like ML605Send, but DMA reads buf in place instead of a copy of it. buf
+// must be page aligned. It may be reused once ML605WaitTxDone(done_mark)
+// has returned.
+int ML605SendZeroCopy(int fd, const void *buf, unsigned int len, unsigned long long *done_mark);
+int ML605WaitTxDone(int fd, unsigned long long done_mark);
 int ML605Recv(int fd, void *buf, unsigned int len);
+// Like ML605Recv, but sleeps in poll() instead of spinning. Returns the
+// bytes received, which is less than len if timeout_us expired first.
+// A negative timeout_us waits forever.
+int ML605RecvTimeout(int fd, void *buf, unsigned int len, long timeout_us);
+// Like ML605Recv. *timestamp is the HW counter (ms << 16 | 50 MHz count)
+// of when DMA completed the page holding the first byte of buf.
+int ML605RecvWithTimestamp(int fd, void *buf, unsigned int len, unsigned int *timestamp);
+// Framed read mode. With a frame length set, the driver hunts for the
+// aaa0aaa0/a0aaa0aa sync word and each read() returns exactly one whole
+// frame of frame_len bytes starting with it; data between frames is
+// dropped. 0 goes back to plain reads. Does not apply to the zero-copy ring.
+int ML605SetFrameLen(int fd, unsigned int frame_len);
+// One frame into buf, which must hold the frame length. Returns the frame
+// length, or 0 if timeout_us expired first. A negative timeout_us waits
+// forever.
+int ML605RecvFrame(int fd, void *buf, unsigned int len, long timeout_us);
+int ML605RecvZeroCopy(int fd, unsigned char **pages, unsigned int *lens, int max_pages);
+int ML605ReleasePages(int fd, int num_pages);
 int ML605QueryTxBuf(int fd);
 int ML605QueryRxBuf(int fd);
 int ML605StartEthernet(int fd, int flag);
 int ML605GetHwCounterMs(int fd);
 int ML605GetHwCounters(int fd, int *ptr_counter_ms, int *ptr_counter_50mhz);
 int ML605SetRfCmd(int fd, int rf_cmd);
+// RF commands are sent one at a time from a FIFO in the driver, in the
+// order they were given. ML605SetRfCmd waits until its command is out;
+// ML605SetRfCmdAsync only queues it, and returns -EAGAIN if the FIFO is
+// full. ML605RfCmdFence waits until every command queued so far is out.
+int ML605SetRfCmdAsync(int fd, int rf_cmd);
+int ML605RfCmdFence(int fd);
+// Each open of a board reads the whole Rx stream on its own. A lossy open
+// (lossy != 0) keeps up like any other, but once the driver runs out of
+// Rx buffers it no longer holds them back between reads; if it falls
+// behind, it skips to the oldest page still held.
+int ML605SetRxLossy(int fd, int lossy);
+int ML605GetStatus(int fd, ML605Status *status);
+int ML605GetStats(int fd, ML605Stats *stats);
+// Runs several control operations in one call, see ML605CtlOp. Returns 0
+// once all ran; each op has its own result.
+int ML605Batch(int fd, ML605CtlOp *ops, int num_ops);
+
+// Handle shim for C callers. Each board and stream has one handle owned by
+// the API; ML605HandleFd gives the fd to use with the functions above.
+ML605Handle *ML605OpenBoard(int board);
+ML605Handle *ML605OpenStream(int board, int stream);
+int ML605CloseBoard(ML605Handle *handle);
+int ML605HandleFd(const ML605Handle *handle);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif    // ML605_API_H
@@ -7,6 +7,8 @@
 #include <unistd.h>
 #include <math.h>
 #include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <errno.h>
 
 #include "ml605_api.h"
 
@@ -635,6 +637,357 @@ void RdCounterTest() {
   return;
 }
 
+// Checks of the driver features below return 0 when the driver behaves
+// as documented in ml605_api.h, and 1 on a mismatch. main() runs them all
+// and exits non-zero if any failed.
+
+// A lossy reader that keeps up must see the whole stream: with no other
+// reader it is never skipped ahead, so rx.drops does not move.
+int LossyReadTest() {
+  ML605Stats before, after;
+  int retval;
+
+  if ((retval = ML605SetRxLossy(fd605, 1)) < 0) {
+    printf("LossyReadTest: set lossy failed. Return %d\n", retval);
+    return 1;
+  }
+  if ((retval = ML605GetStats(fd605, &before)) < 0) {
+    printf("LossyReadTest: get stats failed. Return %d\n", retval);
+    ML605SetRxLossy(fd605, 0);
+    return 1;
+  }
+
+  for (int i = 0; i < 1000; ++i) {
+    if ((retval = ML605Recv(fd605, readbackBuf, kTestLen)) < kTestLen) {
+      printf("LossyReadTest: recv %d failed. Return %d\n", i, retval);
+      ML605SetRxLossy(fd605, 0);
+      return 1;
+    }
+  }
+
+  retval = ML605GetStats(fd605, &after);
+  ML605SetRxLossy(fd605, 0);
+  if (retval < 0) {
+    printf("LossyReadTest: get stats failed. Return %d\n", retval);
+    return 1;
+  }
+
+  if (after.rx.drops != before.rx.drops) {
+    printf("LossyReadTest: lossy read dropped %llu pages\n", after.rx.drops - before.rx.drops);
+    return 1;
+  }
+  printf("LossyReadTest: passed\n");
+  return 0;
+}
+
+// In framed mode every read() is one whole frame that starts with the
+// aaa0aaa0 or a0aaa0aa sync word, in stream byte order.
+static const int kFrameLen = 4096;
+static const int kFrameCount = 100;
+
+int FrameSyncTest() {
+  static unsigned char frame[kFrameLen];
+  int retval;
+  int failed = 0;
+
+  if ((retval = ML605SetFrameLen(fd605, kFrameLen)) < 0) {
+    printf("FrameSyncTest: set frame length failed. Return %d\n", retval);
+    return 1;
+  }
+
+  for (int i = 0; i < kFrameCount && !failed; ++i) {
+    if ((retval = ML605RecvFrame(fd605, frame, kFrameLen, 1000000L)) != kFrameLen) {
+      printf("FrameSyncTest: frame %d returned %d, expected %d\n", i, retval, kFrameLen);
+      failed = 1;
+    } else if (!((frame[0] == 0xaa && frame[1] == 0xa0 && frame[2] == 0xaa && frame[3] == 0xa0) ||
+                 (frame[0] == 0xa0 && frame[1] == 0xaa && frame[2] == 0xa0 && frame[3] == 0xaa))) {
+      printf("FrameSyncTest: frame %d starts with %02x%02x%02x%02x, not a sync word\n",
+             i, frame[0], frame[1], frame[2], frame[3]);
+      failed = 1;
+    }
+  }
+
+  if ((retval = ML605SetFrameLen(fd605, 0)) < 0) {
+    printf("FrameSyncTest: clear frame length failed. Return %d\n", retval);
+    failed = 1;
+  }
+  if (!failed) {
+    printf("FrameSyncTest: passed\n");
+  }
+  return failed;
+}
+
+// Zero-copy Tx: each send moves the done mark on by the bytes queued, and
+// once ML605WaitTxDone returns, the driver's Tx done count has reached it.
+static const int kZcLen = 4*4096;
+
+int ZeroCopyTxTest() {
+  unsigned long long mark, mark2, done;
+  void *ptr;
+  unsigned char *zc_buf;
+  int retval;
+  int failed = 0;
+
+  if (posix_memalign(&ptr, 4096, kZcLen) != 0) {
+    printf("ZeroCopyTxTest: no memory\n");
+    return 1;
+  }
+  zc_buf = static_cast<unsigned char*>(ptr);
+  for (int i = 0; i < kZcLen; ++i) {
+    zc_buf[i] = i;
+  }
+
+  if ((retval = ML605SendZeroCopy(fd605, zc_buf + 1, 4096, &mark)) != -EINVAL) {
+    printf("ZeroCopyTxTest: unaligned buffer returned %d, expected %d\n", retval, -EINVAL);
+    failed = 1;
+  }
+
+  if (!failed && (retval = ML605SendZeroCopy(fd605, zc_buf, kZcLen, &mark)) != kZcLen) {
+    printf("ZeroCopyTxTest: first send returned %d, expected %d\n", retval, kZcLen);
+    failed = 1;
+  }
+  if (!failed && (retval = ML605WaitTxDone(fd605, mark)) < 0) {
+    printf("ZeroCopyTxTest: wait for %llu failed. Return %d\n", mark, retval);
+    failed = 1;
+  }
+  if (!failed && (retval = ML605SendZeroCopy(fd605, zc_buf, kZcLen, &mark2)) != kZcLen) {
+    printf("ZeroCopyTxTest: second send returned %d, expected %d\n", retval, kZcLen);
+    failed = 1;
+  }
+  if (!failed && mark2 != mark + kZcLen) {
+    printf("ZeroCopyTxTest: done mark %llu after %llu, expected %llu\n", mark2, mark, mark + kZcLen);
+    failed = 1;
+  }
+  if (!failed && (retval = ML605WaitTxDone(fd605, mark2)) < 0) {
+    printf("ZeroCopyTxTest: wait for %llu failed. Return %d\n", mark2, retval);
+    failed = 1;
+  }
+
+  // A mark of 0 returns the done count at once
+  done = 0;
+  if (!failed && ioctl(fd605, RD_CMD_WAIT_TX_DONE, &done) != 0) {
+    printf("ZeroCopyTxTest: reading the done count failed: errno=%d\n", errno);
+    failed = 1;
+  }
+  if (!failed && done < mark2) {
+    printf("ZeroCopyTxTest: done count %llu short of %llu after wait\n", done, mark2);
+    failed = 1;
+  }
+
+  free(zc_buf);
+  if (!failed) {
+    printf("ZeroCopyTxTest: passed\n");
+  }
+  return failed;
+}
+
+// RD_CMD_BATCH runs every op, in order, each with its own result. An op
+// that fails does not stop the ones after it.
+int BatchTest() {
+  ML605CtlOp ops[5];
+  int tx_free;
+  int retval;
+  int failed = 0;
+
+  ops[0].cmd = RD_CMD_QUERY_TX_BUF;
+  ops[1].cmd = RD_CMD_QUERY_RX_BUF;
+  ops[2].cmd = RD_CMD_GET_STATS;        // not an int op
+  ops[3].cmd = RD_CMD_SET_RX_LOSSY;
+  ops[4].cmd = RD_CMD_GET_READ_STAMP;
+  for (int i = 0; i < 5; ++i) {
+    ops[i].val = 0;
+    ops[i].result = 1;
+  }
+
+  if ((retval = ML605Batch(fd605, ops, 5)) < 0) {
+    printf("BatchTest: batch failed. Return %d\n", retval);
+    return 1;
+  }
+  for (int i = 0; i < 5; ++i) {
+    int expected = (i == 2) ? -ENOTTY : 0;
+    if (ops[i].result != expected) {
+      printf("BatchTest: op %d result %d, expected %d\n", i, ops[i].result, expected);
+      failed = 1;
+    }
+  }
+
+  // Nothing is being sent, so the Tx space does not move in between.
+  // Asked with the ioctl itself, the status page may lag.
+  if (ioctl(fd605, RD_CMD_QUERY_TX_BUF, &tx_free) != 0) {
+    printf("BatchTest: query Tx failed: errno=%d\n", errno);
+    failed = 1;
+  } else if (ops[0].val != tx_free) {
+    printf("BatchTest: batched Tx query %d, single %d\n", ops[0].val, tx_free);
+    failed = 1;
+  }
+  if ((ops[0].val <= 0) || (ops[1].val < 0)) {
+    printf("BatchTest: Tx free %d, Rx pending %d\n", ops[0].val, ops[1].val);
+    failed = 1;
+  }
+
+  if ((retval = ML605Batch(fd605, ops, ML605_MAX_BATCH + 1)) != -EINVAL) {
+    printf("BatchTest: %d ops returned %d, expected %d\n", ML605_MAX_BATCH + 1, retval, -EINVAL);
+    failed = 1;
+  }
+
+  if (!failed) {
+    printf("BatchTest: passed\n");
+  }
+  return failed;
+}
+
+// RF commands are strobed out one at a time, so a fence after several
+// queued ones cannot return before all but the first strobe have run.
+// The last setup command of main() is queued again, to leave the RF as is.
+#ifdef EAGLE_RF
+static const int kRfFenceCmd = 0x48204920;
+#else
+static const int kRfFenceCmd = 0x48544954;
+#endif
+static const int kRfFenceCmds = 4;
+static const long kRfStrobeUs = 40;   // RF_CMD_STROBE_US in the driver
+
+int RfFenceTest() {
+  struct timeval tv_start, tv_finish;
+  ML605CtlOp ops[2];
+  long elapsed_us;
+  int retval;
+  int failed = 0;
+
+  gettimeofday(&tv_start, NULL);
+  for (int i = 0; i < kRfFenceCmds; ++i) {
+    if ((retval = ML605SetRfCmdAsync(fd605, kRfFenceCmd)) < 0) {
+      printf("RfFenceTest: queueing command %d failed. Return %d\n", i, retval);
+      return 1;
+    }
+  }
+  if ((retval = ML605RfCmdFence(fd605)) < 0) {
+    printf("RfFenceTest: fence failed. Return %d\n", retval);
+    return 1;
+  }
+  gettimeofday(&tv_finish, NULL);
+  elapsed_us = (tv_finish.tv_sec - tv_start.tv_sec) * 1000000L +
+               (tv_finish.tv_usec - tv_start.tv_usec);
+  if (elapsed_us < (kRfFenceCmds - 1) * kRfStrobeUs) {
+    printf("RfFenceTest: fence returned after %ld us, %d commands take at least %ld us\n",
+           elapsed_us, kRfFenceCmds, (kRfFenceCmds - 1) * kRfStrobeUs);
+    failed = 1;
+  }
+
+  // With nothing queued, the fence returns at once
+  if ((retval = ML605RfCmdFence(fd605)) < 0) {
+    printf("RfFenceTest: empty fence failed. Return %d\n", retval);
+    failed = 1;
+  }
+
+  // Also from a batch, queued then fenced in one call
+  ops[0].cmd = RD_CMD_SET_RF_CMD_ASYNC;
+  ops[0].val = kRfFenceCmd;
+  ops[1].cmd = RD_CMD_RF_FENCE;
+  ops[1].val = 0;
+  ops[0].result = ops[1].result = 1;
+  if ((retval = ML605Batch(fd605, ops, 2)) < 0) {
+    printf("RfFenceTest: batch failed. Return %d\n", retval);
+    failed = 1;
+  } else if ((ops[0].result != 0) || (ops[1].result != 0)) {
+    printf("RfFenceTest: batched queue %d, fence %d\n", ops[0].result, ops[1].result);
+    failed = 1;
+  }
+
+  if (!failed) {
+    printf("RfFenceTest: passed\n");
+  }
+  return failed;
+}
+
+// Every Rx stream the driver was loaded with opens on its own device and
+// fd, and sends through the board's Tx, so it sees the same Tx space as
+// stream 0. Streams beyond those do not open.
+#define RX_STREAMS_PARAM "/sys/module/xrawdata_v6/parameters/rx_streams"
+
+int MultiStreamTest() {
+  ML605Handle *handles[ML605_MAX_STREAMS];
+  FILE *param;
+  int rx_streams = 1;
+  int tx_free, stream_tx_free;
+  int fd;
+  int retval;
+  int failed = 0;
+
+  if ((param = fopen(RX_STREAMS_PARAM, "r")) != NULL) {
+    if ((fscanf(param, "%d", &rx_streams) != 1) ||
+        (rx_streams < 1) || (rx_streams > ML605_MAX_STREAMS)) {
+      rx_streams = 1;
+    }
+    fclose(param);
+  }
+  printf("MultiStreamTest: driver has %d Rx stream(s)\n", rx_streams);
+
+  if (ML605OpenStream(0, 0) != NULL) {
+    printf("MultiStreamTest: stream 0 opened twice\n");
+    return 1;
+  }
+  if (ML605OpenStream(0, ML605_XAUI_STREAM + 1) != NULL) {
+    printf("MultiStreamTest: stream %d opened\n", ML605_XAUI_STREAM + 1);
+    return 1;
+  }
+
+  for (int s = 1; s < rx_streams; ++s) {
+    handles[s] = ML605OpenStream(0, s);
+  }
+  for (int s = 1; s < rx_streams; ++s) {
+    if (handles[s] == NULL) {
+      printf("MultiStreamTest: stream %d did not open\n", s);
+      failed = 1;
+      continue;
+    }
+    fd = ML605HandleFd(handles[s]);
+    if (fd == fd605) {
+      printf("MultiStreamTest: stream %d shares fd %d with stream 0\n", s, fd);
+      failed = 1;
+    }
+    for (int t = 1; t < s; ++t) {
+      if ((handles[t] != NULL) && (ML605HandleFd(handles[t]) == fd)) {
+        printf("MultiStreamTest: streams %d and %d share fd %d\n", t, s, fd);
+        failed = 1;
+      }
+    }
+    if ((retval = ML605QueryRxBuf(fd)) < 0) {
+      printf("MultiStreamTest: stream %d Rx query failed. Return %d\n", s, retval);
+      failed = 1;
+    }
+    // Nothing is being sent, so both see the same free Tx space
+    if ((ioctl(fd605, RD_CMD_QUERY_TX_BUF, &tx_free) != 0) ||
+        (ioctl(fd, RD_CMD_QUERY_TX_BUF, &stream_tx_free) != 0)) {
+      printf("MultiStreamTest: stream %d Tx query failed: errno=%d\n", s, errno);
+      failed = 1;
+    } else if (tx_free != stream_tx_free) {
+      printf("MultiStreamTest: stream %d Tx free %d, stream 0 %d\n", s, stream_tx_free, tx_free);
+      failed = 1;
+    }
+  }
+  for (int s = 1; s < rx_streams; ++s) {
+    if ((handles[s] != NULL) && ((retval = ML605CloseBoard(handles[s])) < 0)) {
+      printf("MultiStreamTest: stream %d close failed. Return %d\n", s, retval);
+      failed = 1;
+    }
+  }
+
+  if (rx_streams < ML605_MAX_STREAMS) {
+    ML605Handle *extra = ML605OpenStream(0, rx_streams);
+    if (extra != NULL) {
+      printf("MultiStreamTest: stream %d opened, driver has %d\n", rx_streams, rx_streams);
+      ML605CloseBoard(extra);
+      failed = 1;
+    }
+  }
+
+  if (!failed) {
+    printf("MultiStreamTest: passed\n");
+  }
+  return failed;
+}
+
 void SetRfCmd(int cmd) {
 	ML605SetRfCmd(fd605, cmd);
 }
@@ -857,6 +1210,7 @@ void OfdmTx() {
 
 int main() {
   int retval;
+  int failures;
 
   setpriority(PRIO_PROCESS, 0, -18);
 
@@ -891,6 +1245,26 @@ int main() {
   //SetRfCmd(0x00005818);
   //sleep(1);
 	//SetRfCmd(0x59005900);
+
+  // Checks need Rx running
+  if ((retval = ML605StartEthernet(fd605, SFP_RX_START)) < 0) {
+    printf("Start Rx failed. Return %d\n", retval);
+    ML605Close(fd605);
+    return 1;
+  }
+  failures = 0;
+  failures += LossyReadTest();
+  failures += FrameSyncTest();
+  failures += ZeroCopyTxTest();
+  failures += BatchTest();
+  failures += RfFenceTest();
+  failures += MultiStreamTest();
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    ML605Close(fd605);
+    return 1;
+  }
+
   RdCounterTest();
 //  FileGen();
   RdCounterTest();
@@ -62,6 +62,7 @@ void Dma_Initialize(Dma_Engine *InstancePtr, Xaddr BaseAddress, u32 Type)
     /* Set up the instance */
     log_verbose(KERN_INFO "Clearing DMA instance %p\n", InstancePtr);
     memset(InstancePtr, 0, sizeof(Dma_Engine));
+    spin_lock_init(&InstancePtr->Lock);
 
     log_verbose(KERN_INFO "DMA base address is %p\n", (void*)BaseAddress);
     InstancePtr->RegBase  =  BaseAddress;
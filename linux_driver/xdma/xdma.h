@@ -226,10 +226,22 @@
 * servicing interrupts. Interrupt coalescing can be achieved by the driver
 * enabling BD completion interrupts, not on every BD, but on a set of BDs,
 * thus reducing the frequency of interrupts. The macro INT_COAL_CNT in
-* xdma_hw.h can be used for this purpose.
+* xdma_hw.h gives the initial count. After each interrupt, the count is
+* doubled if interrupts came faster than INT_FAST_US apart, and halved if
+* they came slower than INT_SLOW_US apart, within INT_COAL_MIN and
+* INT_COAL_MAX.
 *
 * In addition, the driver processes outstanding BDs to be processed after an
-* idle timeout with no transactions elapses.
+* idle timeout with no transactions elapses. The timeout is twice the last
+* interval between interrupts, and at most HZ/50.
+*
+* The bottom half handles an interrupt the way NAPI does: it keeps
+* processing the engine's ring, with the engine interrupt still off, until
+* a pass finds no completed BD. Only then is the interrupt re-enabled. If
+* the ring is still busy after INT_POLL_BUDGET passes, the bottom half is
+* rescheduled instead, so one engine cannot hold the CPU. It is also
+* rescheduled when another context, such as DmaReapPkts(), is passing the
+* ring's BDs to the user at the time.
 *
 * <b> Software Initialization </b>
 *
@@ -374,6 +386,10 @@ extern "C" {
 /************************ Include Files *******************************/
 
 #include <linux/timer.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
 
 #include "xdma_bdring.h"
 #include "xdma_user.h"
@@ -397,11 +413,20 @@ extern "C" {
         u32 EngineState;          /**< State of the DMA engine */
         Dma_BdRing BdRing;        /**< BD container for DMA engine */
         u32 Type;                 /**< Type of DMA engine - C2S or S2C */
+        spinlock_t Lock;          /**< Guards the BD ring and engine state */
+        PktBuf * pktFill;         /**< Packets for Rx refill, under Lock */
+        PktBuf * pktDone;         /**< Completed packets for UserPutPkt */
+        int Completing;           /**< pktDone is being passed to the user */
         UserPtrs user;            /**< User callback functions */
         int pktSize;              /**< User-specified usual size of packets */
+        struct hrtimer DoorbellTimer;   /**< Rings for BDs left unrung */
+        struct tasklet_struct DoorbellFlush; /**< Does it, under Lock */
 
 #ifdef TH_BH_ISR
         int intrCount;            /**< Counter to control interrupt coalescing */
+        int intrCoal;             /**< Coalesce count, adapted to the rate */
+        ktime_t lastIntr;         /**< Time of the last completion interrupt */
+        unsigned long intrTimeout;/**< Idle jiffies before poll_routine steps in */
 #endif
 
         dma_addr_t descSpacePA;   /**< Physical address of BD space */
@@ -433,6 +458,7 @@ extern "C" {
         //struct list_head xmit;
 
         u32 index;                    /**< Which interface is this */
+        int board;                    /**< Probe order, used by DmaRegisterBoard */
 
         /**
          * The user driver instance data. An instance must be allocated
@@ -444,9 +470,18 @@ extern "C" {
         Dma_Engine Dma[MAX_DMA_ENGINES];/**< Per-engine information */
 
         int userCount;                  /**< Number of registered users */
+
+        struct timer_list poll_timer;   /**< Housekeeping for this board */
+        struct task_struct * PollThread;/**< Busy-poll thread, if poll_cpu set */
+#ifdef TH_BH_ISR
+        unsigned long long PendingMask; /**< Engines waiting for the BH */
+        int LastIntr[MAX_DMA_ENGINES];  /**< Jiffies of last BH per engine */
+#endif
     };
 
-    extern struct privData *dmaData;
+    extern struct privData *dmaBoards[MAX_BOARDS];
+    extern int NumBoards;
+    extern struct privData *dmaData;    /**< First board, for statistics */
     /*@}*/
 
     extern u32 DriverState;
@@ -458,6 +493,45 @@ extern "C" {
 
     /***************** Macros (Inline Functions) Definitions *********************/
 
+    /** Point a BD at the buffer described by pbuf. Buffers taken from a
+     * DmaPool (PKT_MAPPED) are already mapped and are only synced for the
+     * device; any other buffer is mapped here. The BD remembers which it
+     * was, for DmaUnmapBuf().
+     */
+    static inline dma_addr_t DmaMapBuf(struct pci_dev * pdev, Dma_Bd * BdPtr,
+                                       PktBuf * pbuf, int dir)
+    {
+        dma_addr_t bufPA;
+
+        if(pbuf->flags & PKT_MAPPED)
+        {
+            bufPA = pbuf->bufPA;
+            pci_dma_sync_single_for_device(pdev, bufPA, pbuf->size, dir);
+            Dma_mBdSetSwFlags(BdPtr, DMA_BD_SW_MAPPED);
+        }
+        else
+        {
+            bufPA = pci_map_single(pdev, pbuf->pktBuf, pbuf->size, dir);
+            Dma_mBdSetSwFlags(BdPtr, 0);
+        }
+        Dma_mBdSetBufAddr(BdPtr, bufPA);
+        return bufPA;
+    }
+
+    /** Give the buffer of a BD back to the CPU once DMA is done with it,
+     * or when it is taken back unused. Pool buffers stay mapped.
+     */
+    static inline void DmaUnmapBuf(struct pci_dev * pdev, Dma_Bd * BdPtr,
+                                   unsigned int len, int dir)
+    {
+        dma_addr_t bufPA = (dma_addr_t) Dma_mBdGetBufAddr(BdPtr);
+
+        if(!(Dma_mBdGetSwFlags(BdPtr) & DMA_BD_SW_MAPPED))
+            pci_unmap_single(pdev, bufPA, len, dir);
+        else if(dir == PCI_DMA_FROMDEVICE)
+            pci_dma_sync_single_for_cpu(pdev, bufPA, len, dir);
+    }
+
 
     /************************** Function Prototypes ******************************/
 
@@ -465,7 +539,7 @@ extern "C" {
      * @{
      */
     int    descriptor_init(struct pci_dev *pdev, Dma_Engine * eptr);
-    void   descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr);
+    void   descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr, int giveback);
     void   Dma_Initialize(Dma_Engine * InstancePtr, Xaddr BaseAddress, u32 Type);
     void   Dma_Reset(Dma_Engine * InstancePtr);
     /*@}*/
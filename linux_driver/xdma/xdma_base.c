@@ -39,6 +39,9 @@
 #include <asm/uaccess.h>
 #include <linux/version.h>
 #include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
 
 #include <xpmon_be.h>
 #include "xdebug.h"
@@ -104,44 +107,75 @@ MODULE_DEVICE_TABLE(pci, ids);
 
 /**
  * Default S2C and C2S descriptor ring size. BD Space needed is (DMA_BD_CNT*sizeof(Dma_Bd)).
+ * The bd_cnt module parameter can change it, within DMA_BD_CNT_MIN and
+ * DMA_BD_CNT_MAX.
  */
 #define DMA_BD_CNT 1999
+#define DMA_BD_CNT_MIN      64
+#define DMA_BD_CNT_MAX      16383
 
-/* Size of packet pool */
-#define MAX_POOL    10
+/**
+ * RX BDs are replenished once this many are free, rather than after every
+ * completion, so that buffers are handed over in large batches.
+ */
+#define RX_REFILL_BATCH     (bd_cnt/8)
+
+/**
+ * The poll thread spins this many passes over empty rings before it starts
+ * sleeping between passes.
+ */
+#define POLL_SPIN_PASSES    64
 
 /* Structures to store statistics - the latest 100 */
 #define MAX_STATS   100
 
 
 /************************** Variable Names ***********************************/
-/** Pool of packet arrays to use while processing packets */
-struct PktPool
-{
-    PktBuf * pbuf;
-    struct PktPool * next;
-};
-
+/** Number of BDs in each engine's ring */
+static int bd_cnt = DMA_BD_CNT;
+module_param(bd_cnt, int, S_IRUGO);
+MODULE_PARM_DESC(bd_cnt, "BDs in each DMA engine ring (default 1999)");
 
-PktBuf pktArray[MAX_POOL][DMA_BD_CNT]; // used for passing pkts between drivers.
-struct PktPool pktPool[MAX_POOL];
-struct PktPool *pktPoolHead = NULL;
-struct PktPool *pktPoolTail = NULL;
+/** TX BDs are told to the engine once tx_doorbell_batch of them are
+ * waiting, or tx_doorbell_us after the first one, whichever comes first.
+ */
+static int tx_doorbell_batch = 16;
+module_param(tx_doorbell_batch, int, S_IRUGO);
+MODULE_PARM_DESC(tx_doorbell_batch, "TX BDs per doorbell write, 1 for every submission (default 16)");
+static int tx_doorbell_us = 10;
+module_param(tx_doorbell_us, int, S_IRUGO);
+MODULE_PARM_DESC(tx_doorbell_us, "Longest a TX BD waits for its doorbell, in us (default 10)");
+
+/** With poll_cpu set, each board's rings are busy-polled by a kernel thread
+ * bound to that CPU instead of by the jiffy poll timer. When the rings go
+ * idle the thread backs off, doubling its sleep up to poll_idle_us.
+ */
+static int poll_cpu = -1;
+module_param(poll_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(poll_cpu, "CPU for the ring poll thread, -1 for the poll timer (default -1)");
+static int poll_idle_us = 50;
+module_param(poll_idle_us, int, S_IRUGO);
+MODULE_PARM_DESC(poll_idle_us, "Longest the poll thread sleeps on idle rings, in us (default 50)");
 
 struct timer_list stats_timer;
-struct timer_list poll_timer;
 
 struct cdev *xdmaCdev = NULL;
 
-/** DMA driver state-related variables */
+/** DMA driver state-related variables. Each probed board gets its own
+ * privData; the statistics device and timer follow the first one.
+ */
+struct privData *dmaBoards[MAX_BOARDS];
+int NumBoards = 0;
 struct privData *dmaData = NULL;
 u32 DriverState = UNINITIALIZED;
 
-/* for exclusion of all program flows (processes, ISRs and BHs) */
+/* for exclusion of all program flows (processes, ISRs and BHs). BD rings
+ * are covered by the Lock of their own engine; DmaLock only guards the
+ * driver state and board teardown.
+ */
 static DEFINE_SPINLOCK(DmaStatsLock);
 DEFINE_SPINLOCK(DmaLock);
 static DEFINE_SPINLOCK(IntrLock);
-static DEFINE_SPINLOCK(PktPoolLock);
 
 /* Statistics-related variables */
 int UserOpen=0;
@@ -205,13 +239,12 @@ static struct pci_driver xdma_driver =
  * In the interrupt-mode, these functions are scheduled as bottom-halves.
  * In the polled-mode, these functions are invoked as functions.
  */
-static void PktHandler    (int eng, Dma_Engine * eptr);
+static int  PktHandler    (int eng, Dma_Engine * eptr);
 static void poll_routine  (unsigned long __opaque);
+static int  poll_thread   (void * __opaque);
 
 
 #ifdef TH_BH_ISR
-unsigned long long PendingMask = 0x0LL;
-int LastIntr[MAX_DMA_ENGINES]= { 0, };
 int MSIEnabled=0;
 static void IntrBH(unsigned long unused);
 DECLARE_TASKLET(DmaBH, IntrBH, 0);
@@ -222,37 +255,60 @@ static void poll_stats(unsigned long __opaque);
 
 
 
-/* Functions to enqueue and dequeue packet arrays in packet pools */
-struct PktPool *DQPool(void)
+/* Packet arrays for passing packets between this and user drivers are
+ * kept per engine, each large enough for a whole BD ring. pktFill is only
+ * used with the engine lock held. pktDone is also handed to UserPutPkt
+ * after the lock is dropped, so it belongs to whichever context has set
+ * Completing; the others leave the engine's completions to it.
+ */
+/* Deferred doorbell. DmaSendPkt() leaves fewer than DoorbellBatch BDs
+ * unrung and starts DoorbellTimer. The timer runs in interrupt context,
+ * so the ring itself is done by a tasklet, which can take the engine lock.
+ */
+static void DoorbellFlushBH(unsigned long data)
 {
-    struct PktPool * ppool;
-    unsigned long flags;
+    Dma_Engine * eptr = (Dma_Engine *)data;
 
-    spin_lock_irqsave(&PktPoolLock, flags);
-    ppool = pktPoolHead;
-    pktPoolHead = ppool->next;
-
-    if(pktPoolHead == NULL)
-    {
-        printk(KERN_ERR "pktPoolHead is NULL. This should never happen\n");
-    }
+    spin_lock_bh(&eptr->Lock);
+    Dma_BdRingDoorbell(&eptr->BdRing);
+    spin_unlock_bh(&eptr->Lock);
+}
 
-    spin_unlock_irqrestore(&PktPoolLock, flags);
+static enum hrtimer_restart DoorbellTimerFn(struct hrtimer * timer)
+{
+    Dma_Engine * eptr = container_of(timer, Dma_Engine, DoorbellTimer);
 
-    return ppool;
+    tasklet_schedule(&eptr->DoorbellFlush);
+    return HRTIMER_NORESTART;
 }
 
+/* Called with the engine lock held, after Dma_BdRingToHw() */
+void DmaDoorbellLater(Dma_Engine * eptr)
+{
+    if(eptr->BdRing.Unrung && !hrtimer_active(&eptr->DoorbellTimer))
+        hrtimer_start(&eptr->DoorbellTimer,
+                      ktime_set(0, tx_doorbell_us * 1000), HRTIMER_MODE_REL);
+}
 
-
-void EQPool(struct PktPool *pp)
+int DmaAllocPktArrays(Dma_Engine * eptr)
 {
-    unsigned long flags;
+    eptr->pktDone = vmalloc(bd_cnt * sizeof(PktBuf));
+    eptr->pktFill = vmalloc(bd_cnt * sizeof(PktBuf));
+    if((eptr->pktDone == NULL) || (eptr->pktFill == NULL))
+    {
+        printk(KERN_ERR "XDMA: Unable to allocate packet arrays\n");
+        DmaFreePktArrays(eptr);
+        return -ENOMEM;
+    }
+    eptr->Completing = 0;
+    return 0;
+}
 
-    spin_lock_irqsave(&PktPoolLock, flags);
-    pktPoolTail->next = pp;
-    pp->next = NULL;
-    pktPoolTail = pp;
-    spin_unlock_irqrestore(&PktPoolLock, flags);
+void DmaFreePktArrays(Dma_Engine * eptr)
+{
+    vfree(eptr->pktDone);
+    vfree(eptr->pktFill);
+    eptr->pktDone = eptr->pktFill = NULL;
 }
 
 
@@ -261,7 +317,11 @@ void EQPool(struct PktPool *pp)
 #endif
 
 
-static void PktHandler(int eng, Dma_Engine * eptr)
+/* Pass the BDs an engine has completed to its user, and refill an Rx ring.
+ * Returns the number of BDs passed on, or -EBUSY if another context is
+ * passing BDs on and this one could not look at the ring.
+ */
+static int PktHandler(int eng, Dma_Engine * eptr)
 {
     struct pci_dev * pdev;
     Dma_BdRing * rptr;
@@ -274,8 +334,8 @@ static void PktHandler(int eng, Dma_Engine * eptr)
     static int txcount = 0;
     static int rxcount = 0;
     PktBuf * pbuf;
-    struct PktPool * ppool;
     u32 flag;
+    u32 bytes = 0;
 
     rptr = &(eptr->BdRing);
     uptr = &(eptr->user);
@@ -292,17 +352,23 @@ static void PktHandler(int eng, Dma_Engine * eptr)
         flag = PCI_DMA_TODEVICE;
     }
 
-    spin_lock_bh(&DmaLock);
+    spin_lock_bh(&eptr->Lock);
+
+    /* Another context is still passing completed packets to the user.
+     * It owns pktDone, and will be back for whatever has completed since.
+     */
+    if(eptr->Completing)
+    {
+        spin_unlock_bh(&eptr->Lock);
+        return -EBUSY;
+    }
 
     /* Handle engine operations */
     bd_processed_save = 0;
-    if ((bd_processed = Dma_BdRingFromHw(rptr, DMA_BD_CNT, &BdPtr)) > 0)
+    if ((bd_processed = Dma_BdRingFromHw(rptr, bd_cnt, &BdPtr)) > 0)
     {
         log_verbose(KERN_INFO "PktHandler: Processed %d BDs\n", bd_processed);
 
-        /* First, get a pool of packets to work with */
-        ppool = DQPool();
-
         if(rptr->IsRxChannel) 
         {
                 rxcount += bd_processed;
@@ -320,7 +386,7 @@ static void PktHandler(int eng, Dma_Engine * eptr)
 
         do
         {
-            pbuf = &((ppool->pbuf)[j]);
+            pbuf = &(eptr->pktDone[j]);
 
             bufPA          =  (dma_addr_t)      Dma_mBdGetBufAddr(BdCurPtr);     //guodebug: error prone
             pbuf->size     =  (unsigned int)    Dma_mBdGetStatLength(BdCurPtr);  //guodebug:fixme
@@ -335,7 +401,8 @@ static void PktHandler(int eng, Dma_Engine * eptr)
             pbuf->userInfo  =  Dma_mBdGetUserData(BdCurPtr);
 
             log_verbose(KERN_INFO "Length %d Buf %p\n", pbuf->size, bufPA);
-            pci_unmap_single(pdev, bufPA, pbuf->size, flag);
+            DmaUnmapBuf(pdev, BdCurPtr, pbuf->size, flag);
+            pbuf->bufPA     =  bufPA;
 
             /* reset BD id */
             Dma_mBdSetId(BdCurPtr, 0LL); //guodebug NULL -> 0
@@ -345,31 +412,32 @@ static void PktHandler(int eng, Dma_Engine * eptr)
             j++;
 
             /* Add to SW payload stats counters */
-            spin_lock_bh(&DmaStatsLock);
-            SWrate[eng] += pbuf->size;
-            spin_unlock_bh(&DmaStatsLock);
+            bytes += pbuf->size;
         } while (bd_processed > 0);
 
+        /* Once per batch, rather than once per BD */
+        spin_lock(&DmaStatsLock);
+        SWrate[eng] += bytes;
+        spin_unlock(&DmaStatsLock);
+
         result = Dma_BdRingFree(rptr, bd_processed_save, BdPtr);
         if (result != XST_SUCCESS)
         {
             printk(KERN_ERR "PktHandler: BdRingFree() error %d.\n", result);
-            EQPool(ppool);
-            spin_unlock_bh(&DmaLock);
-            return;
+            spin_unlock_bh(&eptr->Lock);
+            return 0;
         }
-        spin_unlock_bh(&DmaLock);
+        eptr->Completing = 1;
+        spin_unlock_bh(&eptr->Lock);
 
         if (bd_processed_save)
         {
             log_verbose(KERN_INFO "PktHandler processed %d BDs\n", bd_processed_save);
-            (uptr->UserPutPkt)(eptr, ppool->pbuf, bd_processed_save, uptr->privData);
+            (uptr->UserPutPkt)(eptr, eptr->pktDone, bd_processed_save, uptr->privData);
         }
 
-        /* Now return packet pool to list */
-        EQPool(ppool);
-
-        spin_lock_bh(&DmaLock);
+        spin_lock_bh(&eptr->Lock);
+        eptr->Completing = 0;
     }
 
     /* Handle any RX-specific engine operations */
@@ -378,9 +446,40 @@ static void PktHandler(int eng, Dma_Engine * eptr)
         /* Replenish BDs in the RX ring */
         DmaSetupRecvBuffers(pdev, eptr);
     }
-    spin_unlock_bh(&DmaLock);
+    spin_unlock_bh(&eptr->Lock);
+
+    return bd_processed_save;
 }
 
+/*****************************************************************************/
+/**
+ * This function hands the packets an engine has completed back to its
+ * user now, instead of at the next interrupt or poll, so that a TX user
+ * sees its buffers free as soon as DMA is done with them.
+ *
+ * @param handle is the engine handle from DmaRegister().
+ *
+ * @return number of packets handed back.
+ *
+ * @note UserPutPkt() is called from the caller's context, so the caller
+ * must not hold a lock that UserPutPkt() takes. If another context is
+ * already handing packets back, this returns 0 at once.
+ *
+ *****************************************************************************/
+int DmaReapPkts(void * handle)
+{
+    Dma_Engine * eptr = (Dma_Engine *)handle;
+    struct privData * lp;
+    int result;
+
+    if((DriverState != INITIALIZED) || (eptr == NULL) ||
+       (eptr->EngineState != USER_ASSIGNED))
+        return 0;
+
+    lp = pci_get_drvdata(eptr->pdev);
+    result = PktHandler(eptr - lp->Dma, eptr);
+    return (result < 0) ? 0 : result;
+}
 
 
 
@@ -396,16 +495,19 @@ static void poll_routine(unsigned long __opaque)
 
     lp = pci_get_drvdata(pdev);
 
-    //printk("p%d ", get_cpu());
-    for(i=0; i<MAX_DMA_ENGINES; i++)
-    {
+    /* Reschedule poll routine. Incase interrupts are enabled, the
+     * bulk of processing should happen in the ISR, and this only picks up
+     * BDs left behind the last coalesced interrupt.
+     */
 #ifdef TH_BH_ISR
-        /* Do housekeeping only if adequate time has elapsed since
-         * last ISR.
-         */
-        if(jiffies < (LastIntr[i] + (HZ/50))) continue;
+    offset = HZ / 50;
+#else
+    offset = 0;
 #endif
 
+    //printk("p%d ", get_cpu());
+    for(i=0; i<MAX_DMA_ENGINES; i++)
+    {
         if(!((lp->engineMask) & (1LL << i)))
             continue;
 
@@ -413,22 +515,90 @@ static void poll_routine(unsigned long __opaque)
         if(eptr->EngineState != USER_ASSIGNED)
             continue;
 
+#ifdef TH_BH_ISR
+        /* Do housekeeping only if adequate time has elapsed since
+         * last ISR.
+         */
+        if(eptr->intrTimeout < offset)
+            offset = eptr->intrTimeout;
+        if(time_before(jiffies, lp->LastIntr[i] + eptr->intrTimeout)) continue;
+#endif
+
         /* The spinlocks need to be handled within this function, so
          * don't do them here.
          */
         PktHandler(i, eptr);
     }
 
-    /* Reschedule poll routine. Incase interrupts are enabled, the
-     * bulk of processing should happen in the ISR.
-     */
-#ifdef TH_BH_ISR
-    offset = HZ / 50;
-#else
-    offset = 0;
-#endif
-    poll_timer.expires = jiffies + offset;
-    add_timer(&poll_timer);
+    lp->poll_timer.expires = jiffies + offset;
+    add_timer(&lp->poll_timer);
+}
+
+
+
+/*****************************************************************************/
+/**
+ * This is the body of a board's poll thread, used instead of poll_routine()
+ * when poll_cpu is set. It hands completed BDs to the users as soon as they
+ * are seen, rather than at the next jiffy.
+ *
+ * @param __opaque is the PCI device of the board.
+ *
+ * @return 0 when stopped.
+ *
+ * @note After POLL_SPIN_PASSES passes that find nothing, the thread sleeps
+ * between passes, starting at 1 us and doubling up to poll_idle_us. Any
+ * completed BD puts it back to spinning.
+ *
+ *****************************************************************************/
+static int poll_thread(void * __opaque)
+{
+    struct pci_dev *pdev = (struct pci_dev *)__opaque;
+    struct privData *lp = pci_get_drvdata(pdev);
+    Dma_Engine * eptr;
+    ktime_t idle;
+    int i, done, result, empty = 0, sleep_us = 1;
+
+    while(!kthread_should_stop())
+    {
+        done = 0;
+        if(DriverState == INITIALIZED)
+        {
+            for(i=0; i<MAX_DMA_ENGINES; i++)
+            {
+                if(!((lp->engineMask) & (1LL << i)))
+                    continue;
+
+                eptr = &(lp->Dma[i]);
+                if(eptr->EngineState != USER_ASSIGNED)
+                    continue;
+
+                result = PktHandler(i, eptr);
+                if(result > 0)
+                    done += result;
+            }
+        }
+
+        if(done || (++empty < POLL_SPIN_PASSES))
+        {
+            if(done)
+            {
+                empty = 0;
+                sleep_us = 1;
+            }
+            cpu_relax();
+            cond_resched();
+            continue;
+        }
+
+        idle = ktime_set(0, sleep_us * 1000);
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout(&idle, HRTIMER_MODE_REL);
+        if(sleep_us < poll_idle_us)
+            sleep_us = (2*sleep_us < poll_idle_us) ? 2*sleep_us : poll_idle_us;
+    }
+
+    return 0;
 }
 
 
@@ -598,7 +768,7 @@ static void DmaSetupRecvBuffers(struct pci_dev *pdev, Dma_Engine * eptr)
     Dma_Bd *BdPtr, *BdCurPtr;
     int result, num, numgot;
     int i, len;
-    struct PktPool * ppool;
+    PktBuf * pkts;
 #ifdef TH_BH_ISR
     u32 mask;
 #endif
@@ -626,17 +796,23 @@ static void DmaSetupRecvBuffers(struct pci_dev *pdev, Dma_Engine * eptr)
         return;
     }
 
+    /* The rest of the ring is still queued, so there is no hurry */
+    if(free_bd_count < RX_REFILL_BATCH)
+        return;
+
     log_verbose(KERN_INFO "SetupRecv: Free BD count is %d\n", free_bd_count);
 
-    /* First, get a pool of packets to work with */
-    ppool = DQPool();
+    pkts = eptr->pktFill;
 
     numbds = 0;
     do {
         /* Get buffers from user */
         num = free_bd_count;
         log_verbose(KERN_INFO "Trying to get %d buffers from user driver\n", num);
-        numgot = (uptr->UserGetPkt)(eptr, ppool->pbuf, eptr->pktSize, num, uptr->privData);
+        /* Not every user driver sets flags for RX buffers */
+        for(i = 0; i < num; i++)
+            pkts[i].flags = 0;
+        numgot = (uptr->UserGetPkt)(eptr, pkts, eptr->pktSize, num, uptr->privData);
 
         if (!numgot) 
         {
@@ -650,7 +826,7 @@ static void DmaSetupRecvBuffers(struct pci_dev *pdev, Dma_Engine * eptr)
         {
             /* We really shouldn't get this. Return unused buffers to app */
             printk(KERN_ERR "DmaSetupRecvBuffers: BdRingAlloc unsuccessful (%d)\n", result);
-            PutUnusedPkts(eptr, ppool->pbuf, numgot);
+            PutUnusedPkts(eptr, pkts, numgot);
             break;
         }
 
@@ -660,11 +836,10 @@ static void DmaSetupRecvBuffers(struct pci_dev *pdev, Dma_Engine * eptr)
         {
             PktBuf* pbuf;
 
-            pbuf = &((ppool->pbuf)[i]);
-            bufPA = pci_map_single(pdev, (u32*)(pbuf->pktBuf), pbuf->size, PCI_DMA_FROMDEVICE);
+            pbuf = &(pkts[i]);
+            bufPA = DmaMapBuf(pdev, BdCurPtr, pbuf, PCI_DMA_FROMDEVICE);
             log_verbose(KERN_INFO "The buffer after alloc is at VA %p PA %p size %d\n",pbuf->pktBuf,bufPA,pbuf->size);
 
-            Dma_mBdSetBufAddr     (BdCurPtr, bufPA);
             Dma_mBdSetCtrlLength  (BdCurPtr, pbuf->size);
             Dma_mBdSetId          (BdCurPtr, (unsigned long)pbuf->bufInfo); //guodebug: error prone
             Dma_mBdSetCtrl        (BdCurPtr, 0);        // Disable interrupts also.
@@ -675,7 +850,7 @@ static void DmaSetupRecvBuffers(struct pci_dev *pdev, Dma_Engine * eptr)
              * coalesce count.
              */
             mask = DMA_BD_INT_ERROR_MASK;
-            if(!(eptr->intrCount % INT_COAL_CNT))
+            if(!(eptr->intrCount % eptr->intrCoal))
                 mask |= DMA_BD_INT_COMP_MASK;
             eptr->intrCount += 1;
             Dma_mBdSetCtrl(BdCurPtr, mask);
@@ -697,14 +872,13 @@ static void DmaSetupRecvBuffers(struct pci_dev *pdev, Dma_Engine * eptr)
             BdCurPtr = BdPtr;
             for(i = 0; i < numgot; i++)
             {
-                bufPA = Dma_mBdGetBufAddr(BdCurPtr);
                 len = Dma_mBdGetCtrlLength(BdCurPtr);
-                pci_unmap_single(pdev, bufPA, len, PCI_DMA_FROMDEVICE);
+                DmaUnmapBuf(pdev, BdCurPtr, len, PCI_DMA_FROMDEVICE);
                 Dma_mBdSetId(BdCurPtr, 0LL);
                 BdCurPtr = Dma_mBdRingNext(rptr, BdCurPtr);
             }
             Dma_BdRingUnAlloc(rptr, numgot, BdPtr);
-            PutUnusedPkts(eptr, ppool->pbuf, numgot);
+            PutUnusedPkts(eptr, pkts, numgot);
             break;
         }
 
@@ -713,9 +887,6 @@ static void DmaSetupRecvBuffers(struct pci_dev *pdev, Dma_Engine * eptr)
         log_verbose(KERN_INFO "free_bd_count %d, numbds %d, numgot %d\n", free_bd_count, numbds, numgot);
     } while (free_bd_count > 0);
 
-    /* Return packet pool to list */
-    EQPool(ppool);
-
 #ifdef DEBUG_VERBOSE
     if(numbds)
         log_verbose(KERN_INFO "DmaSetupRecvBuffers: %d new RX BDs queued up\n", numbds);
@@ -752,7 +923,7 @@ int descriptor_init(struct pci_dev *pdev, Dma_Engine *eptr)
     /* Calculate size of descriptor space pool - extra to allow for
        * alignment adjustment.
        */
-    dftsize = sizeof(u32) * DMA_BD_SW_NUM_WORDS * (DMA_BD_CNT+1);
+    dftsize = sizeof(u32) * DMA_BD_SW_NUM_WORDS * (bd_cnt+1);
     log_normal(KERN_INFO "XDMA: BD space: %d (0x%0x)\n", dftsize, dftsize);
 
     if((BdPtr = pci_alloc_consistent(pdev, dftsize, &BdPhyAddr)) == NULL)
@@ -793,6 +964,13 @@ int descriptor_init(struct pci_dev *pdev, Dma_Engine *eptr)
         return -EIO;
     }
 
+    /* RX BDs are already refilled in batches, so only TX defers */
+    hrtimer_init(&eptr->DoorbellTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    eptr->DoorbellTimer.function = DoorbellTimerFn;
+    tasklet_init(&eptr->DoorbellFlush, DoorbellFlushBH, (unsigned long)eptr);
+    if((eptr->Type & DMA_ENG_DIRECTION_MASK) != DMA_ENG_C2S)
+        eptr->BdRing.DoorbellBatch = tx_doorbell_batch;
+
     if((eptr->Type & DMA_ENG_DIRECTION_MASK) == DMA_ENG_C2S)
         DmaSetupRecvBuffers(pdev, eptr);
 
@@ -814,19 +992,22 @@ int descriptor_init(struct pci_dev *pdev, Dma_Engine *eptr)
  * - Forcibly retrieves the buffers which have been queued up for DMA with
  *   the DMA engine hardware
  * - Unmaps these buffers from the PCI/PCIe space
- * - Returns these buffers to the user driver, which will free them
+ * - Returns these buffers to the user driver, which will free them,
+ *   if giveback is set
  * - Frees the BD ring
  * - De-allocates the space used for the BD ring, and unmaps it from
  *   the PCI/PCIe space
  *
  * @param  pdev is the PCI/PCIe device instance
  * @param  eptr is a pointer to the DMA engine instance to be worked on.
+ * @param  giveback is 0 if the user driver does not have the engine's
+ *         handle yet, and so cannot take the buffers back.
  *
  * @return None.
  *
  *****************************************************************************/
 
-void descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr)
+void descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr, int giveback)
 {
     Dma_Bd *BdPtr, *BdCurPtr;
     unsigned int bd_processed, bd_processed_save;
@@ -835,26 +1016,35 @@ void descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr)
     PktBuf * pbuf;
     dma_addr_t bufPA;
     int j, result;
-    struct PktPool * ppool;
     u32 flag;
 
     log_verbose(KERN_INFO "descriptor_free: \n");
 
+    /* No late doorbell for a ring that is going away */
+    hrtimer_cancel(&eptr->DoorbellTimer);
+    tasklet_kill(&eptr->DoorbellFlush);
+
     rptr = &(eptr->BdRing);
     uptr = &(eptr->user);
 
     if(rptr->IsRxChannel) flag = PCI_DMA_FROMDEVICE;
     else flag = PCI_DMA_TODEVICE;
 
-    spin_lock_bh(&DmaLock);
+    spin_lock_bh(&eptr->Lock);
+
+    /* Let a PktHandler that is still running finish with pktDone */
+    while(eptr->Completing)
+    {
+        spin_unlock_bh(&eptr->Lock);
+        cpu_relax();
+        spin_lock_bh(&eptr->Lock);
+    }
 
     /* First recover buffers and BDs queued up for DMA, then pass to user */
     bd_processed_save = 0;
-    if ((bd_processed = Dma_BdRingForceFromHw(rptr, DMA_BD_CNT, &BdPtr)) > 0)
+    if ((bd_processed = Dma_BdRingForceFromHw(rptr, bd_cnt, &BdPtr)) > 0)
     {
         log_normal(KERN_INFO "descriptor_free: Forced %d BDs from hw\n", bd_processed);
-        /* First, get a pool of packets to work with */
-        ppool = DQPool();
 
         bd_processed_save = bd_processed;
         BdCurPtr = BdPtr;
@@ -862,7 +1052,7 @@ void descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr)
 
         do
         {
-            pbuf = &((ppool->pbuf)[j]);
+            pbuf = &(eptr->pktDone[j]);
 
             bufPA = (dma_addr_t) Dma_mBdGetBufAddr(BdCurPtr);
             pbuf->size = Dma_mBdGetCtrlLength(BdCurPtr);
@@ -879,7 +1069,8 @@ void descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr)
 #ifdef DEBUG_VERBOSE
             log_verbose(KERN_INFO "Length %d Buf %x\n", pbuf->size, (u32) bufPA);
 #endif
-            pci_unmap_single(pdev, bufPA, pbuf->size, flag);
+            DmaUnmapBuf(pdev, BdCurPtr, pbuf->size, flag);
+            pbuf->bufPA = bufPA;
 
             /* reset BD id */
             Dma_mBdSetId(BdCurPtr, 0LL);
@@ -889,15 +1080,17 @@ void descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr)
             j++;
         } while (bd_processed > 0);
 
-        spin_unlock_bh(&DmaLock);
+        eptr->Completing = 1;
+        spin_unlock_bh(&eptr->Lock);
 
-        if (bd_processed_save)
+        if (bd_processed_save && giveback)
         {
             log_normal("DmaUnregister pushing %d buffers to user\n", bd_processed_save);
-            (uptr->UserPutPkt)(eptr, ppool->pbuf, bd_processed_save, uptr->privData);
+            (uptr->UserPutPkt)(eptr, eptr->pktDone, bd_processed_save, uptr->privData);
         }
 
-        spin_lock_bh(&DmaLock);
+        spin_lock_bh(&eptr->Lock);
+        eptr->Completing = 0;
 
         result = Dma_BdRingFree(rptr, bd_processed_save, BdPtr);
 
@@ -907,10 +1100,8 @@ void descriptor_free(struct pci_dev *pdev, Dma_Engine * eptr)
             printk(KERN_ERR "DmaUnregister: BdRingFree() error %d.\n", result);
             //return;
         }
-
-        EQPool(ppool);
     }
-    spin_unlock_bh(&DmaLock);
+    spin_unlock_bh(&eptr->Lock);
 
     /* Now free BD ring itself */
     if (eptr->descSpaceVA == 0) 
@@ -1249,7 +1440,7 @@ static long xdma_dev_ioctl(struct file * filp,
         }
 
         /* Now add the DMA state */
-        eng.BDs     = DMA_BD_CNT;
+        eng.BDs     = bd_cnt;
         eng.BDerrs  = rptr->BDerrs;
         eng.BDSerrs = rptr->BDSerrs;
 #ifdef TH_BH_ISR
@@ -1428,6 +1619,7 @@ static long xdma_dev_ioctl(struct file * filp,
 
 static int ReadPCIState(struct pci_dev * pdev, PCIState *pcistate)
 {
+    struct privData *lp = pci_get_drvdata(pdev);
     int pos;
     u16 valw;
     u8 valb;
@@ -1480,7 +1672,7 @@ static int ReadPCIState(struct pci_dev * pdev, PCIState *pcistate)
 
 
     /* Read Initial Flow Control Credits information */
-    base = (Xaddr)(dmaData->barInfo[0].baseVAddr); //guodebug
+    base = (Xaddr)(lp->barInfo[0].baseVAddr); //guodebug
 
     pcistate->InitFCCplD   =  XIo_In32(base+0x8210) & 0x00000FFF;
     pcistate->InitFCCplH   =  XIo_In32(base+0x8214) & 0x000000FF;
@@ -1506,9 +1698,16 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
     int i;
     dev_t xdmaDev;
     static struct file_operations xdmaDevFileOps;
-    struct timer_list * timer = &poll_timer;
+    struct timer_list * timer;
+    struct privData *lp;
     unsigned long size;
 
+    if(NumBoards >= MAX_BOARDS)
+    {
+        printk(KERN_ERR "Only %d boards supported, ignoring this one.\n", MAX_BOARDS);
+        return -ENODEV;
+    }
+
     /* Initialize device before it is used by driver. Ask low-level
      * code to enable I/O and memory. Wake up the device if it was
      * suspended. Beware, this function can fail.
@@ -1520,48 +1719,26 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
         return pciRet;
     }
 
-    /* Initialise packet pools for passing of packet arrays between this
-     * and user drivers.
-     */
-    for(i = 0; i < MAX_POOL; i++)
-    {
-        pktPool[i].pbuf = pktArray[i];      // Associate array with pool.
-
-        if(i == (MAX_POOL-1))
-            pktPool[i].next = NULL;
-        else
-            pktPool[i].next = &pktPool[i+1];
-    }
-    pktPoolTail = &pktPool[MAX_POOL-1];
-    pktPoolHead = &pktPool[0];
-
-
-
-#ifdef DEBUG_VERBOSE
-    for(i=0; i<MAX_POOL; i++)
-    {
-        printk("pktPool[%d] %p pktarray %p\n", i, &pktPool[i], pktPool[i].pbuf);
-    }
-
-    printk("pktPoolHead %p pktPoolTail %p\n", pktPoolHead, pktPoolTail);
-#endif
-
-
     /* Allocate space for holding driver-private data - for storing driver
      * context.
      */
-    dmaData = kmalloc(sizeof(struct privData), GFP_KERNEL);
-    if(dmaData == NULL)
+    lp = kmalloc(sizeof(struct privData), GFP_KERNEL);
+    if(lp == NULL)
     {
         printk(KERN_ERR "Unable to allocate DMA private data.\n");
         pci_disable_device(pdev);
         return XST_FAILURE;
     }
 
-//printk("dmaData at %p\n", dmaData);
-    dmaData->barMask = 0;
-    dmaData->engineMask = 0;
-    dmaData->userCount = 0;
+//printk("lp at %p\n", lp);
+    lp->barMask = 0;
+    lp->engineMask = 0;
+    lp->userCount = 0;
+    lp->board = NumBoards;
+    lp->PollThread = NULL;
+#ifdef TH_BH_ISR
+    lp->PendingMask = 0;
+#endif
 
 #if defined(DEBUG_NORMAL) || defined(DEBUG_VERBOSE)
     /* Display PCI configuration space of device. */
@@ -1589,7 +1766,7 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
     if (pciRet < 0)
     {
         printk(KERN_ERR "Could not request PCI regions.\n");
-        kfree(dmaData);
+        kfree(lp);
         pci_disable_device(pdev);
         return pciRet;
     }
@@ -1603,7 +1780,7 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
     if (pciRet < 0) {
         printk(KERN_ERR "pci_set_dma_mask failed\n");
         pci_release_regions(pdev);
-        kfree(dmaData);
+        kfree(lp);
         pci_disable_device(pdev);
         return pciRet;
     }
@@ -1628,7 +1805,7 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
             {
                 printk(KERN_ERR "BAR 0 not valid, aborting.\n");
                 pci_release_regions(pdev);
-                kfree(dmaData);
+                kfree(lp);
                 pci_disable_device(pdev);
                 return XST_FAILURE;
             }
@@ -1638,7 +1815,7 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
         /* Set a bitmask for all the BARs that are present. */
         else
         {
-            (dmaData->barMask) |= ( 1 << i );
+            (lp->barMask) |= ( 1 << i );
         }
 
         /* Check all BARs for memory-mapped or I/O-mapped. The driver is
@@ -1648,15 +1825,15 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
         {
             printk(KERN_ERR "BAR %d is of wrong type, aborting.\n", i);
             pci_release_regions(pdev);
-            kfree(dmaData);
+            kfree(lp);
             pci_disable_device(pdev);
             return XST_FAILURE;
         }
 
 
         /* Get base address of device memory and length for all BARs */
-        dmaData->barInfo[i].basePAddr  =  pci_resource_start(pdev, i); // guodebug: guoerror
-        dmaData->barInfo[i].baseLen    =  size;
+        lp->barInfo[i].basePAddr  =  pci_resource_start(pdev, i); // guodebug: guoerror
+        lp->barInfo[i].baseLen    =  size;
 
         /* Map bus memory to CPU space. The ioremap may fail if size
          * requested is too long for kernel to provide as a single chunk
@@ -1665,34 +1842,36 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
          * of memory. Or mapping should be done based on user request
          * with user size. Neither is being done now - maybe later.
          */
-        if((dmaData->barInfo[i].baseVAddr = ioremap((dmaData->barInfo[i].basePAddr), size)) == 0UL) // guodebug: guoerror
+        if((lp->barInfo[i].baseVAddr = ioremap((lp->barInfo[i].basePAddr), size)) == 0UL) // guodebug: guoerror
         {
             printk(KERN_ERR "Cannot map BAR %d space, invalidating.\n", i);
-            (dmaData->barMask) &= ~( 1 << i );
+            (lp->barMask) &= ~( 1 << i );
         }
         else
         {
             log_verbose(KERN_INFO "[BAR %x] Base PA %p Len %d VA %p\n", i,
-                        (Xaddr) (dmaData->barInfo[i].basePAddr),
-                        (Xaddr) (dmaData->barInfo[i].baseLen),
-                        (Xaddr) (dmaData->barInfo[i].baseVAddr));
+                        (Xaddr) (lp->barInfo[i].basePAddr),
+                        (Xaddr) (lp->barInfo[i].baseLen),
+                        (Xaddr) (lp->barInfo[i].baseVAddr));
         }
     }
 
-    log_verbose(KERN_INFO "Bar mask is 0x%x\n", (dmaData->barMask));
-    log_normal(KERN_INFO "DMA Base VA %x\n", (Xaddr)(dmaData->barInfo[0].baseVAddr));
+    log_verbose(KERN_INFO "Bar mask is 0x%x\n", (lp->barMask));
+    log_normal(KERN_INFO "DMA Base VA %x\n", (Xaddr)(lp->barInfo[0].baseVAddr));
 
     /* Disable global interrupts */
-    Dma_mIntDisable(dmaData->barInfo[0].baseVAddr);
-    dmaData->pdev  = pdev;
-    dmaData->index = pdev->device;
+    Dma_mIntDisable(lp->barInfo[0].baseVAddr);
+    lp->pdev  = pdev;
+    lp->index = pdev->device;
 
     /* Initialize DMA common registers? !!!! */
     /* Read DMA engine configuration and initialise data structures */
-    ReadDMAEngineConfiguration(pdev, dmaData); // guodebug: guoerror here
+    ReadDMAEngineConfiguration(pdev, lp); // guodebug: guoerror here
 
     /* Save private data pointer in device structure */
-    pci_set_drvdata(pdev, dmaData);
+    pci_set_drvdata(pdev, lp);
+    dmaBoards[NumBoards++] = lp;
+    printk(KERN_INFO "Board %d is PCI device %s\n", lp->board, pci_name(pdev));
     /* The following code is for registering as a character device driver.
      * The GUI will use /dev/xdma_stat file to read state & statistics.
      * Incase of any failure, the driver will come up without device
@@ -1700,43 +1879,53 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
      */
 
 
-    /* First allocate a major/minor number. */
-    chrRet = alloc_chrdev_region(&xdmaDev, 0, 1, "xdma_stat");
-    //if(IS_ERR((int*)chrRet)) //guodebug: fixme
-    if (chrRet < 0) //guodebug: fixme
+    /* Statistics are only kept for the first board. */
+    if(lp->board != 0)
     {
-            log_normal(KERN_ERR "Error allocating char device region\n");
+        chrRet = -1;
     }
     else
     {
-        /* Register our character device */
-        xdmaCdev = cdev_alloc();
-        if(IS_ERR(xdmaCdev))
+        dmaData = lp;
+
+        /* First allocate a major/minor number. */
+        chrRet = alloc_chrdev_region(&xdmaDev, 0, 1, "xdma_stat");
+        //if(IS_ERR((int*)chrRet)) //guodebug: fixme
+        if (chrRet < 0) //guodebug: fixme
         {
-            log_normal(KERN_ERR "Alloc error registering device driver\n");
-            unregister_chrdev_region(xdmaDev, 1);
-            chrRet = -1;
+                log_normal(KERN_ERR "Error allocating char device region\n");
         }
         else
         {
-            xdmaDevFileOps.owner    = THIS_MODULE;
-            xdmaDevFileOps.open     = xdma_dev_open;
-            xdmaDevFileOps.release  = xdma_dev_release;
-            #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
-            xdmaDevFileOps.ioctl = xdma_dev_ioctl;
+            /* Register our character device */
+            xdmaCdev = cdev_alloc();
+            if(IS_ERR(xdmaCdev))
+            {
+                log_normal(KERN_ERR "Alloc error registering device driver\n");
+                unregister_chrdev_region(xdmaDev, 1);
+                chrRet = -1;
+            }
+            else
+            {
+                xdmaDevFileOps.owner    = THIS_MODULE;
+                xdmaDevFileOps.open     = xdma_dev_open;
+                xdmaDevFileOps.release  = xdma_dev_release;
+                #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
+                xdmaDevFileOps.ioctl = xdma_dev_ioctl;
 #else
-            xdmaDevFileOps.unlocked_ioctl = xdma_dev_ioctl;
+                xdmaDevFileOps.unlocked_ioctl = xdma_dev_ioctl;
 #endif
 
-            xdmaCdev->owner   = THIS_MODULE;
-            xdmaCdev->ops     = &xdmaDevFileOps;
-            xdmaCdev->dev     = xdmaDev;
-            chrRet            = cdev_add(xdmaCdev, xdmaDev, 1);
+                xdmaCdev->owner   = THIS_MODULE;
+                xdmaCdev->ops     = &xdmaDevFileOps;
+                xdmaCdev->dev     = xdmaDev;
+                chrRet            = cdev_add(xdmaCdev, xdmaDev, 1);
 
-            if(chrRet < 0)
-            {
-                log_normal(KERN_ERR "Add error registering device driver\n");
-                unregister_chrdev_region(xdmaDev, 1);
+                if(chrRet < 0)
+                {
+                    log_normal(KERN_ERR "Add error registering device driver\n");
+                    unregister_chrdev_region(xdmaDev, 1);
+                }
             }
         }
     }
@@ -1766,13 +1955,32 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
 
     DriverState = INITIALIZED;
 
-    /* Start polling routine */
-    log_normal(KERN_INFO "probe: Starting poll routine with %p\n", pdev);
-    init_timer(timer);
-    timer->expires   =  jiffies+(HZ/500);
-    timer->data      =  (unsigned long) pdev;
-    timer->function  =  poll_routine;
-    add_timer(timer);
+    /* Start polling thread, or the polling routine without one */
+    if(poll_cpu >= 0)
+    {
+        lp->PollThread = kthread_create(poll_thread, pdev, "xdma_poll/%d", lp->board);
+        if(IS_ERR(lp->PollThread))
+        {
+            printk(KERN_ERR "Could not start poll thread, using poll routine\n");
+            lp->PollThread = NULL;
+        }
+        else
+        {
+            log_normal(KERN_INFO "probe: Polling on CPU %d\n", poll_cpu);
+            kthread_bind(lp->PollThread, poll_cpu);
+            wake_up_process(lp->PollThread);
+        }
+    }
+    if(lp->PollThread == NULL)
+    {
+        log_normal(KERN_INFO "probe: Starting poll routine with %p\n", pdev);
+        timer = &lp->poll_timer;
+        init_timer(timer);
+        timer->expires   =  jiffies+(HZ/500);
+        timer->data      =  (unsigned long) pdev;
+        timer->function  =  poll_routine;
+        add_timer(timer);
+    }
 
 #ifdef TH_BH_ISR
     /* Now enable interrupts using MSI mode */
@@ -1795,12 +2003,12 @@ static int __devinit xdma_probe(struct pci_dev *pdev, const struct pci_device_id
 
     /* Set flag to synchronise between ISR and poll_routine */
     for(i=0; i<MAX_DMA_ENGINES; i++)
-        LastIntr[i] = jiffies;
+        lp->LastIntr[i] = jiffies;
 
     /* Now, enable global interrupts. Engine interrupts will be enabled
      * only when they are used.
      */
-    Dma_mIntEnable(dmaData->barInfo[0].baseVAddr);
+    Dma_mIntEnable(lp->barInfo[0].baseVAddr);
 
 #endif
 
@@ -1828,16 +2036,24 @@ static void __devexit xdma_remove(struct pci_dev *pdev)
     mdelay(1000);
 
     /* Stop the polling routines */
-    spin_lock_bh(&DmaStatsLock);
-    del_timer_sync(&stats_timer);
-    spin_unlock_bh(&DmaStatsLock);
+    if(lp == dmaData)
+    {
+        spin_lock_bh(&DmaStatsLock);
+        del_timer_sync(&stats_timer);
+        spin_unlock_bh(&DmaStatsLock);
+    }
 
-    spin_lock_bh(&DmaLock);
-    del_timer_sync(&poll_timer);
-    spin_unlock_bh(&DmaLock);
+    if(lp->PollThread != NULL)
+        kthread_stop(lp->PollThread);
+    else
+    {
+        spin_lock_bh(&DmaLock);
+        del_timer_sync(&lp->poll_timer);
+        spin_unlock_bh(&DmaLock);
+    }
 
 #ifdef TH_BH_ISR
-    base = (u32)(dmaData->barInfo[0].baseVAddr); //guodebug: error prone
+    base = (u32)(lp->barInfo[0].baseVAddr); //guodebug: error prone
     Dma_mIntDisable(base);
 
     /* Disable MSI and interrupts */
@@ -1861,16 +2077,16 @@ static void __devexit xdma_remove(struct pci_dev *pdev)
 
     for(i=0; i<MAX_BARS; i++)
     {
-        if((dmaData->barMask) & ( 1 << i ))
+        if((lp->barMask) & ( 1 << i ))
         {
-            iounmap(dmaData->barInfo[i].baseVAddr);
+            iounmap(lp->barInfo[i].baseVAddr);
         }
     }
 
 
     spin_unlock_bh(&DmaLock);
 
-    if(xdmaCdev != NULL)
+    if((lp == dmaData) && (xdmaCdev != NULL))
     {
         printk("Unregistering char device driver\n");
         cdev_del(xdmaCdev);
@@ -1886,22 +2102,38 @@ static void __devexit xdma_remove(struct pci_dev *pdev)
 
 static int __init xdma_init(void)
 {
+    if((bd_cnt < DMA_BD_CNT_MIN) || (bd_cnt > DMA_BD_CNT_MAX))
+    {
+        printk(KERN_ERR "XDMA: bd_cnt %d not in %d..%d\n", bd_cnt,
+                                            DMA_BD_CNT_MIN, DMA_BD_CNT_MAX);
+        return -EINVAL;
+    }
+    /* Without a flush timer, every submission rings */
+    if((tx_doorbell_batch < 1) || (tx_doorbell_us <= 0))
+        tx_doorbell_batch = 1;
+    if((poll_cpu >= 0) && ((poll_cpu >= nr_cpu_ids) || !cpu_online(poll_cpu)))
+    {
+        printk(KERN_ERR "XDMA: poll_cpu %d is not online\n", poll_cpu);
+        return -EINVAL;
+    }
+    if(poll_idle_us < 1)
+        poll_idle_us = 1;
+
     /* Initialize the locks */
     spin_lock_init(&DmaLock);
     spin_lock_init(&IntrLock);
     spin_lock_init(&DmaStatsLock);
-    spin_lock_init(&PktPoolLock);
 
-    /* Just register the driver. No kernel boot options used. */
-    printk(KERN_INFO "XDMA: Inserting Xilinx base DMA driver in kernel.\n");
+    /* Just register the driver. */
+    printk(KERN_INFO "XDMA: Inserting Xilinx base DMA driver in kernel, %d BDs per ring.\n", bd_cnt);
     return pci_register_driver(&xdma_driver);
 }
 
 
 static void __exit xdma_cleanup(void)
 {
-    struct PktPool* ppool;
     int oldstate;
+    int i;
 
     printk("Came to xdma_cleanup\n");
 
@@ -1916,24 +2148,21 @@ static void __exit xdma_cleanup(void)
     /* Then, unregister driver with PCI in order to free up resources */
     pci_unregister_driver(&xdma_driver);
 
-    if(dmaData != NULL)
+    if(NumBoards)
     {
-        printk("User count %d\n", dmaData->userCount);
+        for(i=0; i<NumBoards; i++)
+        {
+            printk("Board %d user count %d\n", i, dmaBoards[i]->userCount);
+            kfree(dmaBoards[i]);
+            dmaBoards[i] = NULL;
+        }
         printk("GUI user open? %d\n", UserOpen);
-        kfree(dmaData);
+        NumBoards = 0;
+        dmaData = NULL;
     }
     else
         printk("DriverState still %d\n", oldstate);
 
-    /* Check whether pools are good */
-    ppool = pktPoolHead;
-    while (ppool != NULL)
-    {
-        log_verbose("pktPool %p pktarray %p\n", ppool, ppool->pbuf);
-        ppool = ppool->next;
-    }
-    log_verbose("pktPoolHead %p pktPoolTail %p\n", pktPoolHead, pktPoolTail);
-
     printk(KERN_INFO "XDMA: Unregistering Xilinx base DMA driver from kernel.\n");
 }
 
@@ -1943,8 +2172,15 @@ module_init(xdma_init);
 module_exit(xdma_cleanup);
 
 EXPORT_SYMBOL(DmaRegister);
+EXPORT_SYMBOL(DmaRegisterBoard);
+EXPORT_SYMBOL(DmaNumBoards);
 EXPORT_SYMBOL(DmaUnregister);
 EXPORT_SYMBOL(DmaSendPkt);
+EXPORT_SYMBOL(DmaReapPkts);
+EXPORT_SYMBOL(DmaPoolCreate);
+EXPORT_SYMBOL(DmaPoolDestroy);
+EXPORT_SYMBOL(DmaMapPage);
+EXPORT_SYMBOL(DmaUnmapPage);
 
 
 
@@ -91,6 +91,11 @@ extern "C" {
 //#define DMA_BD_VBUFAL_OFFSET        DMA_BD_CARDA_OFFSET
 #define DMA_BD_VBUFAL_OFFSET        0x20 /**< Buffer virtual address LSBytes */
 #define DMA_BD_VBUFAH_OFFSET        0x24 /**< Buffer virtual address MSBytes */
+#define DMA_BD_SWFLAGS_OFFSET       0x28 /**< Driver flags, see below */
+
+    /* Bit masks for the driver flags word */
+#define DMA_BD_SW_MAPPED            0x00000001 /**< Buffer is from a DmaPool,
+                                                    sync instead of unmap */
 
     /* Bit masks for some BD fields */
 #define DMA_BD_BUFL_MASK            0x000FFFFF /**< Byte count */
@@ -388,6 +393,26 @@ extern "C" {
 #endif
 
 
+    /*****************************************************************************/
+    /**
+     * Set/retrieve the driver flags word of the given BD. The hardware never
+     * looks at it.
+     *
+     * @param  BdPtr is the BD to operate on
+     * @param  Flags is a combination of DMA_BD_SW_* masks
+     *
+     * @note
+     * C-style signature:
+     *    void Dma_mBdSetSwFlags(Dma_Bd* BdPtr, u32 Flags)
+     *    u32 Dma_mBdGetSwFlags(Dma_Bd* BdPtr)
+     *
+     *****************************************************************************/
+#define Dma_mBdSetSwFlags(BdPtr, Flags)                              \
+  (Dma_mBdWrite((BdPtr), DMA_BD_SWFLAGS_OFFSET, (u32)(Flags)))
+
+#define Dma_mBdGetSwFlags(BdPtr) (Dma_mBdRead((BdPtr), DMA_BD_SWFLAGS_OFFSET))
+
+
     /*****************************************************************************/
     /**
      * Set the BD's buffer address. The driver currently supports only
@@ -469,6 +494,38 @@ extern "C" {
     }
 
 
+    /*****************************************************************************/
+    /**
+     * Fill in a TX BD for a buffer of Len bytes: control flags and length,
+     * a clear status with the length the engine needs, user data and ID.
+     * Each word is stored once, without a read-modify-write, so the BD's
+     * cache line is written in a single pass. The buffer address comes from
+     * DmaMapBuf(); the card address and next BD pointer are left alone.
+     *
+     * @param  BdPtr is the BD to operate on
+     * @param  Ctrl is the control flags
+     * @param  Len is the buffer length
+     * @param  User is the user data
+     * @param  Id is the ID, see Dma_mBdSetId()
+     *
+     * @note
+     * C-style signature:
+     *    void Dma_mBdSetTx(Dma_Bd* BdPtr, u32 Ctrl, u32 Len,
+     *                      unsigned long long User, unsigned long Id)
+     *
+     *****************************************************************************/
+    static inline void Dma_mBdSetTx(Dma_Bd * BdPtr, u32 Ctrl, u32 Len,
+                                    unsigned long long User, unsigned long Id)
+    {
+        Dma_mBdWrite(BdPtr, DMA_BD_BUFL_STATUS_OFFSET, Len & DMA_BD_BUFL_MASK);
+        Dma_mBdWrite(BdPtr, DMA_BD_USRL_OFFSET, (u32)(User & 0xFFFFFFFFLL));
+        Dma_mBdWrite(BdPtr, DMA_BD_USRH_OFFSET, (u32)((User>>32) & 0xFFFFFFFFLL));
+        Dma_mBdWrite(BdPtr, DMA_BD_BUFL_CTRL_OFFSET,
+                     (Ctrl & DMA_BD_CTRL_MASK) | (Len & DMA_BD_BUFL_MASK));
+        Dma_mBdSetId(BdPtr, Id);
+    }
+
+
     /*****************************************************************************/
     /**
      * Compute the virtual address of a descriptor from its physical address
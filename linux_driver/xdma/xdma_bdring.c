@@ -89,6 +89,8 @@ int Dma_BdRingCreate(Dma_BdRing * RingPtr, Xaddr PhysAddr, Xaddr VirtAddr, u32 A
     RingPtr->PostCnt = 0;
     RingPtr->BDerrs = 0;
     RingPtr->BDSerrs = 0;
+    RingPtr->Unrung = 0;
+    RingPtr->DoorbellBatch = 1;
 
     /* Make sure Alignment parameter meets minimum requirements */
     if (Alignment < DMA_BD_MINIMUM_ALIGNMENT) {
@@ -218,6 +220,7 @@ int Dma_BdRingStart(Dma_BdRing * RingPtr)
     /* If there are unprocessed BDs then we want the channel to begin
      * processing right away.
      */
+    RingPtr->Unrung = 0;
     if (RingPtr->HwCnt > 0) 
     {
         Dma_mWriteReg(RingPtr->ChanBase, REG_SW_NEXT_BD, (u32)Dma_mVirtToPhys(RingPtr->HwTail)); //guodebug error prone
@@ -474,8 +477,11 @@ int Dma_BdRingToHw(Dma_BdRing * RingPtr, unsigned NumBd, Dma_Bd * BdSetPtr)
             break;
         }
 
-        /* Clear status field. */
-        Dma_mBdSetStatus(CurBdPtr, 0);
+        /* Clear status field. DmaSendPkt() writes TX BDs whole, with a
+         * clear status, so only RX BDs need the read-modify-write.
+         */
+        if (RingPtr->IsRxChannel)
+            Dma_mBdSetStatus(CurBdPtr, 0);
 
         CurBdPtr = Dma_mBdRingNext(RingPtr, CurBdPtr);
     }
@@ -498,27 +504,54 @@ int Dma_BdRingToHw(Dma_BdRing * RingPtr, unsigned NumBd, Dma_Bd * BdSetPtr)
     RingPtr->HwTail = CurBdPtr;
     RingPtr->HwCnt += NumBd;
 
-    /* If it was enabled, tell the engine to begin processing */
-    if (RingPtr->RunState == XST_DMA_SG_IS_STARTED) {
-
-        /* Ensure that all the descriptor updates are completed before
-         * informing the hardware.
-         */
-        wmb();
-
-        /* In NWL DMA engine, the tail descriptor pointer should actually
-         * point to the next (unused BD).
-         */
-        Dma_mWriteReg(RingPtr->ChanBase, REG_SW_NEXT_BD, (u32)Dma_mVirtToPhys(RingPtr->HwTail)); //guodebug: error prone
-        log_verbose(KERN_INFO "Writing %x into %x\n", Dma_mVirtToPhys(RingPtr->HwTail),
-                    (RingPtr->ChanBase+ REG_SW_NEXT_BD));
-    }
+    /* Tell the engine once enough BDs have piled up. The caller flushes
+     * whatever is left below DoorbellBatch with Dma_BdRingDoorbell().
+     */
+    RingPtr->Unrung += NumBd;
+    if (RingPtr->Unrung >= RingPtr->DoorbellBatch)
+        Dma_BdRingDoorbell(RingPtr);
     log_verbose(KERN_INFO "ToHw with %d BDs\n", NumBd);
 
     return (XST_SUCCESS);
 }
 
 
+/*****************************************************************************/
+/**
+ * Tell the engine about all the BDs given to it with Dma_BdRingToHw() so
+ * far, by moving its tail pointer. This is one uncached register write, so
+ * Dma_BdRingToHw() only does it once DoorbellBatch BDs are waiting.
+ *
+ * @param RingPtr is a pointer to the descriptor ring instance to be worked on.
+ *
+ * @note This function should not be preempted by another Dma_BdRing
+ *       function call that modifies the BD space. It is the caller's
+ *       responsibility to provide a mutual exclusion mechanism.
+ *
+ *****************************************************************************/
+void Dma_BdRingDoorbell(Dma_BdRing * RingPtr)
+{
+    /* If it was enabled, tell the engine to begin processing. Otherwise
+     * Dma_BdRingStart() will.
+     */
+    if ((RingPtr->Unrung == 0) || (RingPtr->RunState != XST_DMA_SG_IS_STARTED))
+        return;
+
+    /* Ensure that all the descriptor updates are completed before
+     * informing the hardware.
+     */
+    wmb();
+
+    /* In NWL DMA engine, the tail descriptor pointer should actually
+     * point to the next (unused BD).
+     */
+    Dma_mWriteReg(RingPtr->ChanBase, REG_SW_NEXT_BD, (u32)Dma_mVirtToPhys(RingPtr->HwTail)); //guodebug: error prone
+    log_verbose(KERN_INFO "Writing %x into %x\n", Dma_mVirtToPhys(RingPtr->HwTail),
+                (RingPtr->ChanBase+ REG_SW_NEXT_BD));
+    RingPtr->Unrung = 0;
+}
+
+
 /*****************************************************************************/
 /**
  * Returns a set of BDs that have been processed by hardware. The returned
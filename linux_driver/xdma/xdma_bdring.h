@@ -42,6 +42,10 @@ extern "C" {
 
         u32 BDerrs;             /**< Total BD errors reported by DMA */
         u32 BDSerrs;            /**< Total TX BD short errors reported by DMA */
+
+        u32 Unrung;             /**< BDs given to HW, engine not told yet */
+        u32 DoorbellBatch;      /**< Tell the engine once this many are
+                                     unrung; 1 tells it on every ToHw */
     } Dma_BdRing;
 
 
@@ -236,6 +240,7 @@ extern "C" {
     int Dma_BdRingAlloc(Dma_BdRing * RingPtr, unsigned NumBd, Dma_Bd ** BdSetPtr);
     int Dma_BdRingUnAlloc(Dma_BdRing * RingPtr, unsigned NumBd, Dma_Bd * BdSetPtr);
     int Dma_BdRingToHw(Dma_BdRing * RingPtr, unsigned NumBd, Dma_Bd * BdSetPtr);
+    void Dma_BdRingDoorbell(Dma_BdRing * RingPtr);
     unsigned Dma_BdRingFromHw(Dma_BdRing * RingPtr, unsigned BdLimit, Dma_Bd ** BdSetPtr);
     unsigned Dma_BdRingForceFromHw(Dma_BdRing * RingPtr, unsigned BdLimit, Dma_Bd ** BdSetPtr);
     int Dma_BdRingFree(Dma_BdRing * RingPtr, unsigned NumBd, Dma_Bd * BdSetPtr);
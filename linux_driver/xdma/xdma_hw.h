@@ -154,7 +154,12 @@ extern "C" {
     /***************** Macros (Inline Functions) Definitions *********************/
 
 #ifdef TH_BH_ISR
-#define INT_COAL_CNT        16  /* Interrupt coalesce count */
+#define INT_COAL_CNT        16  /* Initial interrupt coalesce count */
+#define INT_COAL_MIN        1   /* Bounds of the adaptive coalesce count */
+#define INT_COAL_MAX        256
+#define INT_FAST_US         100 /* Interrupts closer than this raise the count */
+#define INT_SLOW_US         1000 /* Interrupts further apart lower it */
+#define INT_POLL_BUDGET     8   /* Ring passes per BH run before yielding */
 #endif
 
     /* Basic DMA read/write functions - are 32-bit */
@@ -1,26 +1,54 @@
-static void IntrBH(unsigned long unused)
+/* Adapt the coalesce count of an engine to how often it interrupts.
+ * Interrupts that come too close together raise the count; interrupts
+ * that come seldom lower it, so a slow stream is not kept waiting for a
+ * count it rarely reaches. BDs left behind the last interrupting BD are
+ * picked up by poll_routine once the engine has been idle for twice the
+ * last interval.
+ */
+static void IntrAdapt(Dma_Engine * eptr)
+{
+    ktime_t now;
+    s64 us;
+    int max;
+
+    now = ktime_get();
+    us = ktime_us_delta(now, eptr->lastIntr);
+    eptr->lastIntr = now;
+
+    /* An interrupt every quarter ring at most, or the ring could stall */
+    max = (bd_cnt/4 < INT_COAL_MAX) ? bd_cnt/4 : INT_COAL_MAX;
+    if((us < INT_FAST_US) && (eptr->intrCoal < max))
+        eptr->intrCoal <<= 1;
+    else if((us > INT_SLOW_US) && (eptr->intrCoal > INT_COAL_MIN))
+        eptr->intrCoal >>= 1;
+
+    if(us > 1000000)
+        us = 1000000;
+    eptr->intrTimeout = usecs_to_jiffies((unsigned int)(2*us));
+    if(eptr->intrTimeout < 1)
+        eptr->intrTimeout = 1;
+    if(eptr->intrTimeout > HZ/50)
+        eptr->intrTimeout = HZ/50;
+}
+
+static void IntrBoardBH(struct privData *lp)
 {
-    struct pci_dev *pdev;
-    struct privData *lp;
     Dma_Engine * eptr;
     unsigned long flags;
-    int i;
-
-    pdev = dmaData->pdev;
-    lp = pci_get_drvdata(pdev);
+    int i, pass, result = 0;
 
-    log_verbose("IntrBH with PendingMask %llx\n", PendingMask);
+    log_verbose("IntrBH board %d with PendingMask %llx\n", lp->board, lp->PendingMask);
 
     //while(PendingMask)
-    for(i=0; PendingMask && i<MAX_DMA_ENGINES; i++)
+    for(i=0; lp->PendingMask && i<MAX_DMA_ENGINES; i++)
     {
-        if(!(PendingMask & (1LL << i))) continue;
+        if(!(lp->PendingMask & (1LL << i))) continue;
         spin_lock_irqsave(&IntrLock, flags);
 
         /* At this point, we have engine identified. */
 
         /* First, reset mask bit */
-        PendingMask &= ~(1LL << i);
+        lp->PendingMask &= ~(1LL << i);
 
         spin_unlock_irqrestore(&IntrLock, flags);
 
@@ -29,20 +57,45 @@ static void IntrBH(unsigned long unused)
             continue;
 
         /* The spinlocks need to be handled within this function, so
-         * don't do them here.
+         * don't do them here. Keep going, with the engine interrupt off,
+         * until a pass finds the ring drained.
          */
-
-        PktHandler(i, eptr);
+        for(pass=0; pass<INT_POLL_BUDGET; pass++)
+        {
+            if((result = PktHandler(i, eptr)) <= 0)
+                break;
+        }
 
         spin_lock_irqsave(&IntrLock, flags);
-        Dma_mEngIntEnable(eptr);
+        if((pass == INT_POLL_BUDGET) || (result == -EBUSY))
+        {
+            /* Still busy, or another context has the ring and may leave
+             * BDs behind. Come back later, leaving the interrupt off.
+             */
+            lp->PendingMask |= (1LL << i);
+            tasklet_schedule(&DmaBH);
+        }
+        else
+        {
+            IntrAdapt(eptr);
+            Dma_mEngIntEnable(eptr);
+        }
 
         /* Update flag to synchronise between ISR and poll_routine */
-        LastIntr[i] = jiffies;
+        lp->LastIntr[i] = jiffies;
         spin_unlock_irqrestore(&IntrLock, flags);
     }
 }
 
+/* One tasklet serves all boards; each keeps its own pending mask. */
+static void IntrBH(unsigned long unused)
+{
+    int b;
+
+    for(b=0; b<NumBoards; b++)
+        IntrBoardBH(dmaBoards[b]);
+}
+
 
 
 u32 Acks(u32 dirqval)
@@ -117,7 +170,7 @@ int IntrCheck(struct pci_dev * dev) //guodebug: error prone
             if(dirqval & DMA_ENG_INT_BDCOMP)
             {
                 //Dma_mEngIntDisable(eptr); // Already disabled
-                PendingMask |= (1LL << i);
+                lp->PendingMask |= (1LL << i);
             }
             spin_unlock(&IntrLock);
 
@@ -157,7 +210,7 @@ int IntrCheck(struct pci_dev * dev) //guodebug: error prone
             if(dirqval & DMA_ENG_INT_BDCOMP)
             {
                 Dma_mEngIntDisable(eptr);
-                PendingMask |= (1LL << i);
+                lp->PendingMask |= (1LL << i);
             }
             spin_unlock(&IntrLock);
 
@@ -169,7 +222,7 @@ int IntrCheck(struct pci_dev * dev) //guodebug: error prone
     }
 
     spin_lock(&IntrLock);
-    if(PendingMask && (retval == XST_SUCCESS))
+    if(lp->PendingMask && (retval == XST_SUCCESS))
     {
         tasklet_schedule(&DmaBH);
     }
@@ -26,6 +26,7 @@
 #include <linux/timer.h>
 #include <linux/jiffies.h>
 #include <linux/pci.h>
+#include <linux/slab.h>
 
 #include "xdebug.h"
 #include "xstatus.h"
@@ -40,6 +41,9 @@
 #ifdef DEBUG_VERBOSE
 extern void disp_frag(unsigned char * addr, u32 len);
 #endif
+extern int DmaAllocPktArrays(Dma_Engine * eptr);
+extern void DmaFreePktArrays(Dma_Engine * eptr);
+extern void DmaDoorbellLater(Dma_Engine * eptr);
 
 /*****************************************************************************/
 /**
@@ -52,6 +56,7 @@ extern void disp_frag(unsigned char * addr, u32 len);
  * engine has already been registered with another user driver, an error
  * will be returned.
  *
+ * @param board is the board, in probe order, that owns the engine.
  * @param engine is the DMA engine the user driver wants to use.
  * @param bar is the BAR register the user driver wants to use.
  * @param uptr is a pointer to the function callbacks in the user driver.
@@ -64,13 +69,14 @@ extern void disp_frag(unsigned char * addr, u32 len);
  * @note This function should not be called in an interrupt context
  *
  *****************************************************************************/
-void * DmaRegister(int engine, int bar, UserPtrs * uptr, int pktsize)
+void * DmaRegisterBoard(int board, int engine, int bar, UserPtrs * uptr, int pktsize)
 {
+    struct privData *lp;
     Dma_Engine * eptr;
     Xaddr barbase;
     int result;
 
-    log_verbose(KERN_INFO "User register for engine %d, BAR %d, pktsize %d\n", engine, bar, pktsize);
+    log_verbose(KERN_INFO "User register for board %d engine %d, BAR %d, pktsize %d\n", board, engine, bar, pktsize);
 
     if(DriverState != INITIALIZED)
     {
@@ -78,17 +84,23 @@ void * DmaRegister(int engine, int bar, UserPtrs * uptr, int pktsize)
         return NULL;
     }
 
+    if((board < 0) || (board >= NumBoards)) {
+        printk(KERN_ERR "Requested board %d is not present\n", board);
+        return NULL;
+    }
+    lp = dmaBoards[board];
+
     if((bar < 0) || (bar > 5)) {
         printk(KERN_ERR "Requested BAR %d is not valid\n", bar);
         return NULL;
     }
 
-    if(!((dmaData->engineMask) & (1LL << engine))) {
+    if(!((lp->engineMask) & (1LL << engine))) {
         printk(KERN_ERR "Requested engine %d does not exist\n", engine);
         return NULL;
     }
-    eptr = &(dmaData->Dma[engine]);
-    barbase = (Xaddr)(dmaData->barInfo[bar].baseVAddr);
+    eptr = &(lp->Dma[engine]);
+    barbase = (Xaddr)(lp->barInfo[bar].baseVAddr);
     log_verbose("guodebug DmaReg: barbase = %p\n", barbase);
 
     if(eptr->EngineState != INITIALIZED) {
@@ -107,10 +119,22 @@ void * DmaRegister(int engine, int bar, UserPtrs * uptr, int pktsize)
     eptr->user = *uptr;
     eptr->pktSize = pktsize;
 
+#ifdef TH_BH_ISR
+    /* Start from the default coalescing; the BH adapts it from here on */
+    eptr->intrCount = 0;
+    eptr->intrCoal = INT_COAL_CNT;
+    eptr->lastIntr = ktime_get();
+    eptr->intrTimeout = HZ / 50;
+#endif
+
+    /* Packet arrays for passing completions, sized to the BD ring */
+    if(DmaAllocPktArrays(eptr))
+        return NULL;
+
     /* Should check for errors returned here !!!! */
     (uptr->UserInit)(barbase, uptr->privData);
 
-    spin_lock_bh(&DmaLock);
+    spin_lock_bh(&eptr->Lock);
 
     /* Should inform the user of the errors !!!! */
     result = descriptor_init(eptr->pdev, eptr);
@@ -125,11 +149,28 @@ void * DmaRegister(int engine, int bar, UserPtrs * uptr, int pktsize)
 
     /* Change the state of the engine, and increment the user count */
     eptr->EngineState = USER_ASSIGNED;
-    dmaData->userCount ++ ;
+    lp->userCount ++ ;
 
     /* Start the DMA engine */
     if (Dma_BdRingStart(&(eptr->BdRing)) == XST_FAILURE) {
         log_normal(KERN_ERR "DmaRegister: Could not start Dma channel\n");
+
+        /* Undo the above, so that the engine can be registered again.
+         * Keep the poll and reap paths off the ring while it goes away.
+         * The user does not have the handle yet, so the buffers on the
+         * ring are not passed back to it.
+         */
+        eptr->EngineState = UNREGISTERING;
+        Dma_Reset(eptr);
+        spin_unlock_bh(&eptr->Lock);
+        if (!result)
+            descriptor_free(eptr->pdev, eptr, 0);
+        DmaFreePktArrays(eptr);
+
+        spin_lock_bh(&eptr->Lock);
+        eptr->EngineState = INITIALIZED;
+        lp->userCount --;
+        spin_unlock_bh(&eptr->Lock);
         return NULL;
     }
 
@@ -138,13 +179,43 @@ void * DmaRegister(int engine, int bar, UserPtrs * uptr, int pktsize)
     Dma_mEngIntEnable(eptr);
 #endif
 
-    spin_unlock_bh(&DmaLock);
+    spin_unlock_bh(&eptr->Lock);
 
     log_verbose(KERN_INFO "Returning user handle %p\n", eptr);
 
     return eptr;
 }
 
+/*****************************************************************************/
+/**
+ * Registers with an engine on the first board. Kept for user drivers that
+ * only drive a single board.
+ *
+ * @param engine is the DMA engine the user driver wants to use.
+ * @param bar is the BAR register the user driver wants to use.
+ * @param uptr is a pointer to the function callbacks in the user driver.
+ * @param pktsize is the size of packets that the user driver will normally
+ *        use.
+ *
+ * @return Same as DmaRegisterBoard().
+ *
+ *****************************************************************************/
+void * DmaRegister(int engine, int bar, UserPtrs * uptr, int pktsize)
+{
+    return DmaRegisterBoard(0, engine, bar, uptr, pktsize);
+}
+
+/*****************************************************************************/
+/**
+ * Returns the number of boards found by the PCI probe. Boards are numbered
+ * from 0 in probe order.
+ *
+ *****************************************************************************/
+int DmaNumBoards(void)
+{
+    return NumBoards;
+}
+
 /*****************************************************************************/
 /**
  * This function must be called by the user driver to unregister itself from
@@ -164,6 +235,7 @@ void * DmaRegister(int engine, int bar, UserPtrs * uptr, int pktsize)
  *****************************************************************************/
 int DmaUnregister(void * handle)
 {
+    struct privData *lp;
     Dma_Engine * eptr;
 
     printk(KERN_INFO "User unregister for handle %p\n", handle);
@@ -188,7 +260,7 @@ int DmaUnregister(void * handle)
         return XST_FAILURE;
     }
 
-    spin_lock_bh(&DmaLock);
+    spin_lock_bh(&eptr->Lock);
 
     /* Change DMA engine state */
     eptr->EngineState = UNREGISTERING;
@@ -202,17 +274,19 @@ int DmaUnregister(void * handle)
      */
 
     printk("Now checking all descriptors\n");
-    spin_unlock_bh(&DmaLock);
-    descriptor_free(eptr->pdev, eptr);
-    spin_lock_bh(&DmaLock);
+    spin_unlock_bh(&eptr->Lock);
+    descriptor_free(eptr->pdev, eptr, 1);
+    DmaFreePktArrays(eptr);
+    spin_lock_bh(&eptr->Lock);
 
     /* Change DMA engine state */
     eptr->EngineState = INITIALIZED;
-    dmaData->userCount --;
+    lp = pci_get_drvdata(eptr->pdev);
+    lp->userCount --;
 
-    printk("DMA driver user count is %d\n", dmaData->userCount);
+    printk("DMA driver board %d user count is %d\n", lp->board, lp->userCount);
 
-    spin_unlock_bh(&DmaLock);
+    spin_unlock_bh(&eptr->Lock);
 
     return 0;
 }
@@ -300,7 +374,7 @@ int DmaSendPkt(void * handle, PktBuf * pkts, int numpkts)
     lp = pci_get_drvdata(pdev);
 
     /* Protect this entry point from the handling of sent packets */
-    spin_lock_bh(&DmaLock);
+    spin_lock_bh(&eptr->Lock);
 
     /* Ensure that requested number of packets can be queued up */
     free_bd_count = Dma_mBdRingGetFreeCnt(rptr);
@@ -321,7 +395,7 @@ int DmaSendPkt(void * handle, PktBuf * pkts, int numpkts)
     else
     {
         log_verbose(KERN_ERR "Not enough BDs to handle %d pkts\n", numpkts);
-        spin_unlock_bh(&DmaLock);
+        spin_unlock_bh(&eptr->Lock);
         return 0;
     }
 
@@ -336,7 +410,7 @@ int DmaSendPkt(void * handle, PktBuf * pkts, int numpkts)
     if (result != XST_SUCCESS) {
         /* we really shouldn't get this */
         printk(KERN_ERR "DmaSendPkt: BdRingAlloc unsuccessful (%d)\n", result);
-        spin_unlock_bh(&DmaLock);
+        spin_unlock_bh(&eptr->Lock);
         return 0;
     }
 
@@ -345,15 +419,10 @@ int DmaSendPkt(void * handle, PktBuf * pkts, int numpkts)
     for(i=0; i<numpkts; i++)
     {
         pbuf = &(pkts[i]);
-        bufPA = pci_map_single(pdev, pbuf->pktBuf, pbuf->size, PCI_DMA_TODEVICE);
+        bufPA = DmaMapBuf(pdev, BdCurPtr, pbuf, PCI_DMA_TODEVICE);
         log_verbose(KERN_INFO "DmaSendPkt: BD %x buf PA %x VA %x size %d\n",
                     (u32)BdCurPtr, bufPA, (u32) (pbuf->pktBuf), pbuf->size);
 
-        Dma_mBdSetBufAddr(BdCurPtr, bufPA);
-        Dma_mBdSetCtrlLength(BdCurPtr, pbuf->size);
-        Dma_mBdSetStatLength(BdCurPtr, pbuf->size); // Required for TX BDs
-        Dma_mBdSetId(BdCurPtr, (unsigned long)pbuf->bufInfo); //guodebug: error prone
-
         uflags = pbuf->flags;
         flags = 0;
         if(uflags & DMA_BD_SOP_MASK)
@@ -375,20 +444,20 @@ int DmaSendPkt(void * handle, PktBuf * pkts, int numpkts)
         //printk("partialBDcount = %d partialOK = %d PartialBDPtr = %x\n",
         //                        partialBDcount, partialOK, (u32)PartialBDPtr);
 
-        Dma_mBdSetCtrl(BdCurPtr, flags);                 // No ints also.
-        Dma_mBdSetUserData(BdCurPtr, pbuf->userInfo);
-
 #ifdef TH_BH_ISR
         /* Enable interrupts for errors and completion based on
          * coalesce count.
          */
         flags |= DMA_BD_INT_ERROR_MASK;
-        if(!(eptr->intrCount % INT_COAL_CNT))
+        if(!(eptr->intrCount % eptr->intrCoal))
             flags |= DMA_BD_INT_COMP_MASK;
         eptr->intrCount += 1;
-        Dma_mBdSetCtrl(BdCurPtr, flags);
 #endif
 
+        /* All fields at once; the status length is required for TX BDs */
+        Dma_mBdSetTx(BdCurPtr, flags, pbuf->size, pbuf->userInfo,
+                     (unsigned long)pbuf->bufInfo); //guodebug: error prone
+
         log_verbose("DmaSendPkt: free %d BD %x buf PA %x VA %x size %d flags %x\n",
                     free_bd_count, (u32)BdCurPtr, bufPA, (u32) (pbuf->pktBuf),
                     pbuf->size, flags);
@@ -436,9 +505,8 @@ int DmaSendPkt(void * handle, PktBuf * pkts, int numpkts)
 
         for(i=0; i<count; i++)
         {
-            bufPA = Dma_mBdGetBufAddr(BdCurPtr);
             len = Dma_mBdGetCtrlLength(BdCurPtr);
-            pci_unmap_single(pdev, bufPA, len, PCI_DMA_TODEVICE);
+            DmaUnmapBuf(pdev, BdCurPtr, len, PCI_DMA_TODEVICE);
             Dma_mBdSetId(BdCurPtr, 0LL);
             BdCurPtr = Dma_mBdRingNext(rptr, BdCurPtr);
         }
@@ -446,8 +514,188 @@ int DmaSendPkt(void * handle, PktBuf * pkts, int numpkts)
         numpkts -= count;
     }
 
-    spin_unlock_bh(&DmaLock);
+    /* Dma_BdRingToHw() rings only for full batches; flush the rest soon */
+    DmaDoorbellLater(eptr);
+
+    spin_unlock_bh(&eptr->Lock);
 
     log_verbose("DmaSendPkt: Successfully transmitted %d buffers\n", numpkts);
     return numpkts;
 }
+
+/* Free a pool buffer of 2^order pages. They were split on allocation. */
+static void DmaFreePages(unsigned char * bufVA, int order)
+{
+    int i;
+
+    for(i = 0; i < (1 << order); i++)
+        free_page((unsigned long)(bufVA + i * PAGE_SIZE));
+}
+
+/*****************************************************************************/
+/**
+ * This function allocates a pool of DMA buffers for a board and maps them
+ * once, for as long as the pool exists. The pages come from the board's
+ * NUMA node, and from below 4 GB since BDs only hold 32-bit addresses, so
+ * that mapping never has to bounce them. A buffer bigger than a page is
+ * physically contiguous, but made of separate pages, so that user drivers
+ * can map each page to user space. Packets using these buffers are queued
+ * with PKT_MAPPED set, and are only synced on the way in and out.
+ *
+ * @param board is the board, in probe order, that will DMA to the buffers.
+ * @param numbufs is the number of buffers wanted.
+ * @param bufsize is the size of each buffer.
+ * @param dir is PCI_DMA_TODEVICE for TX buffers, or PCI_DMA_FROMDEVICE for
+ *        RX buffers.
+ *
+ * @return NULL incase no buffer at all could be allocated.
+ * @return Pool, with numBufs set to the number of buffers allocated.
+ *
+ * @note This function should not be called in an interrupt context
+ *
+ *****************************************************************************/
+DmaPool * DmaPoolCreate(int board, int numbufs, unsigned int bufsize, int dir)
+{
+    struct pci_dev * pdev;
+    DmaPool * pool;
+    struct page * pg;
+    unsigned char * bufVA;
+    dma_addr_t bufPA;
+    int node, order, i;
+
+    if((board < 0) || (board >= NumBoards) || (numbufs <= 0))
+    {
+        printk(KERN_ERR "DmaPoolCreate: Board %d, %d buffers not valid\n",
+                                                            board, numbufs);
+        return NULL;
+    }
+
+    pdev = dmaBoards[board]->pdev;
+    node = dev_to_node(&pdev->dev);
+    order = get_order(bufsize);
+
+    if((pool = kzalloc(sizeof(DmaPool), GFP_KERNEL)) == NULL)
+        return NULL;
+    pool->bufVA = kzalloc(numbufs * sizeof(unsigned char *), GFP_KERNEL);
+    pool->bufPA = kzalloc(numbufs * sizeof(dma_addr_t), GFP_KERNEL);
+    if((pool->bufVA == NULL) || (pool->bufPA == NULL))
+    {
+        printk(KERN_ERR "DmaPoolCreate: Unable to allocate pool\n");
+        kfree(pool->bufVA);
+        kfree(pool->bufPA);
+        kfree(pool);
+        return NULL;
+    }
+    pool->pdev = pdev;
+    pool->dir = dir;
+    pool->bufSize = bufsize;
+
+    for(i = 0; i < numbufs; i++)
+    {
+        if((pg = alloc_pages_node(node, GFP_KERNEL | GFP_DMA32, order)) == NULL)
+        {
+            printk(KERN_ERR "DmaPoolCreate: Unable to allocate buffer %d\n", i);
+            break;
+        }
+        if(order)
+            split_page(pg, order);
+        bufVA = (unsigned char *) page_address(pg);
+        bufPA = pci_map_single(pdev, bufVA, bufsize, dir);
+        if(pci_dma_mapping_error(pdev, bufPA))
+        {
+            printk(KERN_ERR "DmaPoolCreate: Unable to map buffer %d\n", i);
+            DmaFreePages(bufVA, order);
+            break;
+        }
+        pool->bufVA[i] = bufVA;
+        pool->bufPA[i] = bufPA;
+    }
+    pool->numBufs = i;
+
+    if(!i)
+    {
+        DmaPoolDestroy(pool);
+        return NULL;
+    }
+
+    log_normal(KERN_INFO "DmaPoolCreate: %d buffers of %d bytes on node %d\n",
+                                                    i, bufsize, node);
+    return pool;
+}
+
+/*****************************************************************************/
+/**
+ * This function unmaps and frees a pool created by DmaPoolCreate(). No
+ * engine may still have any of its buffers queued.
+ *
+ * @param pool is the pool to free.
+ *
+ *****************************************************************************/
+void DmaPoolDestroy(DmaPool * pool)
+{
+    int order, i;
+
+    if(pool == NULL)
+        return;
+
+    order = get_order(pool->bufSize);
+    for(i = 0; i < pool->numBufs; i++)
+    {
+        pci_unmap_single(pool->pdev, pool->bufPA[i], pool->bufSize, pool->dir);
+        DmaFreePages(pool->bufVA[i], order);
+    }
+    kfree(pool->bufVA);
+    kfree(pool->bufPA);
+    kfree(pool);
+}
+
+/*****************************************************************************/
+/**
+ * This function maps one page for DMA by a board, for a buffer that is
+ * queued only once, such as a pinned user page. It is queued with
+ * PKT_MAPPED and bufPA set, like a pool buffer, and must be unmapped with
+ * DmaUnmapPage() once it has been returned.
+ *
+ * @param board is the board, in probe order, that will DMA to the page.
+ * @param pg is the page.
+ * @param len is the number of bytes used, from the start of the page.
+ * @param dir is PCI_DMA_TODEVICE or PCI_DMA_FROMDEVICE.
+ * @param pa returns the bus address.
+ *
+ * @return 0 on success, -1 if the page could not be mapped.
+ *
+ *****************************************************************************/
+int DmaMapPage(int board, struct page * pg, unsigned int len, int dir, dma_addr_t * pa)
+{
+    struct pci_dev * pdev;
+
+    if((board < 0) || (board >= NumBoards))
+        return -1;
+
+    pdev = dmaBoards[board]->pdev;
+    *pa = pci_map_page(pdev, pg, 0, len, dir);
+    if(pci_dma_mapping_error(pdev, *pa))
+    {
+        printk(KERN_ERR "DmaMapPage: Unable to map page for board %d\n", board);
+        return -1;
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+/**
+ * This function unmaps a page mapped by DmaMapPage().
+ *
+ * @param board is the board the page was mapped for.
+ * @param pa is the bus address returned by DmaMapPage().
+ * @param len is the length it was mapped with.
+ * @param dir is the direction it was mapped with.
+ *
+ *****************************************************************************/
+void DmaUnmapPage(int board, dma_addr_t pa, unsigned int len, int dir)
+{
+    if((board < 0) || (board >= NumBoards))
+        return;
+
+    pci_unmap_page(dmaBoards[board]->pdev, pa, len, dir);
+}
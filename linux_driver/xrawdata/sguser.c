@@ -82,6 +82,20 @@
 #include <asm/uaccess.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <asm/atomic.h>
 
 #include "xdma_user.h"
 #include "xpmon_be.h"
@@ -91,10 +105,6 @@
 
 #define USER_DATA
 // #define WY_TEST
-#define WY_NEW_LOCK
-#ifdef WY_NEW_LOCK
-static volatile bool is_read_busy = false;
-#endif   
 
 #define XDMA_FILENAME    "/dev/xdma_stat"
 
@@ -108,26 +118,9 @@ static volatile bool is_read_busy = false;
 /* DMA characteristics */
 #define MYBAR           0
 
-#ifdef XAUI
-#define MYNAME  "XAUI"
-#else
 #define MYNAME   "Raw Data"
-#endif
-
-#ifdef XAUI
-
-#define TX_CONFIG_ADDRESS       0x9008
-#define LINK_STATUS_ADDRESS     0x900C
-
-/* Test start / stop conditions */
-#define LOOPBACK            0x0001
-
-/* Link status conditions */
-#define RX_LINK_UP          0x00000080  /**< RX link up / down */
-#define RX_ALIGNED          0x00000040  /**< RX link aligned */
-
-#else
 
+/* Raw data path registers */
 #define TIMING_STATUS       0x9000	// Reg for HW counter - ms and chip counter
 #define RF_CONTROL          0x9008	// Reg for RF command
 #define TX_CONFIG_ADDRESS   0x9108  /* Reg for controlling TX data */
@@ -137,37 +130,86 @@ static volatile bool is_read_busy = false;
 
 /* Test start / stop conditions */
 #define LOOPBACK            0x00000002  /* Enable TX data loopback onto RX */
-#endif
+
+/* XAUI path registers, as in the XAUI reference design. They share the
+ * 0x9000 block with TIMING_STATUS and RF_CONTROL, so a bitstream has
+ * either the XAUI path or the RF control, not both. With xaui set, the
+ * raw data devices leave that block alone too.
+ */
+#define XAUI_TX_CONFIG_ADDRESS  0x9008
+#define XAUI_LINK_STATUS_ADDRESS 0x900C
+
+/* Test start / stop conditions */
+#define XAUI_LOOPBACK       0x0001
+
+/* Link status conditions */
+#define RX_LINK_UP          0x00000080  /**< RX link up / down */
+#define RX_ALIGNED          0x00000040  /**< RX link aligned */
 
 /* Test start / stop conditions */
 #define PKTCHKR             0x00000001  /* Enable TX packet checker */
 #define PKTGENR             0x00000001  /* Enable RX packet generator */
 #define CHKR_MISMATCH       0x00000001  /* TX checker reported data mismatch */
 
-#ifdef XAUI
-#define ENGINE_TX       0
-#define ENGINE_RX       32
-#else
 #define ENGINE_TX       1
 #define ENGINE_RX       33
-#endif
+#define XAUI_ENGINE_TX  0
+#define XAUI_ENGINE_RX  32
 
-/* Packet characteristics */
-#define BUFSIZE         (PAGE_SIZE)
-#ifdef XAUI
-#define MAXPKTSIZE      (4*PAGE_SIZE)
-#else
+/* Rx stream s of a board comes from C2S engine ENGINE_RX+s, into a RawDev
+ * and device minor of its own. Stream 0 is the board's minor as before.
+ * The XAUI engine pair of a board, when enabled, is one more RawDev in
+ * the slot after the last stream.
+ */
+#define XAUI_SLOT                   ML605_XAUI_STREAM
+#define RAW_MINOR(board, stream)    ((stream) * MAX_BOARDS + (board))
+#define MAX_RAW_DEVS                (MAX_BOARDS * (ML605_MAX_STREAMS + 1))
+
+/* What differs between a raw data and a XAUI device */
+#define DevName(dev)        ((dev)->Xaui ? "XAUI" : MYNAME)
+#define DevTxConfig(dev)    ((dev)->Xaui ? XAUI_TX_CONFIG_ADDRESS : TX_CONFIG_ADDRESS)
+#define DevLoopback(dev)    ((dev)->Xaui ? XAUI_LOOPBACK : LOOPBACK)
+#define DevMaxPktSize(dev)  ((dev)->Xaui ? XAUI_MAXPKTSIZE : MAXPKTSIZE)
+#define DevHasRf(dev)       (!(dev)->Xaui && !xaui)
+
+/* Packet characteristics. Each buffer is buf_pages pages, so that a
+ * packet of up to MAXPKTSIZE can take a single BD; a larger packet is
+ * chained over several buffers with SOP/EOP.
+ */
+#define BUFSIZE         ((int)(buf_pages * PAGE_SIZE))
 #define MAXPKTSIZE      (8*PAGE_SIZE)
-#endif
+#define XAUI_MAXPKTSIZE (4*PAGE_SIZE)
 #define MINPKTSIZE      (64)
-#define NUM_BUFS        2000
+#define NUM_BUFS        2000        /**< Default TX and RX buffers per board */
+#define NUM_BUFS_MIN    64
+#define NUM_BUFS_MAX    65536
+#define STATUS_PERIOD_US    100     /**< Status page refresh period */
+#define RF_CMD_FIFO_LEN     64      /**< RF commands queued, power of 2 */
+#define RF_CMD_STROBE_US    40      /**< RF cmd send signal pulse width */
 #define BUFALIGN        8
 #define BYTEMULTIPLE    8   /**< Lowest sub-multiple of memory path */
 
-// raw data character driver related variables
+/* Ring depth and buffer size, set at load time */
+static int num_bufs = NUM_BUFS;
+module_param(num_bufs, int, S_IRUGO);
+MODULE_PARM_DESC(num_bufs, "TX and RX buffers per board (default 2000)");
+
+static int buf_pages = 1;
+module_param(buf_pages, int, S_IRUGO);
+MODULE_PARM_DESC(buf_pages, "Pages per buffer, up to MAXPKTSIZE (default 1)");
+
+static int rx_streams = 1;
+module_param(rx_streams, int, S_IRUGO);
+MODULE_PARM_DESC(rx_streams, "C2S engines per board, each with its own minor (default 1)");
+
+static int xaui = 0;
+module_param(xaui, int, S_IRUGO);
+MODULE_PARM_DESC(xaui, "Also run the XAUI engine pair of each board on its own minor (default 0)");
+
+// raw data character driver related variables. One minor per board and
+// Rx stream.
 struct cdev * rawdataCdev = NULL;
-static int UserOpen = 0;
-static const int kMaxUserOpen = 2;
+static const int kMaxUserOpen = 4;
 // static char TestBuf[BUFSIZE];
 
 static int rawdata_dev_open(struct inode * in, struct file * filp);
@@ -183,57 +225,223 @@ static ssize_t rawdata_dev_read(struct file *filp, char __user *buf,
                                 size_t count, loff_t *f_pos);
 static ssize_t rawdata_dev_write(struct file *filp, const char __user *buf,
                                  size_t count, loff_t *f_pos);
+static int rawdata_dev_mmap(struct file *filp, struct vm_area_struct *vma);
+static unsigned int rawdata_dev_poll(struct file *filp, poll_table *wait);
 
-int DriverState = UNINITIALIZED;
-struct timer_list poll_timer;
-void * handle[4] = {NULL, NULL, NULL, NULL};
-unsigned long TXbarbase, RXbarbase;
-u32 polldata = 0xaa55;
-u32 RawTestMode = TEST_STOP;
-u32 RawMinPktSize=MINPKTSIZE, RawMaxPktSize=MAXPKTSIZE;
-
+/* Everything about one buffer, kept together so that handling a packet
+ * touches a single entry. A PktBuf carries its BufDesc in bufInfo.
+ */
+typedef struct {
+    unsigned char * VA;                 // Pool->bufVA[Index]
+    dma_addr_t PA;                      // Pool->bufPA[Index]
+    unsigned int Len;                   // valid bytes, for Rx
+    u32 Stamp;                          // TIMING_STATUS at Rx completion
+    int Index;                          // buffer number, also in the mmap()
+} BufDesc;
+
+/* Buffers are handed out from a bitmap of free ones, and may come back in
+ * any order. The bitmap is only changed with atomic bit operations, so
+ * AllocBuf() and FreeBuf() can be called from any side without a lock.
+ * FreeNum follows the bitmap and may briefly lag it.
+ */
 typedef struct {
     int TotalNum;
-    int AllocNum;
-    int FirstBuf;
-    int LastBuf;
-    int FreePtr;
-    int AllocPtr;
-    unsigned char * origVA[NUM_BUFS];
+    atomic_t FreeNum;                   // buffers set in FreeMap
+    int NextFree;                       // where AllocBuf() starts looking
+    unsigned long * FreeMap;            // bit i set while buffer i is free
+    BufDesc * Desc;                     // one per buffer
+    DmaPool * Pool;                     // buffers, mapped once by xdma
     // below fields are inserted in order to support user application data Rx
-    int RxNum;
-    int RxTotalBytes;
-    int rxBytes[NUM_BUFS];
+    volatile unsigned long long RxProduced;  // pages completed by DMA
+    BufDesc ** RxQueue;                 // completed buffer in each Rx slot
 } Buffer;
 
-Buffer TxBufs;
-Buffer RxBufs;
-PktBuf pkts[NUM_BUFS];
+#define BufAllocNum(bptr)   ((bptr)->TotalNum - atomic_read(&(bptr)->FreeNum))
 
-/* For exclusion */
-spinlock_t RawLock;
-// July 6, 2012, WANG Yang. Specific lock for read operation.
-spinlock_t RawReadLock;
+/* A user page pinned for zero-copy Tx, from RD_CMD_TX_ZERO_COPY until its
+ * DMA completes. A PktBuf carries its TxPin in bufInfo, like a BufDesc.
+ */
+typedef struct {
+    struct page * Page;                 // NULL while the entry is free
+    dma_addr_t PA;                      // mapped by DmaMapPage()
+    unsigned int Len;
+} TxPin;
+
+/* Counters of one direction. Each CPU counts in its own copy, so the data
+ * path never shares a cache line for them; RawGetStats() adds them up.
+ */
+typedef struct {
+    u64 Bufs;                       /**< Buffers completed by DMA */
+    u64 Bytes;                      /**< Bytes in them */
+    u64 Drops;                      /**< Tx: not sent. Rx: skipped by lossy readers */
+    u64 RingFull;                   /**< Times no free buffer was left */
+    u64 StarvedUs;                  /**< Time spent with no free buffer */
+    u32 HighWater;                  /**< Most buffers in use at once */
+} RawDirStats;
+
+typedef struct {
+    RawDirStats Tx;
+    RawDirStats Rx;
+    u64 Errors;                     /**< Rx data check failures */
+} RawStats;
+
+#define RawStatAdd(dev, field, n)   this_cpu_add((dev)->Stats->field, (n))
+#define RawStatInc(dev, field)      this_cpu_inc((dev)->Stats->field)
+
+/* One open of the raw data device. Every reader has its own cursor into
+ * the Rx queue and sees the whole stream from its first read() on. Opens
+ * that never read, e.g. for control ioctls only, do not hold any pages.
+ *
+ * A lossy reader holds its pages like any other until RxBufs runs out.
+ * Then the pages it has not got to, outside read(), may be given back to
+ * DMA, and it skips ahead.
+ */
+typedef struct {
+    struct list_head List;          /**< On RawDev Readers */
+    struct RawDevTag * Dev;
+    unsigned long long Consumer;    /**< Next Rx page to read */
+    unsigned int HeadOffset;        /**< Bytes of that page already read */
+    int Started;                    /**< Has read, Consumer is valid */
+    int Lossy;                      /**< May be overrun by DMA */
+    int Busy;                       /**< Copying pages out in read() */
+    int RingMapped;                 /**< Has mmap()ed the zero-copy ring */
+    unsigned int FrameLen;          /**< Framed read mode if not 0 */
+    unsigned long long FrameSeen;   /**< RxProduced when no frame was found */
+    u32 ReadStamp;                  /**< Stamp of the first page of the last read() */
+    unsigned long long Dropped;     /**< Pages skipped while lossy */
+    struct mutex Mutex;             /**< Serialises read() on this open */
+} RawReader;
+
+/* Zero-copy Rx ring. The control area is shared with user space through
+ * mmap(), and is followed in the mapping by the RxBufs pages themselves.
+ * Completed buffers are queued in RxQueue, and in the desc[] of the
+ * control area, in the order DMA filled them.
+ *
+ * RxBufs is refilled by the DMA side (myGetRxPkt/myPutRxPkt), which runs
+ * from a single context per engine. Readers never touch it: read() only
+ * advances the reader's cursor and the zero-copy API the ring consumer.
+ * On its next refill the DMA side returns the pages every reader has
+ * passed to RxBufs. RxRingConsumer counts the pages already returned;
+ * it and the reader cursors are kept under RxReaderLock.
+ *
+ * The status page is mapped read-only by user space. While it is mapped,
+ * StatusTimer refreshes it every STATUS_PERIOD_US, so the HW timer and
+ * ring levels can be polled without a system call.
+ *
+ * All of the above is kept per Rx stream in a RawDev, found from the
+ * device minor number on the file side and from privData on the DMA side.
+ * Stream 0 also owns the board's Tx engine, RF commands and test mode.
+ * The other streams have no Tx buffers, and send through TxDev. A XAUI
+ * device drives the board's XAUI engine pair with the same code; it has
+ * its own Tx and test mode, and no RF commands or HW counter.
+ */
+typedef struct RawDevTag {
+    int Board;                  /**< Board number in xdma probe order */
+    int Stream;                 /**< Rx from C2S engine ENGINE_RX+Stream */
+    int Xaui;                   /**< XAUI engine pair instead, Stream is 0 */
+    struct RawDevTag * TxDev;   /**< Stream 0 of the board, maybe this one */
+    int DriverState;
+    void * handle[4];
+    unsigned long TXbarbase, RXbarbase;
+    u32 RawTestMode;
+    u32 HwTestMode;             /**< Test bits last written to TX_CONFIG */
+    u32 RawMinPktSize, RawMaxPktSize;
+
+    Buffer TxBufs;
+    Buffer RxBufs;
+    PktBuf * pkts;              /**< num_bufs packets for DMA submission */
+
+    /* Zero-copy Tx. Writers take TxPins entries in ring order from
+     * TxPinNext under TxMutex; the DMA side frees them as they complete,
+     * which is in the same order. TxZcQueued and TxZcDone count the bytes
+     * queued and given back; only the DMA side writes TxZcDone.
+     */
+    TxPin * TxPins;             /**< num_bufs entries */
+    struct page ** TxPinPages;  /**< get_user_pages_fast() result */
+    int TxPinNext;
+    unsigned long long TxZcQueued;
+    volatile unsigned long long TxZcDone;
+
+    ML605RxRing * RxRing;
+    unsigned long RxRingCtrlSize;
+    unsigned long long RxRingConsumer;
+    int RxRingUsers;            /**< Opens that have mapped RxRing */
+    struct list_head Readers;   /**< RawReader of every open */
+    spinlock_t RxReaderLock;
+
+    /* Bytes completed by DMA and bytes given back to RxBufs, for the
+     * status page. Both are written by the DMA side.
+     */
+    volatile unsigned long long RxBytesProduced;
+    volatile unsigned long long RxBytesConsumed;
+
+    ML605Status * StatusPage;
+    struct hrtimer StatusTimer;
+    int StatusMaps;             /**< Mappings of StatusPage, timer runs if > 0 */
+    struct mutex StatusMutex;   /**< Guards StatusMaps and the timer */
+
+    /* For exclusion */
+    spinlock_t RawLock;
+    /* Serialise concurrent writers among themselves. Tx and Rx never
+     * wait on each other.
+     */
+    struct mutex TxMutex;
+
+    /* RF commands wait in RfCmdFifo and RfCmdTimer strobes them out one
+     * at a time, so no caller waits out the strobe. RfCmdQueued and
+     * RfCmdDone count commands; a fence sleeps until RfCmdDone catches up.
+     * The timer runs in interrupt context, hence the irqsave lock.
+     */
+    spinlock_t RfCmdLock;
+    struct hrtimer RfCmdTimer;
+    u32 RfCmdFifo[RF_CMD_FIFO_LEN];
+    unsigned long long RfCmdQueued;
+    volatile unsigned long long RfCmdDone;
+    int RfCmdBusy;              /**< Strobe up, RfCmdTimer running */
+
+    /* Readers and pollers sleep here until Rx data or Tx buffers show up */
+    wait_queue_head_t RawWaitQueue;
+    int UserOpen;
+
+    /* Per-CPU counters, and when each direction ran out of buffers. Tx
+     * starvation is tracked by writers, Rx starvation by the DMA side.
+     */
+    RawStats __percpu * Stats;
+    int TxStarved, RxStarved;
+    ktime_t TxStarvedSince, RxStarvedSince;
+
+    unsigned short TxSeqNo;
+    unsigned short RxSeqNo;
+} RawDev;
+
+static RawDev * RawDevs[MAX_RAW_DEVS];    /**< By minor, see RAW_MINOR */
+static int NumRawDevs = 0;                  /**< Boards */
+static int NumRawMinors = 0;                /**< Minors up to the last one used */
+static struct dentry * RawDebugDir = NULL;
+
+/* privData given to DmaRegisterBoard: engine magic in the upper bits,
+ * device minor in the low byte.
+ */
+#define PRIV_TX             0x54545400
+#define PRIV_RX             0x54545600
+#define PRIV_IS_TX(p)       (((p) & ~0xffU) == PRIV_TX)
+#define PRIV_MINOR(p)       ((p) & 0xffU)
 
-#ifdef XAUI
-#define DRIVER_NAME         "xxaui_driver"
-#define DRIVER_DESCRIPTION  "Xilinx XAUI Data Driver"
-#else
 #define DRIVER_NAME         "xrawdata_driver"
-#define DRIVER_DESCRIPTION  "Xilinx Raw Data Driver"
-#endif
+#define DRIVER_DESCRIPTION  "Xilinx Raw Data and XAUI Data Driver"
 
-static void poll_routine(unsigned long __opaque);
-static void InitBuffers(Buffer * bptr);
+static int InitBuffers(Buffer * bptr, int board, int dir);
+static int InitRxRing(RawDev * dev);
+static void CleanupRawDevs(void);
 
-// static void FormatBuffer(unsigned char * buf, int pktsize, int bufsize, int fragment);
+// static void FormatBuffer(RawDev * dev, unsigned char * buf, int pktsize, int bufsize, int fragment);
 #ifdef DATA_VERIFY
-static void VerifyBuffer(unsigned char * buf, int size, unsigned long long uinfo);
+static void VerifyBuffer(RawDev * dev, unsigned char * buf, int size, unsigned long long uinfo);
 #endif
 
 int myInit(unsigned long, unsigned int);
 int myFreePkt(void *, unsigned int *, int, unsigned int);
-// static int DmaSetupTransmit(void *, int);
+// static int DmaSetupTransmit(RawDev *, void *, int);
 int myGetRxPkt(void *, PktBuf *, unsigned int, int, unsigned int);
 int myPutTxPkt(void *, PktBuf *, int, unsigned int);
 int myPutRxPkt(void *, PktBuf *, int, unsigned int);
@@ -242,507 +450,1592 @@ int myGetState(void * hndl, UserState * ustate, unsigned int privdata);
 
 extern unsigned int CRC(unsigned int * buf, int len);
 
-/* For checking data integrity */
-unsigned int TxBufCnt=0;
-unsigned int RxBufCnt=0;
-unsigned int ErrCnt=0;
+/* Device that registered with this privData, or NULL */
+static inline RawDev * PrivDev(unsigned int privdata)
+{
+    if(PRIV_MINOR(privdata) >= MAX_RAW_DEVS)
+        return NULL;
+    return RawDevs[PRIV_MINOR(privdata)];
+}
 
-unsigned short TxSeqNo = 0;
-unsigned short RxSeqNo = 0;
+static void FreeBufferState(Buffer * bptr)
+{
+    vfree(bptr->FreeMap);
+    vfree(bptr->Desc);
+    vfree(bptr->RxQueue);
+    bptr->FreeMap = NULL;
+    bptr->Desc = NULL;
+    bptr->RxQueue = NULL;
+}
 
-/* Simplistic buffer management algorithm. Buffers must be freed in the
- * order in which they have been allocated. Out of order buffer frees will
- * result in the wrong buffer being freed and may cause a system hang during
- * the next buffer/DMA access.
- */
-static void InitBuffers(Buffer * bptr)
+/* Allocate the buffers of one direction. They all start out free. */
+static int InitBuffers(Buffer * bptr, int board, int dir)
 {
-    unsigned char * bufVA;
     int i;
     
     printk("InitBuffers() is invoked\n");
 
     /* Initialise */
-    bptr->TotalNum = bptr->AllocNum = 0;
-    bptr->FirstBuf = 0;
-    bptr->LastBuf = 0;
-    bptr->FreePtr = 0;
-    bptr->AllocPtr = 0;
-    bptr->RxNum = 0;
-    bptr->RxTotalBytes = 0;
-
-    /* Allocate for TX buffer pool - have not taken care of alignment */
-    for(i = 0; i < NUM_BUFS; i++)
-    {
-        if((bufVA = (unsigned char *)__get_free_pages(GFP_KERNEL, get_order(BUFSIZE))) == NULL)
-        {
-            printk("InitBuffers: Unable to allocate [%d] TX buffer for data\n", i);
-            break;
-        }
-        bptr->origVA[i] = bufVA;
-        bptr->rxBytes[i] = 0;
+    bptr->TotalNum = 0;
+    atomic_set(&bptr->FreeNum, 0);
+    bptr->NextFree = 0;
+    bptr->FreeMap = NULL;
+    bptr->Desc = NULL;
+    bptr->RxQueue = NULL;
+    bptr->RxProduced = 0;
+
+    /* Buffers are recycled for the life of the driver, so have xdma map
+     * them once, instead of on every DMA.
+     */
+    if((bptr->Pool = DmaPoolCreate(board, num_bufs, BUFSIZE, dir)) == NULL)
+    {
+        printk("InitBuffers: Unable to allocate buffers for data\n");
+        return -ENOMEM;
+    }
+    i = bptr->Pool->numBufs;
+    bptr->FreeMap = vmalloc(BITS_TO_LONGS(i) * sizeof(long));
+    bptr->Desc = vmalloc(i * sizeof(BufDesc));
+    if(dir == PCI_DMA_FROMDEVICE)
+        bptr->RxQueue = vmalloc(i * sizeof(BufDesc *));
+    if((bptr->FreeMap == NULL) || (bptr->Desc == NULL) ||
+       ((dir == PCI_DMA_FROMDEVICE) && (bptr->RxQueue == NULL)))
+    {
+        printk("InitBuffers: Unable to allocate buffer state\n");
+        FreeBufferState(bptr);
+        DmaPoolDestroy(bptr->Pool);
+        bptr->Pool = NULL;
+        return -ENOMEM;
+    }
+    for(i = 0; i < bptr->Pool->numBufs; i++)
+    {
+        bptr->Desc[i].VA = bptr->Pool->bufVA[i];
+        bptr->Desc[i].PA = bptr->Pool->bufPA[i];
+        bptr->Desc[i].Len = 0;
+        bptr->Desc[i].Index = i;
     }
-    printk("Allocated %d buffers from %p\n", i, (void *)bufVA);
+    bitmap_fill(bptr->FreeMap, i);
+    atomic_set(&bptr->FreeNum, i);
+    printk("Allocated %d buffers from %p\n", i, (void *)bptr->Desc[0].VA);
     printk("Buffer size = %d\n", BUFSIZE);
 
-#if 0
-    /* Do the buffer alignment adjustment, if required */
-    if((u32)bufVA % BUFALIGN)
-        bufVA += (BUFALIGN - ((u32)bufVA & 0xFF));
-#endif
-
-    if(i)
-    {
-        bptr->FirstBuf = 0;
-        bptr->LastBuf = i;      // One more than last valid buffer.
-        bptr->FreePtr = 0;
-        bptr->AllocPtr = 0;
-        bptr->TotalNum = i;
-        bptr->AllocNum = 0;
-        bptr->RxNum = 0;
-        bptr->RxTotalBytes = 0;
-    }
-    //printk("Buffers allocated first %x last %x, number %d\n",
-    //                (u32)(bptr->origVA[0]), (u32)(bptr->origVA[i-1]), i);
+    bptr->TotalNum = i;
+    return 0;
 }
 
-static inline unsigned char * AllocBuf(Buffer * bptr)
+/* Allocates a free buffer, and fills in pbuf with its DmaPool mapping.
+ * The search starts after the last buffer handed out, so buffers are
+ * reused round-robin while they come back in order.
+ */
+static inline unsigned char * AllocBuf(Buffer * bptr, PktBuf * pbuf)
 {
-    unsigned char * cptr;
-    int freeptr;
+    BufDesc * desc;
+    int i;
 
-    if(bptr->AllocNum == bptr->TotalNum)
+    if(atomic_read(&bptr->FreeNum) <= 0)
     {
 //        printk("No buffers available to allocate\n");
         return NULL;
     }
 
-    freeptr = bptr->FreePtr;
-
-    //printk("Before allocating:\n");
-    //printk("Allocated %d buffers\n", bptr->AllocNum);
-    //printk("FreePtr %d AllocPtr %d\n", bptr->FreePtr, bptr->AllocPtr);
+    i = bptr->NextFree;
+    for(;;)
+    {
+        i = find_next_bit(bptr->FreeMap, bptr->TotalNum, i);
+        if(i >= bptr->TotalNum)
+            i = find_first_bit(bptr->FreeMap, bptr->TotalNum);
+        if(i >= bptr->TotalNum)
+            return NULL;
+        if(test_and_clear_bit(i, bptr->FreeMap))
+            break;
+    }
+    atomic_dec(&bptr->FreeNum);
+    bptr->NextFree = i + 1;
+    /* Do not touch the buffer before the freeing side is done with it */
+    smp_mb();
 
-    cptr = bptr->origVA[freeptr];
-    bptr->FreePtr ++;
-    if(bptr->FreePtr == bptr->LastBuf)
-        bptr->FreePtr = 0;
-    bptr->AllocNum++;
+    desc = &bptr->Desc[i];
+    pbuf->pktBuf = desc->VA;
+    pbuf->bufInfo = (unsigned char *)desc;
+    pbuf->bufPA = desc->PA;
 
-    //printk("After allocating:\n");
-    //printk("Allocated %d buffers\n", bptr->AllocNum);
-    //printk("FreePtr %d AllocPtr %d\n", bptr->FreePtr, bptr->AllocPtr);
+    return desc->VA;
+}
 
-    return cptr;
+/* Return one buffer to the free bitmap, in whatever order it comes back */
+static inline void FreeBuf(Buffer * bptr, BufDesc * desc)
+{
+    /* Buffers must be finished with before the allocator can see them */
+    smp_mb();
+    if(test_and_set_bit(desc->Index, bptr->FreeMap))
+    {
+        printk("FreeBuf: buffer %d is already free. bptr = 0x%p\n", desc->Index, bptr);
+        return;
+    }
+    atomic_inc(&bptr->FreeNum);
 }
 
-static inline void FreeUsedBuf(Buffer * bptr, int num)
+/* Return the buffers of num packets from AllocBuf() */
+static inline void FreePktBufs(Buffer * bptr, PktBuf * pbuf, int num)
 {
-    /* This version differs from FreeUnusedBuf() in that this frees used
-     * buffers by moving the AllocPtr, while the other frees unused buffers
-     * by moving the FreePtr.
-     */
     int i;
 
-    //printk("Trying to free %d buffers\n", num);
-    //printk("Allocated %d buffers\n", bptr->AllocNum);
-    //printk("FreePtr %d AllocPtr %d\n", bptr->FreePtr, bptr->AllocPtr);
-
     for(i=0; i<num; i++)
-    {
-        if(bptr->AllocNum == 0)
-        {
-            printk("No more buffers allocated, cannot free anything\n");
-            break;
-        }
+        FreeBuf(bptr, (BufDesc *)pbuf[i].bufInfo);
+}
 
-        bptr->AllocPtr ++;
-        if(bptr->AllocPtr == bptr->LastBuf)
-            bptr->AllocPtr = 0;
-        bptr->AllocNum--;
-    }
-    //printk("After freeing:\n");
-    //printk("Allocated %d buffers\n", bptr->AllocNum);
-    //printk("FreePtr %d AllocPtr %d\n", bptr->FreePtr, bptr->AllocPtr);
+static inline int IsTxPin(RawDev * dev, unsigned char * info)
+{
+    return (info >= (unsigned char *)dev->TxPins) &&
+           (info < (unsigned char *)(dev->TxPins + num_bufs));
+}
+
+/* Unmap and unpin a zero-copy Tx page. DMA only read it, so it is not
+ * dirtied.
+ */
+static void TxPinRelease(RawDev * dev, TxPin * pin)
+{
+    DmaUnmapPage(dev->Board, pin->PA, pin->Len, PCI_DMA_TODEVICE);
+    put_page(pin->Page);
+    /* The writer may reuse the entry as soon as it sees Page cleared */
+    smp_mb();
+    pin->Page = NULL;
 }
 
-static inline void FreeUnusedBuf(Buffer * bptr, int num)
+/* Return the buffers of num Tx packets, pool buffers and pinned pages
+ * alike. Returns the bytes of pinned pages among them.
+ */
+static unsigned int FreeTxPkts(RawDev * dev, PktBuf * pbuf, int num)
 {
-    /* This version differs from FreeUsedBuf() in that this frees unused buffers
-     * by moving the FreePtr, while the other frees used buffers by moving
-     * the AllocPtr.
-     */
+    unsigned int zcbytes = 0;
+    TxPin * pin;
     int i;
 
-    //printk("Trying to free %d unused buffers\n", num);
-    //printk("Allocated %d buffers\n", bptr->AllocNum);
-    //printk("FreePtr %d AllocPtr %d\n", bptr->FreePtr, bptr->AllocPtr);
-
     for(i=0; i<num; i++)
     {
-        if(bptr->AllocNum == 0)
+        if(IsTxPin(dev, pbuf[i].bufInfo))
         {
-            printk("No more buffers allocated, cannot free anything. bptr = 0x%x\n", bptr);
-            break;
+            pin = (TxPin *)pbuf[i].bufInfo;
+            zcbytes += pin->Len;
+            TxPinRelease(dev, pin);
         }
-
-        if(bptr->FreePtr == 0)
-            bptr->FreePtr = bptr->LastBuf;
-        bptr->FreePtr --;
-        bptr->AllocNum--;
+        else
+            FreeBuf(&dev->TxBufs, (BufDesc *)pbuf[i].bufInfo);
     }
-    //printk("After freeing:\n");
-    //printk("Allocated %d buffers\n", bptr->AllocNum);
-    //printk("FreePtr %d AllocPtr %d\n", bptr->FreePtr, bptr->AllocPtr);
+    return zcbytes;
 }
 
-static inline void PrintSummary(void)
+/* Allocate the control area of the zero-copy Rx ring. It is vmalloc'ed so
+ * that it can be mapped page by page next to the RxBufs pages. Must be
+ * called after InitBuffers(&RxBufs).
+ */
+static int InitRxRing(RawDev * dev)
 {
-#ifndef XAUI
-    u32 val;
-#endif
+    dev->RxRingCtrlSize = PAGE_ALIGN(sizeof(ML605RxRing) +
+                                dev->RxBufs.TotalNum * sizeof(ML605RxDesc));
 
-    printk("---------------------------------------------------\n");
-    printk("%s Driver results Summary:-\n", MYNAME);
-    printk("Current Run Min Packet Size = %d, Max Packet Size = %d\n",
-                            RawMinPktSize, RawMaxPktSize);
-    printk("Buffers Transmitted = %u, Buffers Received = %u, Error Count = %u\n", TxBufCnt, RxBufCnt, ErrCnt);
-    printk("TxSeqNo = %u, RxSeqNo = %u\n", TxSeqNo, RxSeqNo);
+    if((dev->RxRing = vmalloc_user(dev->RxRingCtrlSize)) == NULL)
+    {
+        printk("InitRxRing: Unable to allocate %lu bytes for Rx ring\n",
+                                                dev->RxRingCtrlSize);
+        return -ENOMEM;
+    }
 
-#ifndef XAUI
-    val = XIo_In32(TXbarbase+STATUS_ADDRESS);
-    printk("Data Mismatch Status = %x\n", val);
-#endif
+    dev->RxRing->producer = 0;
+    dev->RxRing->consumer = 0;
+    dev->RxRing->num_pages = dev->RxBufs.TotalNum;
+    dev->RxRing->page_size = BUFSIZE;
+    dev->RxRing->data_offset = dev->RxRingCtrlSize;
+    dev->RxRing->map_size = dev->RxRingCtrlSize + dev->RxBufs.TotalNum * BUFSIZE;
+    dev->RxRingConsumer = 0;
 
-    printk("---------------------------------------------------\n");
+    printk("Rx ring: %d pages, control area %lu bytes\n",
+                                dev->RxBufs.TotalNum, dev->RxRingCtrlSize);
+    return 0;
 }
 
-#ifndef USER_DATA
-static void FormatBuffer(unsigned char * buf, int pktsize, int bufsize, int fragment)
+/* Slot in RxBufs of the Rx page with free-running number cnt */
+static inline int RxSlot(RawDev * dev, unsigned long long cnt)
 {
-    int i;
+    return do_div(cnt, dev->RxBufs.TotalNum);
+}
 
-    /* Apply data pattern in the buffer */
-    for(i = 0; i < bufsize; i = i+2)
-        *(unsigned short *)(buf + i) = TxSeqNo;
+/* Number of completed Rx pages the reader has not read yet. A reader that
+ * has not started, or a lossy one that fell behind, begins at the oldest
+ * page still queued.
+ */
+static inline int RxPending(RawDev * dev, RawReader * rd)
+{
+    unsigned long long consumer = dev->RxRingConsumer;
 
-    /* Update header information for the first fragment in packet */
-    if(!fragment)
+    if(rd->Started && (rd->Consumer > consumer))
+        consumer = rd->Consumer;
+    return (int)(dev->RxBufs.RxProduced - consumer);
+}
+
+/* Return the Rx pages every reader is done with to RxBufs. Until some
+ * reader has started, or the zero-copy ring is mapped, pages are kept for
+ * the first one. Lossy readers outside read() hold their pages too, unless
+ * RxBufs has run out: then up to want pages they have not read yet go back
+ * to DMA. Called from the DMA side only.
+ */
+static inline void RxRingSync(RawDev * dev, int want)
+{
+    RawReader * rd;
+    unsigned long long produced = dev->RxBufs.RxProduced;
+    unsigned long long release = produced;
+    unsigned long long lossy = produced;
+    unsigned long long cnt, ring, pos;
+    int started = 0;
+
+    spin_lock(&dev->RxReaderLock);
+    list_for_each_entry(rd, &dev->Readers, List)
     {
-        /* Apply packet length and sequence number */
-        *(unsigned short *)(buf + 0) = pktsize;
-        *(unsigned short *)(buf + 2) = TxSeqNo;
+        if(!rd->Started)
+            continue;
+        started = 1;
+        /* A lossy reader may already have been skipped past */
+        pos = rd->Consumer;
+        if(pos < dev->RxRingConsumer)
+            pos = dev->RxRingConsumer;
+        if(pos < release)
+            release = pos;
+        if(rd->Lossy && !rd->Busy)
+            continue;
+        if(pos < lossy)
+            lossy = pos;
     }
 
-#ifdef DEBUG_VERBOSE
-    printk("TX Buffer has:\n");
-    for(i=0; i<bufsize; i++)
+    /* The ring consumer is written by user space, so it is checked here */
+    if(dev->RxRingUsers)
     {
-        if(!(i % 32)) printk("\n");
-        printk("%02x ", buf[i]);
+        started = 1;
+        ring = dev->RxRing->consumer;
+        if((ring < dev->RxRingConsumer) || (ring > produced))
+        {
+            printk("RxRingSync: user released up to page %llu, only %llu..%llu held\n",
+                                ring, dev->RxRingConsumer, produced);
+            dev->RxRing->consumer = ring = dev->RxRingConsumer;
+        }
+        if(ring < release)
+            release = ring;
+        if(ring < lossy)
+            lossy = ring;
     }
-    printk("\n");
-#endif
-}
-#endif
 
-#ifdef DATA_VERIFY
-static void VerifyBuffer(unsigned char * buf, int size, unsigned long long uinfo)
-{
-    unsigned int check4;
-    unsigned short check2, check6;
-    unsigned char * bptr;
+    /* Only overrun lossy readers if DMA would find no free buffer */
+    if((release < lossy) &&
+       (atomic_read(&dev->RxBufs.FreeNum) + (release - dev->RxRingConsumer) == 0))
+        release = (lossy - release > want) ? release + want : lossy;
 
-#ifdef DEBUG_VERBOSE
-    int i;
+    if(!started)
+        release = dev->RxRingConsumer;
+    cnt = dev->RxRingConsumer;
+    dev->RxRingConsumer = release;
+    spin_unlock(&dev->RxReaderLock);
 
-    printk("%s: RX packet len %d uinfo %llx\n", MYNAME, size, uinfo);
-    for(i=0; i<size; i++)
+    /* The readers are done with these pages before DMA may reuse them */
+    smp_mb();
+    for(; cnt != release; cnt++)
     {
-        if(i && !(i % 16)) printk("\n");
-        printk("%02x ", buf[i]);
+        dev->RxBytesConsumed += dev->RxBufs.RxQueue[RxSlot(dev, cnt)]->Len;
+        FreeBuf(&dev->RxBufs, dev->RxBufs.RxQueue[RxSlot(dev, cnt)]);
     }
-    printk("\n");
-#endif
+}
 
-    bptr = buf+size;
-    check6 = *(unsigned short *)(bptr-6);
-    check4 = *(unsigned int *)(bptr-4);
-    check2 = *(unsigned short *)(bptr-2);
-#ifdef XAUI
-    if(check4 != (unsigned int)uinfo)
-#else
-    if(check2 != RxSeqNo)
-#endif
+/* Pin the pages from the reader's cursor on, so that they are not given
+ * back to DMA while read() works on them. A lossy reader that fell behind
+ * first skips to the oldest page still queued.
+ */
+static void RxReaderPin(RawDev * dev, RawReader * rd)
+{
+    spin_lock_bh(&dev->RxReaderLock);
+    if(!rd->Started || (rd->Consumer < dev->RxRingConsumer))
     {
-        ErrCnt++;
-        printk("Mismatch: Size %x SeqNo %x uinfo %x, buf has %x\n",
-                        size, (*(unsigned short *)(buf+2)),
-                        (unsigned int)uinfo, check4);
-        printk("RxSeqNo %x\n", RxSeqNo);
+        if(rd->Started)
+        {
+            rd->Dropped += dev->RxRingConsumer - rd->Consumer;
+            RawStatAdd(dev, Rx.Drops, dev->RxRingConsumer - rd->Consumer);
+        }
+        rd->Consumer = dev->RxRingConsumer;
+        rd->HeadOffset = 0;
+        rd->Started = 1;
+    }
+    rd->Busy = 1;
+    spin_unlock_bh(&dev->RxReaderLock);
+}
+
+/* Move the reader's cursor to (consumer, offset) and unpin its pages */
+static void RxReaderUnpin(RawDev * dev, RawReader * rd,
+                          unsigned long long consumer, unsigned int offset)
+{
+    /* Finish reading the pages before handing them back to DMA */
+    smp_mb();
+    spin_lock_bh(&dev->RxReaderLock);
+    rd->Consumer = consumer;
+    rd->HeadOffset = offset;
+    rd->Busy = 0;
+    spin_unlock_bh(&dev->RxReaderLock);
+}
+
+/* Framed read mode. The Rx stream is made of frames that start with one
+ * of these sync words, in stream byte order.
+ */
+#define RX_SYNC_AAA0    0xaaa0aaa0
+#define RX_SYNC_A0AA    0xa0aaa0aa
+
+/* Look for a sync word from (*page, *off) up to, not including, page end.
+ * If found, returns 1 with (*page, *off) at its first byte. Otherwise
+ * returns 0 with (*page, *off) where the search should resume: at the last
+ * three bytes, which may start a sync word that is not complete yet.
+ */
+static int RxFindSync(RawDev * dev, unsigned long long * page,
+                      unsigned int * off, unsigned long long end)
+{
+    unsigned long long pp[4], p;
+    unsigned int po[4], o;
+    unsigned int have = 0;
+    u32 win = 0;
+    BufDesc * desc;
 
+    for(p = *page, o = *off; p != end; p++, o = 0)
+    {
+        desc = dev->RxBufs.RxQueue[RxSlot(dev, p)];
+        for(; o < desc->Len; o++)
         {
-            int i;
-            for(i=0; i<8; i++) printk("%02x ", buf[i]);
-            printk("...");
-            for(i=0; i<8; i++) printk("%02x ", buf[size-8+i]);
-            printk("\n");
+            win = (win << 8) | desc->VA[o];
+            pp[have & 3] = p;
+            po[have & 3] = o;
+            if((++have >= 4) && ((win == RX_SYNC_AAA0) || (win == RX_SYNC_A0AA)))
+            {
+                *page = pp[have & 3];
+                *off = po[have & 3];
+                return 1;
+            }
         }
+    }
 
-        /* Update RxSeqNo */
-        RxSeqNo = check6;
+    if(have >= 3)
+    {
+        *page = pp[(have - 3) & 3];
+        *off = po[(have - 3) & 3];
     }
+    return 0;
 }
-#endif
 
-// Character driver related operations
-static int rawdata_dev_open(struct inode * in, struct file * filp)
+/* Bytes queued from (page, off) up to page end, counted up to max */
+static unsigned int RxBytesFrom(RawDev * dev, unsigned long long page,
+                                unsigned int off, unsigned long long end,
+                                unsigned int max)
 {
-  if (DriverState != REGISTERED)
-  {
-    printk("Driver rawdata not yet ready!\n");
-    return -1;
-  }
-
-  if (UserOpen >= kMaxUserOpen)
-  {
-    printk("Device already in use\n");
-    return -EACCES;
-  }
+    unsigned int bytes = 0;
 
-  spin_lock_bh(&RawLock);
-  ++UserOpen;   // To prevent more than one user application
-  spin_unlock_bh(&RawLock);
+    for(; (page != end) && (bytes < max); page++, off = 0)
+        bytes += dev->RxBufs.RxQueue[RxSlot(dev, page)]->Len - off;
+    return bytes;
+}
 
-  return 0;
+/* Refresh the status page. The timer is the only writer; seq is odd while
+ * the fields are being updated, like a seqlock.
+ */
+static void UpdateStatusPage(RawDev * dev)
+{
+    dev->StatusPage->seq++;
+    smp_wmb();
+    /* No BAR yet if the device did not register with DMA */
+    if(DevHasRf(dev) && dev->TXbarbase)
+        dev->StatusPage->timing_status = XIo_In32(dev->TXbarbase+TIMING_STATUS);
+    dev->StatusPage->tx_free_bytes = (dev->TxBufs.TotalNum - BufAllocNum(&dev->TxBufs)) * BUFSIZE;
+    dev->StatusPage->rx_bytes = (unsigned int)(dev->RxBytesProduced - dev->RxBytesConsumed);
+    dev->StatusPage->tx_seq_no = dev->TxSeqNo;
+    dev->StatusPage->rx_seq_no = dev->RxSeqNo;
+    smp_wmb();
+    dev->StatusPage->seq++;
 }
 
-static int rawdata_dev_release(struct inode * in, struct file * filp)
+static enum hrtimer_restart StatusTimerFn(struct hrtimer *timer)
 {
-  if (!UserOpen)
-  {
-    /* Should not come here */
-    printk("Device rawdata not in use\n");
-    return -EFAULT;
-  }
+    RawDev * dev = container_of(timer, RawDev, StatusTimer);
 
-  spin_lock_bh(&RawLock);
-  --UserOpen;
-  spin_unlock_bh(&RawLock);
+    if(dev->DriverState == REGISTERED)
+        UpdateStatusPage(dev);
 
-  return 0;
+    hrtimer_forward_now(timer, ktime_set(0, STATUS_PERIOD_US * 1000));
+    return HRTIMER_RESTART;
 }
 
-static ssize_t rawdata_dev_write(struct file *filp, const char __user *buf,
-                          size_t count, loff_t *f_pos)
+/* Allocate the status page. It is refreshed once mapped. */
+static int InitStatusPage(RawDev * dev)
 {
-  PktBuf *pbuf;
-  unsigned char *bufVA;
-  int result;
-  int origseqno;
-  int avail;
-//	int i;
-#ifdef WY_NEW_LOCK
-  static volatile bool is_write_busy = false;
-#endif    
+    if((dev->StatusPage = vmalloc_user(PAGE_SIZE)) == NULL)
+    {
+        printk("InitStatusPage: Unable to allocate status page\n");
+        return -ENOMEM;
+    }
 
-  // Return value used if there is *not* enough buffer space
-  ssize_t retval = -ENOMEM;
+    dev->StatusMaps = 0;
+    mutex_init(&dev->StatusMutex);
+    hrtimer_init(&dev->StatusTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev->StatusTimer.function = StatusTimerFn;
+    return 0;
+}
 
-	bufVA = NULL;
+/* The first mapping of the status page starts the timer, and the last
+ * unmap stops it. open is also called when a mapping is copied on fork()
+ * or split.
+ */
+static void StatusVmOpen(struct vm_area_struct * vma)
+{
+    RawDev * dev = vma->vm_private_data;
 
-  origseqno = TxSeqNo;
+    mutex_lock(&dev->StatusMutex);
+    if(dev->StatusMaps++ == 0)
+    {
+        if(dev->DriverState == REGISTERED)
+            UpdateStatusPage(dev);
+        hrtimer_start(&dev->StatusTimer, ktime_set(0, STATUS_PERIOD_US * 1000),
+                      HRTIMER_MODE_REL);
+    }
+    mutex_unlock(&dev->StatusMutex);
+}
 
-  if (DriverState != REGISTERED)
-  {
-    return -EPERM;
-  }
-  else if (count <= BUFSIZE)
-  {
-#ifndef WY_NEW_LOCK  
-    spin_lock_bh(&RawLock);
-#else
-    // The following operation (copy_from_user) might sleep, so we don't want to keep the spinlock that long time.
-    // If device is busy, we simply return EBUSY error to API.
-    // API could retry write operation after sleeping a short while.
-    if (spin_trylock_bh(&RawLock) == 0) {
-      return -EBUSY;
-    }
-    if (is_write_busy) {
-      spin_unlock_bh(&RawLock);
-      return -EBUSY;
-    }
-    is_write_busy = true;
-    spin_unlock_bh(&RawLock);
-#endif
-//    /* Only if the test mode is set, and only for TX direction */
-//    if((RawTestMode & TEST_START) &&
-//       (RawTestMode & (ENABLE_PKTCHK|ENABLE_LOOPBACK)))
-//    {
-//      /* First change the state */
-//      RawTestMode &= ~TEST_START;
-//      RawTestMode |= TEST_IN_PROGRESS;
-//    }
-
-    avail = (TxBufs.TotalNum - TxBufs.AllocNum);
-    if (avail > 0)
-    {
-      pbuf = &(pkts[0]);
-
-      /* Allocate a buffer. DMA driver will map to PCI space. */
-      bufVA = AllocBuf(&TxBufs);
-
-      log_verbose(KERN_INFO "TX: The buffer after alloc is at address %x size %d\n",
-                          (unsigned long) bufVA, (u32) BUFSIZE);
-      if (bufVA != NULL)
-      {
-        pbuf->pktBuf = bufVA;
-        pbuf->bufInfo = bufVA;
-        pbuf->size = count;
-        pbuf->userInfo = TxSeqNo;
-        pbuf->flags = PKT_ALL | PKT_SOP | PKT_EOP;
-
-        // copy from user to Tx buffer
-        if (copy_from_user(bufVA, buf, count))
-        {
-          printk("Copy_from_user failed\n");
-          FreeUnusedBuf(&TxBufs, 1);
-        }
-        else
-        {
-//					for (i = 0; i < 8; ++i) {
-//						printk("%2x\t", bufVA[i]);
-//					}
-//					printk("\n");
-          retval = count;
-        }
+static void StatusVmClose(struct vm_area_struct * vma)
+{
+    RawDev * dev = vma->vm_private_data;
 
-        ++TxSeqNo;
+    mutex_lock(&dev->StatusMutex);
+    if(--dev->StatusMaps == 0)
+        hrtimer_cancel(&dev->StatusTimer);
+    mutex_unlock(&dev->StatusMutex);
+}
+
+static const struct vm_operations_struct StatusVmOps = {
+    .open = StatusVmOpen,
+    .close = StatusVmClose,
+};
+
+/* Put the oldest queued RF command out and raise its send signal. Called
+ * with RfCmdLock held, when no strobe is running.
+ */
+static void RfCmdStart(RawDev * dev)
+{
+    u32 cmd = dev->RfCmdFifo[(unsigned int)dev->RfCmdDone & (RF_CMD_FIFO_LEN-1)];
+
+    // clear RF cmd send signal
+    XIo_Out32(dev->TXbarbase+RX_CONFIG_ADDRESS, 0);
+
+    XIo_Out32(dev->TXbarbase+RF_CONTROL, cmd);
+
+    // set RF cmd send signal
+    XIo_Out32(dev->TXbarbase+RX_CONFIG_ADDRESS, PKTGENR);
+    dev->RfCmdBusy = 1;
+}
+
+/* The send signal has been up for RF_CMD_STROBE_US: drop it, and go on
+ * with the next command if there is one.
+ */
+static enum hrtimer_restart RfCmdTimerFn(struct hrtimer *timer)
+{
+    RawDev * dev = container_of(timer, RawDev, RfCmdTimer);
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->RfCmdLock, flags);
+    // clear RF cmd send signal
+    XIo_Out32(dev->TXbarbase+RX_CONFIG_ADDRESS, 0);
+    dev->RfCmdDone++;
+    dev->RfCmdBusy = 0;
+    if(dev->RfCmdDone != dev->RfCmdQueued)
+    {
+        RfCmdStart(dev);
+        hrtimer_forward_now(timer, ktime_set(0, RF_CMD_STROBE_US * 1000));
+        ret = HRTIMER_RESTART;
+    }
+    spin_unlock_irqrestore(&dev->RfCmdLock, flags);
+
+    /* Fences and callers waiting for FIFO space */
+    wake_up_interruptible(&dev->RawWaitQueue);
+    return ret;
+}
+
+/* Queue an RF command, and start the strobe if it is idle. *mark is what
+ * RfCmdDone will be once the command has been sent.
+ */
+static int RfCmdQueue(RawDev * dev, u32 cmd, unsigned long long * mark)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->RfCmdLock, flags);
+    if(dev->RfCmdQueued - dev->RfCmdDone >= RF_CMD_FIFO_LEN)
+    {
+        spin_unlock_irqrestore(&dev->RfCmdLock, flags);
+        return -EAGAIN;
+    }
+    dev->RfCmdFifo[(unsigned int)dev->RfCmdQueued & (RF_CMD_FIFO_LEN-1)] = cmd;
+    *mark = ++dev->RfCmdQueued;
+    if(!dev->RfCmdBusy)
+    {
+        RfCmdStart(dev);
+        hrtimer_start(&dev->RfCmdTimer, ktime_set(0, RF_CMD_STROBE_US * 1000),
+                      HRTIMER_MODE_REL);
+    }
+    spin_unlock_irqrestore(&dev->RfCmdLock, flags);
+    return 0;
+}
+
+/* Sleep until every RF command up to mark has been sent */
+static int RfCmdFence(RawDev * dev, unsigned long long mark)
+{
+    if(wait_event_interruptible(dev->RawWaitQueue, dev->RfCmdDone >= mark))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+/* Send an RF command. Without wait, returns as soon as it is queued, or
+ * with -EAGAIN if the FIFO is full; with wait, sleeps for FIFO space and
+ * then until the command is out.
+ */
+static int RfCmdSend(RawDev * dev, u32 cmd, int wait)
+{
+    unsigned long long mark;
+    int retval;
+
+    while((retval = RfCmdQueue(dev, cmd, &mark)) == -EAGAIN && wait)
+    {
+        if(wait_event_interruptible(dev->RawWaitQueue,
+                    dev->RfCmdQueued - dev->RfCmdDone < RF_CMD_FIFO_LEN))
+            return -ERESTARTSYS;
+    }
+    if(retval || !wait)
+        return retval;
+    return RfCmdFence(dev, mark);
+}
+
+/* Note how many buffers of a direction are in use, for the watermark */
+static inline void RawStatWater(RawDirStats __percpu * s, int inuse)
+{
+    if((u32)inuse > this_cpu_read(s->HighWater))
+        this_cpu_write(s->HighWater, (u32)inuse);
+}
+
+/* A direction has run out of free buffers (full), or has them again. Only
+ * one context calls this for each direction.
+ */
+static inline void RawStatStarve(RawDirStats __percpu * s, int * starved,
+                                 ktime_t * since, int full)
+{
+    if(full && !*starved)
+    {
+        *starved = 1;
+        *since = ktime_get();
+        this_cpu_inc(s->RingFull);
+    }
+    else if(!full && *starved)
+    {
+        *starved = 0;
+        this_cpu_add(s->StarvedUs, ktime_us_delta(ktime_get(), *since));
+    }
+}
+
+static void RawAddDirStats(ML605DirStats * d, RawDirStats * s)
+{
+    d->bufs += s->Bufs;
+    d->bytes += s->Bytes;
+    d->drops += s->Drops;
+    d->ring_full += s->RingFull;
+    d->starved_us += s->StarvedUs;
+    if(s->HighWater > d->high_water)
+        d->high_water = s->HighWater;
+}
+
+/* Add up the counters of all CPUs. A starvation still going on is counted
+ * up to now.
+ */
+static void RawGetStats(RawDev * dev, ML605Stats * st)
+{
+    RawStats * s;
+    int cpu;
+
+    memset(st, 0, sizeof(ML605Stats));
+    for_each_possible_cpu(cpu)
+    {
+        s = per_cpu_ptr(dev->Stats, cpu);
+        RawAddDirStats(&st->tx, &s->Tx);
+        RawAddDirStats(&st->rx, &s->Rx);
+        st->errors += s->Errors;
+    }
+    if(dev->TxStarved)
+        st->tx.starved_us += ktime_us_delta(ktime_get(), dev->TxStarvedSince);
+    if(dev->RxStarved)
+        st->rx.starved_us += ktime_us_delta(ktime_get(), dev->RxStarvedSince);
+    st->tx.num_bufs = dev->TxBufs.TotalNum;
+    st->rx.num_bufs = dev->RxBufs.TotalNum;
+}
+
+static void RawResetStats(RawDev * dev)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(dev->Stats, cpu), 0, sizeof(RawStats));
+}
+
+/* debugfs file of one board, ml605_raw_data/boardn */
+static int RawStatsShow(struct seq_file * m, void * v)
+{
+    RawDev * dev = m->private;
+    ML605Stats st;
+
+    RawGetStats(dev, &st);
+    seq_printf(m, "%-12s %20s %20s\n", "", "tx", "rx");
+    seq_printf(m, "%-12s %20llu %20llu\n", "bufs", st.tx.bufs, st.rx.bufs);
+    seq_printf(m, "%-12s %20llu %20llu\n", "bytes", st.tx.bytes, st.rx.bytes);
+    seq_printf(m, "%-12s %20llu %20llu\n", "drops", st.tx.drops, st.rx.drops);
+    seq_printf(m, "%-12s %20llu %20llu\n", "ring_full", st.tx.ring_full, st.rx.ring_full);
+    seq_printf(m, "%-12s %20llu %20llu\n", "starved_us", st.tx.starved_us, st.rx.starved_us);
+    seq_printf(m, "%-12s %20u %20u\n", "high_water", st.tx.high_water, st.rx.high_water);
+    seq_printf(m, "%-12s %20u %20u\n", "num_bufs", st.tx.num_bufs, st.rx.num_bufs);
+    seq_printf(m, "%-12s %20llu\n", "errors", st.errors);
+    return 0;
+}
+
+static int RawStatsOpen(struct inode * in, struct file * filp)
+{
+    return single_open(filp, RawStatsShow, in->i_private);
+}
+
+static inline void PrintSummary(RawDev * dev)
+{
+    ML605Stats st;
+    u32 val;
+
+    printk("---------------------------------------------------\n");
+    printk("%s Driver results Summary:-\n", DevName(dev));
+    printk("Current Run Min Packet Size = %d, Max Packet Size = %d\n",
+                            dev->RawMinPktSize, dev->RawMaxPktSize);
+    RawGetStats(dev, &st);
+    printk("Buffers Transmitted = %llu, Buffers Received = %llu, Error Count = %llu\n", st.tx.bufs, st.rx.bufs, st.errors);
+    printk("Tx drops %llu ring full %llu high water %u, Rx drops %llu ring full %llu high water %u\n",
+                st.tx.drops, st.tx.ring_full, st.tx.high_water,
+                st.rx.drops, st.rx.ring_full, st.rx.high_water);
+    printk("TxSeqNo = %u, RxSeqNo = %u\n", dev->TxSeqNo, dev->RxSeqNo);
+
+    if(!dev->Xaui)
+    {
+        val = XIo_In32(dev->TXbarbase+STATUS_ADDRESS);
+        printk("Data Mismatch Status = %x\n", val);
+    }
+
+    printk("---------------------------------------------------\n");
+}
+
+#ifndef USER_DATA
+static void FormatBuffer(RawDev * dev, unsigned char * buf, int pktsize, int bufsize, int fragment)
+{
+    int i;
+
+    /* Apply data pattern in the buffer */
+    for(i = 0; i < bufsize; i = i+2)
+        *(unsigned short *)(buf + i) = dev->TxSeqNo;
+
+    /* Update header information for the first fragment in packet */
+    if(!fragment)
+    {
+        /* Apply packet length and sequence number */
+        *(unsigned short *)(buf + 0) = pktsize;
+        *(unsigned short *)(buf + 2) = dev->TxSeqNo;
+    }
+
+#ifdef DEBUG_VERBOSE
+    printk("TX Buffer has:\n");
+    for(i=0; i<bufsize; i++)
+    {
+        if(!(i % 32)) printk("\n");
+        printk("%02x ", buf[i]);
+    }
+    printk("\n");
+#endif
+}
+#endif
+
+#ifdef DATA_VERIFY
+static void VerifyBuffer(RawDev * dev, unsigned char * buf, int size, unsigned long long uinfo)
+{
+    unsigned int check4;
+    unsigned short check2, check6;
+    unsigned char * bptr;
+
+#ifdef DEBUG_VERBOSE
+    int i;
+
+    printk("%s: RX packet len %d uinfo %llx\n", MYNAME, size, uinfo);
+    for(i=0; i<size; i++)
+    {
+        if(i && !(i % 16)) printk("\n");
+        printk("%02x ", buf[i]);
+    }
+    printk("\n");
+#endif
+
+    bptr = buf+size;
+    check6 = *(unsigned short *)(bptr-6);
+    check4 = *(unsigned int *)(bptr-4);
+    check2 = *(unsigned short *)(bptr-2);
+    if(dev->Xaui ? (check4 != (unsigned int)uinfo) : (check2 != dev->RxSeqNo))
+    {
+        RawStatInc(dev, Errors);
+        printk("Mismatch: Size %x SeqNo %x uinfo %x, buf has %x\n",
+                        size, (*(unsigned short *)(buf+2)),
+                        (unsigned int)uinfo, check4);
+        printk("RxSeqNo %x\n", dev->RxSeqNo);
+
+        {
+            int i;
+            for(i=0; i<8; i++) printk("%02x ", buf[i]);
+            printk("...");
+            for(i=0; i<8; i++) printk("%02x ", buf[size-8+i]);
+            printk("\n");
+        }
+
+        /* Update RxSeqNo */
+        dev->RxSeqNo = check6;
+    }
+}
+#endif
+
+// Character driver related operations
+static int rawdata_dev_open(struct inode * in, struct file * filp)
+{
+  RawDev * dev;
+  RawReader * rd;
+
+  if (iminor(in) >= MAX_RAW_DEVS || RawDevs[iminor(in)] == NULL)
+  {
+    return -ENODEV;
+  }
+  dev = RawDevs[iminor(in)];
+
+  if (dev->DriverState != REGISTERED)
+  {
+    printk("Driver rawdata not yet ready!\n");
+    return -1;
+  }
+
+  if ((rd = kzalloc(sizeof(RawReader), GFP_KERNEL)) == NULL)
+  {
+    return -ENOMEM;
+  }
+  rd->Dev = dev;
+  mutex_init(&rd->Mutex);
+
+  // Check and take a slot in one go, or two opens could share the last
+  spin_lock_bh(&dev->RawLock);
+  if (dev->UserOpen >= kMaxUserOpen)
+  {
+    spin_unlock_bh(&dev->RawLock);
+    kfree(rd);
+    printk("Device already in use\n");
+    return -EACCES;
+  }
+  ++dev->UserOpen;   // To limit the number of user applications
+  spin_unlock_bh(&dev->RawLock);
+
+  spin_lock_bh(&dev->RxReaderLock);
+  list_add_tail(&rd->List, &dev->Readers);
+  spin_unlock_bh(&dev->RxReaderLock);
+
+  filp->private_data = rd;
+  return 0;
+}
+
+static int rawdata_dev_release(struct inode * in, struct file * filp)
+{
+  RawReader * rd = filp->private_data;
+  RawDev * dev = rd->Dev;
+
+  if (!dev->UserOpen)
+  {
+    /* Should not come here */
+    printk("Device rawdata not in use\n");
+    return -EFAULT;
+  }
+
+  // The pages this reader held go back to DMA on the next refill
+  spin_lock_bh(&dev->RxReaderLock);
+  list_del(&rd->List);
+  if (rd->RingMapped)
+  {
+    --dev->RxRingUsers;
+  }
+  spin_unlock_bh(&dev->RxReaderLock);
+
+  if (rd->Dropped)
+  {
+    log_normal("%s: lossy reader skipped %llu Rx pages\n", MYNAME, rd->Dropped);
+  }
+  kfree(rd);
+
+  spin_lock_bh(&dev->RawLock);
+  --dev->UserOpen;
+  spin_unlock_bh(&dev->RawLock);
+
+  return 0;
+}
+
+static ssize_t rawdata_dev_write(struct file *filp, const char __user *buf,
+                          size_t count, loff_t *f_pos)
+{
+  RawReader * rd = filp->private_data;
+  RawDev * dev = rd->Dev->TxDev;
+  PktBuf *pbuf;
+  unsigned char *bufVA;
+  int result;
+  int origseqno;
+  int avail;
+  int numpkts;
+  int numbufs;
+  int i;
+  size_t len;
+
+  // Return value used if there is *not* enough buffer space
+  ssize_t retval = -ENOMEM;
+
+  if (dev->DriverState != REGISTERED)
+  {
+    return -EPERM;
+  }
+  if (count == 0 || count > ML605_MAX_XFER_LEN)
+  {
+    return -EINVAL;
+  }
+
+  // Writers are the only producer on TxBufs; myPutTxPkt frees completed
+  // buffers without a lock. Concurrent writers queue up here.
+  if (mutex_lock_interruptible(&dev->TxMutex))
+  {
+    return -ERESTARTSYS;
+  }
+  origseqno = dev->TxSeqNo;
+
+  // One Tx buffer per page. Queue as many pages as there are free buffers,
+  // the rest is left to the caller as a partial write.
+  numpkts = (count + BUFSIZE - 1) / BUFSIZE;
+  avail = (dev->TxBufs.TotalNum - BufAllocNum(&dev->TxBufs));
+  if (numpkts > avail)
+  {
+    // Reclaim what DMA has sent instead of waiting for the poll timer
+    DmaReapPkts(dev->handle[0]);
+    avail = (dev->TxBufs.TotalNum - BufAllocNum(&dev->TxBufs));
+  }
+  RawStatStarve(&dev->Stats->Tx, &dev->TxStarved, &dev->TxStarvedSince, numpkts > avail);
+  if (numpkts > avail)
+  {
+    numpkts = avail;
+  }
+
+  for (numbufs = 0; numbufs < numpkts; numbufs++)
+  {
+    /* Allocate a buffer. It is already mapped for DMA. */
+    if ((bufVA = AllocBuf(&dev->TxBufs, &dev->pkts[numbufs])) == NULL)
+    {
+      break;
+    }
+    log_verbose(KERN_INFO "TX: The buffer after alloc is at address %lx size %d\n",
+                        (unsigned long) bufVA, (u32) BUFSIZE);
+  }
+  RawStatWater(&dev->Stats->Tx, BufAllocNum(&dev->TxBufs));
+
+  // copy from user to Tx buffers
+  for (i = 0; i < numbufs; i++)
+  {
+    pbuf = &(dev->pkts[i]);
+    len = count - i * BUFSIZE;
+    if (len > BUFSIZE)
+    {
+      len = BUFSIZE;
+    }
+
+    if (copy_from_user(pbuf->pktBuf, buf + i * BUFSIZE, len))
+    {
+      printk("Copy_from_user failed\n");
+      retval = -EFAULT;
+      break;
+    }
+    pbuf->size = len;
+    pbuf->userInfo = dev->TxSeqNo;
+    pbuf->flags = PKT_ALL | PKT_SOP | PKT_EOP | PKT_MAPPED;
+    ++dev->TxSeqNo;
+  }
+
+  if (i < numbufs)
+  {
+    // Copy failure: give back everything, nothing has been queued yet.
+    FreePktBufs(&dev->TxBufs, dev->pkts, numbufs);
+    dev->TxSeqNo = origseqno;
+    numbufs = 0;
+  }
+
+  if (numbufs)
+  {
+    // Queue all pages as one batch, so the engine is kicked only once.
+    result = DmaSendPkt(dev->handle[0], dev->pkts, numbufs);
+//    printk("DmaSendPkt result = %d\n", result);
+    if (result != numbufs)
+    {
+      RawStatAdd(dev, Tx.Drops, numbufs - result);
+      log_normal(KERN_ERR "Tried to send %d pkts in %d buffers, sent only %d\n",
+                                  numbufs, numbufs, result);
+      if(result) dev->TxSeqNo = dev->pkts[result].userInfo;
+      else dev->TxSeqNo = origseqno;
+
+      FreePktBufs(&dev->TxBufs, &dev->pkts[result], (numbufs-result));
+    }
+
+    if (result)
+    {
+      retval = count;
+      if (result * BUFSIZE < count)
+      {
+        retval = result * BUFSIZE;
+      }
+    }
+    else
+    {
+      retval = -98;
+    }
+  }
+
+  mutex_unlock(&dev->TxMutex);
+
+//	printk("retval=%d\n", (int)retval);
+  return retval;
+}
+
+/* RD_CMD_TX_ZERO_COPY: queue a user buffer for DMA straight from its own
+ * pages, instead of copying it into TxBufs like write(). Each page is
+ * pinned and mapped until its DMA completes; the caller may reuse the
+ * buffer once TxZcDone reaches zc->done_mark. Like write(), only part of
+ * the buffer may be queued, zc->len tells how much. Sleeps while no page
+ * can be taken, unless opened O_NONBLOCK.
+ */
+static int rawdata_dev_send_pinned(RawDev * dev, struct file * filp,
+                                   ML605TxZeroCopy * zc)
+{
+  unsigned long start = (unsigned long)zc->addr;
+  PktBuf *pbuf;
+  TxPin *pin;
+  int origseqno;
+  int numpkts;
+  int pinned;
+  int numbufs;
+  int result;
+  int i;
+
+  if (zc->len == 0 || zc->len > ML605_MAX_XFER_LEN ||
+      (start & ~PAGE_MASK) || (zc->len & ~PAGE_MASK) || dev->TxPins == NULL)
+  {
+    return -EINVAL;
+  }
+
+  // Entries come back in ring order, so the next one is the first to free
+  if (dev->TxPins[dev->TxPinNext].Page != NULL)
+  {
+    DmaReapPkts(dev->handle[0]);
+  }
+  if (dev->TxPins[dev->TxPinNext].Page != NULL)
+  {
+    if (filp->f_flags & O_NONBLOCK)
+    {
+      return -EAGAIN;
+    }
+    if (wait_event_interruptible(dev->RawWaitQueue,
+                                 dev->TxPins[dev->TxPinNext].Page == NULL ||
+                                 dev->DriverState != REGISTERED))
+    {
+      return -ERESTARTSYS;
+    }
+  }
+
+  if (mutex_lock_interruptible(&dev->TxMutex))
+  {
+    return -ERESTARTSYS;
+  }
+  origseqno = dev->TxSeqNo;
+
+  // One page per packet, as many as there are free entries in a row
+  numpkts = zc->len >> PAGE_SHIFT;
+  if (numpkts > num_bufs)
+  {
+    numpkts = num_bufs;
+  }
+  for (i = 0; i < numpkts; i++)
+  {
+    if (dev->TxPins[(dev->TxPinNext + i) % num_bufs].Page != NULL)
+    {
+      break;
+    }
+  }
+  RawStatStarve(&dev->Stats->Tx, &dev->TxStarved, &dev->TxStarvedSince, i < numpkts);
+  numpkts = i;
+  if (numpkts == 0)
+  {
+    mutex_unlock(&dev->TxMutex);
+    return -ENOMEM;
+  }
+
+  // The device only reads the pages
+  pinned = get_user_pages_fast(start, numpkts, 0, dev->TxPinPages);
+  if (pinned <= 0)
+  {
+    mutex_unlock(&dev->TxMutex);
+    return pinned ? pinned : -EFAULT;
+  }
+
+  for (numbufs = 0; numbufs < pinned; numbufs++)
+  {
+    pin = &dev->TxPins[(dev->TxPinNext + numbufs) % num_bufs];
+    if (DmaMapPage(dev->Board, dev->TxPinPages[numbufs], PAGE_SIZE,
+                   PCI_DMA_TODEVICE, &pin->PA))
+    {
+      break;
+    }
+    pin->Page = dev->TxPinPages[numbufs];
+    pin->Len = PAGE_SIZE;
+
+    pbuf = &(dev->pkts[numbufs]);
+    pbuf->pktBuf = NULL;
+    pbuf->bufInfo = (unsigned char *)pin;
+    pbuf->bufPA = pin->PA;
+    pbuf->size = PAGE_SIZE;
+    pbuf->userInfo = dev->TxSeqNo;
+    pbuf->flags = PKT_ALL | PKT_SOP | PKT_EOP | PKT_MAPPED;
+    ++dev->TxSeqNo;
+  }
+  for (i = numbufs; i < pinned; i++)
+  {
+    put_page(dev->TxPinPages[i]);
+  }
+
+  result = 0;
+  if (numbufs)
+  {
+    result = DmaSendPkt(dev->handle[0], dev->pkts, numbufs);
+  }
+  if (result != numbufs)
+  {
+    RawStatAdd(dev, Tx.Drops, numbufs - result);
+    if(result) dev->TxSeqNo = dev->pkts[result].userInfo;
+    else dev->TxSeqNo = origseqno;
+
+    // Never queued, so not counted in TxZcDone either
+    for (i = result; i < numbufs; i++)
+    {
+      TxPinRelease(dev, (TxPin *)dev->pkts[i].bufInfo);
+    }
+  }
+
+  dev->TxPinNext = (dev->TxPinNext + result) % num_bufs;
+  dev->TxZcQueued += result * PAGE_SIZE;
+  zc->len = result * PAGE_SIZE;
+  zc->done_mark = dev->TxZcQueued;
+
+  mutex_unlock(&dev->TxMutex);
+
+  return result ? 0 : -ENOMEM;
+}
+
+/* read() in framed mode: exactly one whole frame of rd->FrameLen bytes,
+ * starting at its sync word. Data before the next sync word is dropped,
+ * so the caller never sees a misaligned frame. Sleeps until a whole frame
+ * is there, unless opened O_NONBLOCK.
+ */
+static ssize_t rawdata_dev_read_frame(RawDev * dev, RawReader * rd,
+                                      struct file *filp, char __user *buf,
+                                      size_t count)
+{
+  ssize_t retval = 0;
+  unsigned long long produced;
+  unsigned long long page, sync_page;
+  unsigned int off, sync_off;
+  unsigned int framelen = rd->FrameLen;
+  unsigned int copied;
+  size_t len;
+  BufDesc * desc;
+
+  if (count < framelen)
+  {
+    return -EINVAL;
+  }
+
+  if (mutex_lock_interruptible(&rd->Mutex))
+  {
+    return -ERESTARTSYS;
+  }
+
+  for (;;)
+  {
+    RxReaderPin(dev, rd);
+    produced = dev->RxBufs.RxProduced;
+    // Page lengths are published before RxProduced moves
+    smp_rmb();
+
+    page = rd->Consumer;
+    off = rd->HeadOffset;
+    if (RxFindSync(dev, &page, &off, produced) &&
+        RxBytesFrom(dev, page, off, produced, framelen) >= framelen)
+    {
+      rd->ReadStamp = dev->RxBufs.RxQueue[RxSlot(dev, page)]->Stamp;
+      sync_page = page;
+      sync_off = off;
+      for (copied = 0; copied < framelen && retval == 0; )
+      {
+        desc = dev->RxBufs.RxQueue[RxSlot(dev, page)];
+        len = desc->Len - off;
+        if (len > framelen - copied)
+        {
+          len = framelen - copied;
+        }
+        if (copy_to_user(buf + copied, desc->VA + off, len))
+        {
+          printk("copy_to_user failed. frame byte %u of %u\n", copied, framelen);
+          retval = -EFAULT;
+        }
+        copied += len;
+        off += len;
+        if (off == desc->Len)
+        {
+          page++;
+          off = 0;
+        }
+      }
+      // On a fault, keep the frame for a retry: stay at its sync word
+      if (retval)
+      {
+        page = sync_page;
+        off = sync_off;
+      }
+      RxReaderUnpin(dev, rd, page, off);
+      if (retval == 0)
+      {
+        retval = framelen;
+      }
+      break;
+    }
+
+    // No whole frame yet. Drop what comes before the sync word, or all
+    // but the tail of a stream without one, and wait for more.
+    RxReaderUnpin(dev, rd, page, off);
+    rd->FrameSeen = produced;
+    if (filp->f_flags & O_NONBLOCK)
+    {
+      retval = -EAGAIN;
+      break;
+    }
+    if (wait_event_interruptible(dev->RawWaitQueue,
+            (dev->RxBufs.RxProduced != produced) || (dev->DriverState != REGISTERED)))
+    {
+      retval = -ERESTARTSYS;
+      break;
+    }
+    if (dev->DriverState != REGISTERED)
+    {
+      retval = -EPERM;
+      break;
+    }
+  }
+
+  mutex_unlock(&rd->Mutex);
+
+  return retval;
+}
+
+/* Copy as many completed Rx pages as fit in count, in one call. The reader
+ * only advances its own cursor; the DMA side gives the pages back to
+ * RxBufs once every reader is past them, so read() never waits for
+ * myPutRxPkt/myGetRxPkt.
+ */
+static ssize_t rawdata_dev_read(struct file *filp, char __user *buf,
+                         size_t count, loff_t *f_pos)
+{
+  RawReader * rd = filp->private_data;
+  RawDev * dev = rd->Dev;
+  ssize_t retval = 0;
+  size_t num_copied_bytes = 0;
+  int num_avail_pkts;
+  int num_copied_pkts = 0;
+  int num_pkt_index;
+  BufDesc * desc;
+  unsigned int offset;
+  size_t len;
+  unsigned long long consumer;
+
+  if (dev->DriverState != REGISTERED)
+  {
+    return -EPERM;
+  }
+
+  if (rd->FrameLen)
+  {
+    return rawdata_dev_read_frame(dev, rd, filp, buf, count);
+  }
+
+  for (;;)
+  {
+    // Sleep until myPutRxPkt has something, unless opened O_NONBLOCK.
+    if (RxPending(dev, rd) == 0)
+    {
+      if (filp->f_flags & O_NONBLOCK)
+      {
+        return -EAGAIN;
+      }
+      if (wait_event_interruptible(dev->RawWaitQueue,
+              (RxPending(dev, rd) > 0) || (dev->DriverState != REGISTERED)))
+      {
+        return -ERESTARTSYS;
+      }
+      if (dev->DriverState != REGISTERED)
+      {
+        return -EPERM;
+      }
+    }
+
+    // Threads reading the same open queue up here; other opens have their
+    // own cursor.
+    if (mutex_lock_interruptible(&rd->Mutex))
+    {
+      return -ERESTARTSYS;
+    }
+
+    // Another thread on this open may have read the pages meanwhile
+    RxReaderPin(dev, rd);
+    num_avail_pkts = RxPending(dev, rd);
+    if (num_avail_pkts > 0)
+    {
+      break;
+    }
+    RxReaderUnpin(dev, rd, rd->Consumer, rd->HeadOffset);
+    mutex_unlock(&rd->Mutex);
+    if (filp->f_flags & O_NONBLOCK)
+    {
+      return -EAGAIN;
+    }
+  }
+
+  consumer = rd->Consumer;
+  // Page lengths are published before RxProduced moves
+  smp_rmb();
+
+  // A buffer can be bigger than what is left of count. Its tail is then
+  // kept, at HeadOffset, for the next read().
+  num_pkt_index = RxSlot(dev, consumer);
+  offset = rd->HeadOffset;
+  rd->ReadStamp = dev->RxBufs.RxQueue[num_pkt_index]->Stamp;
+  while (num_copied_pkts < num_avail_pkts && num_copied_bytes < count)
+  {
+    desc = dev->RxBufs.RxQueue[num_pkt_index];
+    len = desc->Len - offset;
+    if (len > count - num_copied_bytes)
+    {
+      len = count - num_copied_bytes;
+    }
+    if (copy_to_user(buf + num_copied_bytes, desc->VA + offset, len))
+    {
+      printk("copy_to_user failed. page %d of %d\n", num_copied_pkts, num_avail_pkts);
+      retval = -EFAULT;
+      break;
+    }
+    num_copied_bytes += len;
+    offset += len;
+    if (offset < desc->Len)
+    {
+      break;
+    }
+    offset = 0;
+    ++num_copied_pkts;
+    if (++num_pkt_index == dev->RxBufs.TotalNum)
+    {
+      num_pkt_index = 0;
+    }
+  }
+
+  if (num_copied_bytes)
+  {
+    RxReaderUnpin(dev, rd, consumer + num_copied_pkts, offset);
+    retval = num_copied_bytes;
+  }
+  else
+  {
+    RxReaderUnpin(dev, rd, rd->Consumer, rd->HeadOffset);
+  }
+
+  mutex_unlock(&rd->Mutex);
+
+  return retval;
+}
+
+
+/* Map the zero-copy Rx ring: the control area first, then every RxBufs
+ * buffer in buffer index order. The pages stay owned by RxBufs; user space
+ * gives them back by advancing the consumer counter in the control area.
+ * Until the open is closed, the ring consumer holds pages like a reader.
+ */
+static int rawdata_dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  RawReader * rd = filp->private_data;
+  RawDev * dev = rd->Dev;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  unsigned long uaddr = vma->vm_start;
+  unsigned long offset;
+  unsigned long page;
+  int i;
+  int retval;
+
+  if (dev->DriverState != REGISTERED)
+  {
+    return -EPERM;
+  }
+
+  // The status page is a single read-only page
+  if (vma->vm_pgoff == (ML605_STATUS_MMAP_OFFSET >> PAGE_SHIFT))
+  {
+    if (dev->StatusPage == NULL)
+    {
+      return -EPERM;
+    }
+    if (size != PAGE_SIZE || (vma->vm_flags & VM_WRITE))
+    {
+      return -EINVAL;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+    retval = vm_insert_page(vma, uaddr, vmalloc_to_page(dev->StatusPage));
+    if (retval)
+    {
+      return retval;
+    }
+    vma->vm_private_data = dev;
+    vma->vm_ops = &StatusVmOps;
+    StatusVmOpen(vma);
+    return 0;
+  }
+
+  if (dev->RxRing == NULL)
+  {
+    return -EPERM;
+  }
+
+  if (vma->vm_pgoff != (ML605_RX_RING_MMAP_OFFSET >> PAGE_SHIFT))
+  {
+    return -EINVAL;
+  }
+
+  if (size > dev->RxRing->map_size)
+  {
+    printk("mmap: requested %lu bytes, Rx ring is %u bytes\n",
+           size, dev->RxRing->map_size);
+    return -EINVAL;
+  }
+
+  for (offset = 0; offset < dev->RxRingCtrlSize && offset < size; offset += PAGE_SIZE)
+  {
+    retval = vm_insert_page(vma, uaddr + offset,
+                            vmalloc_to_page((char *)dev->RxRing + offset));
+    if (retval)
+    {
+      return retval;
+    }
+  }
+
+  // A buffer can span several pages; xdma allocates them as separate pages
+  for (i = 0; i < dev->RxBufs.TotalNum && offset < size; i++)
+  {
+    for (page = 0; page < BUFSIZE && offset < size; page += PAGE_SIZE, offset += PAGE_SIZE)
+    {
+      retval = vm_insert_page(vma, uaddr + offset,
+                              virt_to_page(dev->RxBufs.Desc[i].VA + page));
+      if (retval)
+      {
+        return retval;
+      }
+    }
+  }
+
+  // The first mapping starts the ring at the oldest page still queued
+  spin_lock_bh(&dev->RxReaderLock);
+  if (!rd->RingMapped)
+  {
+    if (dev->RxRingUsers++ == 0)
+    {
+      dev->RxRing->consumer = dev->RxRingConsumer;
+    }
+    rd->RingMapped = 1;
+  }
+  spin_unlock_bh(&dev->RxReaderLock);
+
+  return 0;
+}
+
+/* poll()/epoll support. The fd is readable while completed Rx pages are
+ * waiting and writable while Tx buffers are free.
+ */
+static unsigned int rawdata_dev_poll(struct file *filp, poll_table *wait)
+{
+  RawReader * rd = filp->private_data;
+  RawDev * dev = rd->Dev;
+  RawDev * tx = dev->TxDev;
+  unsigned int mask = 0;
+
+  poll_wait(filp, &dev->RawWaitQueue, wait);
+  if (tx != dev)
+  {
+    // Tx buffers are woken up on the board's stream 0
+    poll_wait(filp, &tx->RawWaitQueue, wait);
+  }
+
+  if (dev->DriverState != REGISTERED)
+  {
+    return POLLERR;
+  }
+
+  // In framed mode, only pages the last read() has not looked at yet may
+  // complete a frame
+  if ((RxPending(dev, rd) > 0) &&
+      (!rd->FrameLen || dev->RxBufs.RxProduced != rd->FrameSeen))
+  {
+    mask |= POLLIN | POLLRDNORM;
+  }
+  if (BufAllocNum(&tx->TxBufs) == tx->TxBufs.TotalNum)
+  {
+    DmaReapPkts(tx->handle[0]);
+  }
+  if (BufAllocNum(&tx->TxBufs) < tx->TxBufs.TotalNum)
+  {
+    mask |= POLLOUT | POLLWRNORM;
+  }
+
+  return mask;
+}
+
+/* The commands that take or return one int, on values already copied in
+ * from user space. Shared by the single ioctls and RD_CMD_BATCH, so none
+ * of them ever copies to or from user space, and none does it while
+ * holding a lock.
+ */
+static int RawCtlInt(RawDev * dev, RawReader * rd, unsigned int cmd, int * pval)
+{
+  RawDev * tx = dev->TxDev;
+  int val = 0;
+  int i;
+  int num_pkt_index;
+
+  switch (cmd)
+  {
+  case RD_CMD_QUERY_TX_BUF:
+    // Count the buffers DMA has finished with, not only those given back
+    DmaReapPkts(tx->handle[0]);
+    *pval = (tx->TxBufs.TotalNum - BufAllocNum(&tx->TxBufs)) * BUFSIZE;
+    break;
+  case RD_CMD_QUERY_RX_BUF:
+    // Sum the pages this reader has not consumed yet
+    spin_lock_bh(&dev->RxReaderLock);
+    if (rd->Started && rd->Consumer >= dev->RxRingConsumer)
+    {
+      num_pkt_index = RxSlot(dev, rd->Consumer);
+      if (RxPending(dev, rd) > 0)
+      {
+        val = -(int)rd->HeadOffset;
+      }
+    }
+    else
+    {
+      num_pkt_index = RxSlot(dev, dev->RxRingConsumer);
+    }
+    // RxRingConsumer, and so the pages counted, cannot move under the lock
+    for (i = RxPending(dev, rd); i > 0; i--)
+    {
+      val += dev->RxBufs.RxQueue[num_pkt_index]->Len;
+      if (++num_pkt_index == dev->RxBufs.TotalNum)
+      {
+        num_pkt_index = 0;
       }
     }
-
-#ifndef WY_NEW_LOCK
-  	spin_unlock_bh(&RawLock);
-#else
-//    spin_lock_bh(&RawLock);
-    is_write_busy = false;
-//    spin_unlock_bh(&RawLock);
-#endif
-
-		if (bufVA != NULL)
-		{
-		  result = DmaSendPkt(handle[0], pkts, 1);
-	//    printk("DmaSendPkt result = %d\n", result);
-		  TxBufCnt += result;
-		  if(result != 1)
-		  {
-		      log_normal(KERN_ERR "Tried to send %d pkts in %d buffers, sent only %d\n",
-		                                  1, 1, result);
-		      //printk("[s%d-%d,%d-%d]", bufindex, result, TxSeqNo, origseqno);
-		      if(result) TxSeqNo = pkts[result].userInfo;
-		      else TxSeqNo = origseqno;
-		      //printk("-%u-", TxSeqNo);
-		      //lastno = TxSeqNo;
-
-//		      spin_lock_bh(&RawLock);
-		      FreeUnusedBuf(&TxBufs, (1-result));
-//		      spin_unlock_bh(&RawLock);
-
-		      return -98;
-		  }
-		}
+    spin_unlock_bh(&dev->RxReaderLock);
+    *pval = val;
+    break;
+  case RD_CMD_GET_COUNTER:
+    // Not there with the XAUI path loaded, nor RF control below
+    if (!DevHasRf(dev))
+    {
+      return -EINVAL;
+    }
+    *pval = XIo_In32(dev->TXbarbase+TIMING_STATUS);
+    break;
+  case RD_CMD_SET_RF_CMD:
+    // Goes through the FIFO too, so it keeps its place among async ones
+    return DevHasRf(tx) ? RfCmdSend(tx, *pval, 1) : -EINVAL;
+  case RD_CMD_SET_RF_CMD_ASYNC:
+    return DevHasRf(tx) ? RfCmdSend(tx, *pval, 0) : -EINVAL;
+  case RD_CMD_RF_FENCE:
+    return DevHasRf(tx) ? RfCmdFence(tx, tx->RfCmdQueued) : -EINVAL;
+  case RD_CMD_SET_RX_LOSSY:
+    spin_lock_bh(&dev->RxReaderLock);
+    rd->Lossy = (*pval != 0);
+    spin_unlock_bh(&dev->RxReaderLock);
+    break;
+  case RD_CMD_GET_READ_STAMP:
+    *pval = rd->ReadStamp;
+    break;
+  case RD_CMD_SET_FRAME_LEN:
+    val = *pval;
+    // 0 goes back to plain reads. A frame must fit in a read(), and be
+    // short enough for the Rx buffers to hold it while it comes in.
+    if(val < 0 || val > ML605_MAX_XFER_LEN || (val > 0 && val < 4) ||
+       val > (dev->RxBufs.TotalNum / 2) * BUFSIZE)
+    {
+      return -EINVAL;
+    }
+    mutex_lock(&rd->Mutex);
+    rd->FrameLen = val;
+    rd->FrameSeen = 0;
+    mutex_unlock(&rd->Mutex);
+    break;
+  default:
+    return -ENOTTY;
   }
 
-//	printk("retval=%d\n", (int)retval);
-  return retval;
+  return 0;
 }
 
-static ssize_t rawdata_dev_read(struct file *filp, char __user *buf,
-                         size_t count, loff_t *f_pos)
+/* RD_CMD_BATCH: run a vector of int commands in one system call. The ops
+ * are copied in whole, run one after the other, and copied back with the
+ * value and result of each. A failed op does not stop the ones after it.
+ */
+static int RawCtlBatch(RawDev * dev, RawReader * rd, ML605CtlBatch * batch)
 {
-  ssize_t retval = 0;
-  int num_copied_bytes = 0;
-  int num_copied_pkts = 0;
-	int num_pkt_index = RxBufs.AllocPtr;
+  ML605CtlOp ops[ML605_MAX_BATCH];
+  unsigned long uops = (unsigned long)batch->ops;
+  unsigned int i;
 
-#ifdef WY_NEW_LOCK  
-//  spin_lock_bh(&RawLock);
-  spin_lock_bh(&RawReadLock);
-#else
-  // The following operation (copy_from_user) might sleep, so we don't want to keep the spinlock that long time.
-  // If device is busy, we simply return EBUSY error to API.
-  // API could retry write operation after sleeping a short while.
-  if (spin_trylock_bh(&RawReadLock) == 0) {
-    return -EBUSY;
+  if (batch->num_ops == 0 || batch->num_ops > ML605_MAX_BATCH)
+  {
+    return -EINVAL;
   }
-  if (is_read_busy) {
-    spin_unlock_bh(&RawReadLock);
-    return -EBUSY;
+  if (copy_from_user(ops, (void *)uops, batch->num_ops * sizeof(ML605CtlOp)))
+  {
+    printk("copy_from_user failed\n");
+    return -EFAULT;
   }
-  is_read_busy = true;
-  spin_unlock_bh(&RawReadLock);
-#endif
-//	printk("InState: AllocNum=%d, RxNum=%d, RxTotalBytes=%d\n",
-//				 RxBufs.AllocNum, RxBufs.RxNum, RxBufs.RxTotalBytes);
 
-  if (count <= BUFSIZE)
+  for (i = 0; i < batch->num_ops; i++)
   {
-    if (RxBufs.RxTotalBytes >= count)
-    {
-      while (num_copied_bytes + RxBufs.rxBytes[num_pkt_index] <= count)
-      {
-//				printk("AllocPtr=%d, num_copied_pkts=%d, num_copied_bytes=%d, rxBytes[]=%d, count=%d\n",
-//							 RxBufs.AllocPtr, num_copied_pkts, num_copied_bytes,
-//							 RxBufs.rxBytes[RxBufs.AllocPtr + num_copied_pkts], (unsigned)count);
-        if ((retval =
-							copy_to_user(buf + num_copied_bytes, RxBufs.origVA[num_pkt_index], RxBufs.rxBytes[num_pkt_index])))
-        {
-          printk("copy_to_user failed. retval=%d\n", (int)retval);
-//					printk("buf=0x%lx, num_copied_bytes=%d, num_copied_pkts=%d\n",
-//								 (long unsigned)buf, num_copied_bytes, num_copied_pkts);
-//					printk("RxTotalBytes=%d, rxBytes[%d]=%d\n",
-//								 RxBufs.RxTotalBytes, num_pkt_index, RxBufs.rxBytes[num_pkt_index]);
-          retval = -EFAULT;
-          break;
-        }
-        num_copied_bytes += RxBufs.rxBytes[num_pkt_index];
-		    RxBufs.RxTotalBytes -= RxBufs.rxBytes[num_pkt_index];
-        RxBufs.rxBytes[num_pkt_index] = 0;
-				++num_pkt_index;
-				if (num_pkt_index == RxBufs.TotalNum)
-				{
-					num_pkt_index = 0;
-				}
-        ++num_copied_pkts;
-		    RxBufs.RxNum--;
-        retval = num_copied_bytes;
-
-				if (num_copied_bytes == count)
-				{
-					break;
-				}
-      } // while loop
-    }
+    ops[i].result = RawCtlInt(dev, rd, ops[i].cmd, &ops[i].val);
   }
+  batch->done = i;
 
-  if (num_copied_pkts)
+  if (copy_to_user((void *)uops, ops, batch->num_ops * sizeof(ML605CtlOp)))
   {
-//		printk("Try to free %d Rx pkts\n", num_copied_pkts);
-//		printk("AllocNum = %d\n", RxBufs.AllocNum);
-    FreeUsedBuf(&RxBufs, num_copied_pkts);
+    printk("copy_to_user failed\n");
+    return -EFAULT;
   }
-
-//	printk("OutState: AllocNum=%d, RxNum=%d, RxTotalBytes=%d\n",
-//				 RxBufs.AllocNum, RxBufs.RxNum, RxBufs.RxTotalBytes);
-#ifdef WY_NEW_LOCK
-//	spin_unlock_bh(&RawLock);
-	spin_unlock_bh(&RawReadLock);
-#else
-  is_read_busy = false;
-#endif
-
-  return retval;
-  //return PAGE_SIZE;
+  return 0;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
@@ -753,13 +2046,17 @@ static long rawdata_dev_ioctl(struct file * filp,
                           unsigned int cmd, unsigned long arg)
 #endif 
 {
+  RawReader * rd = filp->private_data;
+  RawDev * dev = rd->Dev;
+  RawDev * tx = dev->TxDev;
   int retval = 0;
   int val = 0;
-#ifdef WY_NEW_LOCK
-  static volatile bool is_ioctl_busy = false;
-#endif    
-  
-  if(DriverState != REGISTERED)
+  ML605Stats stats;
+  ML605TxZeroCopy zc;
+  ML605CtlBatch batch;
+  unsigned long long mark;
+
+  if(dev->DriverState != REGISTERED)
   {
       /* Should not come here */
       printk("Driver not yet ready!\n");
@@ -778,143 +2075,176 @@ static long rawdata_dev_ioctl(struct file * filp,
     if(!access_ok(VERIFY_READ, (void *)arg, _IOC_SIZE(cmd)))
       return -EFAULT;
 
-#ifndef WY_NEW_LOCK
-	spin_lock_bh(&RawLock);
-#else
-  // The following operation (copy_from_user, copy_to_user) might sleep, so we don't want to keep the spinlock that long time.
-  // If device is busy, we simply return EBUSY error to API.
-  // API could retry ioctl operation after sleeping a short while.
-  if (spin_trylock_bh(&RawLock) == 0) {
-    return -EBUSY;
-  }
-  if (is_ioctl_busy) {
-    spin_unlock_bh(&RawLock);
-    return -EBUSY;
-  }
-  is_ioctl_busy = true;
-  spin_unlock_bh(&RawLock);
-#endif
-
   switch (cmd)
   {
   case RD_CMD_QUERY_TX_BUF:
-    val = (TxBufs.TotalNum - TxBufs.AllocNum) * BUFSIZE;
-//		printk("TxBuf=%d\n", val);
-    if(copy_to_user((int *)arg, &val, sizeof(int)))
+  case RD_CMD_QUERY_RX_BUF:
+  case RD_CMD_GET_COUNTER:
+  case RD_CMD_SET_RF_CMD:
+  case RD_CMD_SET_RF_CMD_ASYNC:
+  case RD_CMD_RF_FENCE:
+  case RD_CMD_SET_RX_LOSSY:
+  case RD_CMD_GET_READ_STAMP:
+  case RD_CMD_SET_FRAME_LEN:
+    // Copy in, run, copy out; no lock is held across the copies
+    if((_IOC_DIR(cmd) & _IOC_WRITE) && copy_from_user(&val, (int *)arg, sizeof(int)))
+    {
+      printk("copy_from_user failed\n");
+      retval = -EFAULT;
+      break;
+    }
+    if((retval = RawCtlInt(dev, rd, cmd, &val)) == 0 &&
+       (_IOC_DIR(cmd) & _IOC_READ) && copy_to_user((int *)arg, &val, sizeof(int)))
     {
       printk("copy_to_user failed\n");
       retval = -EFAULT;
     }
     break;
-  case RD_CMD_QUERY_RX_BUF:
-    val = RxBufs.RxTotalBytes;
-    if(copy_to_user((int *)arg, &val, sizeof(int)))
+  case RD_CMD_BATCH:
+    if(copy_from_user(&batch, (ML605CtlBatch *)arg, sizeof(ML605CtlBatch)))
+    {
+      printk("copy_from_user failed\n");
+      retval = -EFAULT;
+      break;
+    }
+    if((retval = RawCtlBatch(dev, rd, &batch)) == 0 &&
+       copy_to_user((ML605CtlBatch *)arg, &batch, sizeof(ML605CtlBatch)))
     {
       printk("copy_to_user failed\n");
       retval = -EFAULT;
     }
     break;
-  case RD_CMD_GET_COUNTER:
-    val = XIo_In32(TXbarbase+TIMING_STATUS);
-    if(copy_to_user((int *)arg, &val, sizeof(int)))
+  case RD_CMD_TX_ZERO_COPY:
+    if(copy_from_user(&zc, (ML605TxZeroCopy *)arg, sizeof(ML605TxZeroCopy)))
+    {
+      printk("copy_from_user failed\n");
+      retval = -EFAULT;
+      break;
+    }
+    if((retval = rawdata_dev_send_pinned(tx, filp, &zc)) == 0 &&
+       copy_to_user((ML605TxZeroCopy *)arg, &zc, sizeof(ML605TxZeroCopy)))
     {
       printk("copy_to_user failed\n");
       retval = -EFAULT;
     }
     break;
-  case RD_CMD_SET_RF_CMD:
-//		printk("Hello from rawdata_dev_ioctl\n");
-    // clear RF cmd send signal
-    XIo_Out32(TXbarbase+RX_CONFIG_ADDRESS, 0);
-
-    // write RF cmd
-    if(copy_from_user(&val, (int *)arg, sizeof(int)))
+  case RD_CMD_WAIT_TX_DONE:
+    if(copy_from_user(&mark, (unsigned long long *)arg, sizeof(mark)))
     {
       printk("copy_from_user failed\n");
       retval = -EFAULT;
+      break;
     }
-    XIo_Out32(TXbarbase+RF_CONTROL, val);
-
-    // set RF cmd send signal
-    XIo_Out32(TXbarbase+RX_CONFIG_ADDRESS, PKTGENR);
-		udelay(40);
-    // clear RF cmd send signal
-    XIo_Out32(TXbarbase+RX_CONFIG_ADDRESS, 0);
-		break;
+    // Sleeps even with O_NONBLOCK, it is the way to wait for Tx pages.
+    // Every queued page comes back, sent or not, so waiting for no more
+    // than has been queued always ends.
+    // TxZcQueued moves under TxMutex, with the zero-copy send
+    if(mutex_lock_interruptible(&tx->TxMutex))
+    {
+      retval = -ERESTARTSYS;
+      break;
+    }
+    if(mark > tx->TxZcQueued)
+    {
+      mark = tx->TxZcQueued;
+    }
+    mutex_unlock(&tx->TxMutex);
+    if(wait_event_interruptible(tx->RawWaitQueue,
+                                tx->TxZcDone >= mark ||
+                                tx->DriverState != REGISTERED))
+    {
+      retval = -ERESTARTSYS;
+      break;
+    }
+    mark = tx->TxZcDone;
+    if(copy_to_user((unsigned long long *)arg, &mark, sizeof(mark)))
+    {
+      printk("copy_to_user failed\n");
+      retval = -EFAULT;
+    }
+    break;
+  case RD_CMD_GET_STATS:
+    RawGetStats(dev, &stats);
+    if(copy_to_user((ML605Stats *)arg, &stats, sizeof(ML605Stats)))
+    {
+      printk("copy_to_user failed\n");
+      retval = -EFAULT;
+    }
+    break;
   default:
     printk("Invalid command %d\n", cmd);
     retval = -EINVAL;
   }
 
-#ifndef WY_NEW_LOCK
-	spin_unlock_bh(&RawLock);
-#else
-//  spin_lock_bh(&RawLock);
-  is_ioctl_busy = false;
-//  spin_unlock_bh(&RawLock);
-#endif
-
   return retval;
 }
 
-static void poll_routine(unsigned long __opaque)
+/* Register the engines of one device with DMA: the board's Tx engine for
+ * stream 0, and the C2S engine of its stream; or the XAUI pair. Called
+ * once from rawdata_init; xdma has probed every board by then.
+ */
+static int RegisterBoard(RawDev * dev)
 {
-//    struct timer_list *timer = &poll_timer;
     UserPtrs ufuncs;
-//    int offset = (2*HZ);
+    int minor = RAW_MINOR(dev->Board, dev->Xaui ? XAUI_SLOT : dev->Stream);
+    int txeng = dev->Xaui ? XAUI_ENGINE_TX : ENGINE_TX;
+    int rxeng = dev->Xaui ? XAUI_ENGINE_RX : ENGINE_RX + dev->Stream;
 
-    //printk("Came to poll_routine with %x\n", (u32)(__opaque));
+    spin_lock_bh(&dev->RawLock);
+    printk("Calling DmaRegisterBoard on board %d %s stream %d engine %d\n",
+                        dev->Board, DevName(dev), dev->Stream, rxeng);
+    dev->DriverState = REGISTERED;
+    spin_unlock_bh(&dev->RawLock);
 
-    /* Register with DMA incase not already done so */
-    if(DriverState < POLLING)
+    if(dev->Stream == 0)
     {
-        spin_lock_bh(&RawLock);
-        printk("Calling DmaRegister on engine %d and %d\n",
-                            ENGINE_TX, ENGINE_RX);
-        DriverState = REGISTERED;
-
+        /* Callbacks not set here are not used by xdma, and stay NULL */
+        spin_lock_bh(&dev->RawLock);
+        memset(&ufuncs, 0, sizeof(ufuncs));
         ufuncs.UserInit = myInit;
+        ufuncs.UserGetPkt = NULL;
         ufuncs.UserPutPkt = myPutTxPkt;
         ufuncs.UserSetState = mySetState;
         ufuncs.UserGetState = myGetState;
-        ufuncs.privData = 0x54545454;
-        spin_unlock_bh(&RawLock);
+        ufuncs.privData = PRIV_TX | minor;
+        spin_unlock_bh(&dev->RawLock);
 
-        if((handle[0]=DmaRegister(ENGINE_TX, MYBAR, &ufuncs, BUFSIZE)) == NULL)
+        if((dev->handle[0]=DmaRegisterBoard(dev->Board, txeng, MYBAR, &ufuncs, BUFSIZE)) == NULL)
         {
-            printk("Register for engine %d failed. Stopping.\n", ENGINE_TX);
-            spin_lock_bh(&RawLock);
-            DriverState = UNINITIALIZED;
-            spin_unlock_bh(&RawLock);
-            return;     // This polling will not happen again.
+            printk("Register for engine %d failed. Stopping.\n", txeng);
+            spin_lock_bh(&dev->RawLock);
+            dev->DriverState = UNINITIALIZED;
+            spin_unlock_bh(&dev->RawLock);
+            return -ENODEV;
         }
-        printk("Handle for engine %d is %p\n", ENGINE_TX, handle[0]);
-
-        spin_lock_bh(&RawLock);
-        ufuncs.UserInit = myInit;
-        ufuncs.UserPutPkt = myPutRxPkt;
-        ufuncs.UserGetPkt = myGetRxPkt;
-        ufuncs.UserSetState = mySetState;
-        ufuncs.UserGetState = myGetState;
-        ufuncs.privData = 0x54545456;
-        spin_unlock_bh(&RawLock);
+        printk("Handle for engine %d is %p\n", txeng, dev->handle[0]);
+    }
 
-        if((handle[2]=DmaRegister(ENGINE_RX, MYBAR, &ufuncs, BUFSIZE)) == NULL)
+    spin_lock_bh(&dev->RawLock);
+    memset(&ufuncs, 0, sizeof(ufuncs));
+    ufuncs.UserInit = myInit;
+    ufuncs.UserPutPkt = myPutRxPkt;
+    ufuncs.UserGetPkt = myGetRxPkt;
+    ufuncs.UserSetState = mySetState;
+    ufuncs.UserGetState = myGetState;
+    ufuncs.privData = PRIV_RX | minor;
+    spin_unlock_bh(&dev->RawLock);
+
+    if((dev->handle[2]=DmaRegisterBoard(dev->Board, rxeng, MYBAR, &ufuncs, BUFSIZE)) == NULL)
+    {
+        printk("Register for engine %d failed. Stopping.\n", rxeng);
+        if(dev->handle[0] != NULL)
         {
-            printk("Register for engine %d failed. Stopping.\n", ENGINE_RX);
-            spin_lock_bh(&RawLock);
-            DriverState = UNINITIALIZED;
-            spin_unlock_bh(&RawLock);
-            return;     // This polling will not happen again.
+            DmaUnregister(dev->handle[0]);
+            dev->handle[0] = NULL;
         }
-        printk("Handle for engine %d is %p\n", ENGINE_RX, handle[2]);
-
-        /* Reschedule poll routine */
-//        timer->expires = jiffies + offset;
-//        add_timer(timer);
-
-//        ssleep(2);   // sleep 2 seconds
+        spin_lock_bh(&dev->RawLock);
+        dev->DriverState = UNINITIALIZED;
+        spin_unlock_bh(&dev->RawLock);
+        return -ENODEV;
     }
+    printk("Handle for engine %d is %p\n", rxeng, dev->handle[2]);
+    return 0;
 }
 
 void CheckBuffer(unsigned char *ptrBuf, unsigned int len)
@@ -934,53 +2264,72 @@ void CheckBuffer(unsigned char *ptrBuf, unsigned int len)
 
 int myInit(unsigned long barbase, unsigned int privdata)
 {
+    RawDev * dev = PrivDev(privdata);
+
+    if(dev == NULL)
+    {
+        printk("myInit: no board for privdata %x\n", privdata);
+        return -1;
+    }
+
     log_normal("Reached myInit with barbase %x and privdata %x\n",
                 barbase, privdata);
 
-    spin_lock_bh(&RawLock);
-    if(privdata == 0x54545454)  // So that this is done only once
+    spin_lock_bh(&dev->RawLock);
+    if(PRIV_IS_TX(privdata))  // So that this is done only once
     {
-        TXbarbase = barbase;
+        dev->TXbarbase = barbase;
     }
-    else if(privdata == 0x54545456)  // So that this is done only once
+    else
     {
-        RXbarbase = barbase;
+        dev->RXbarbase = barbase;
+        /* The board registers are in the same BAR, and a stream other
+         * than 0 has no Tx engine to learn it from.
+         */
+        if(dev->Stream)
+            dev->TXbarbase = barbase;
     }
-    TxBufCnt = 0; RxBufCnt = 0;
-    ErrCnt = 0;
-    TxSeqNo = RxSeqNo = 0;
+    RawResetStats(dev);
+    dev->TxSeqNo = dev->RxSeqNo = 0;
 
     /* Stop any running tests. The driver could have been unloaded without
      * stopping running tests the last time. Hence, good to reset everything.
+     * The tests belong to stream 0.
      */
-    XIo_Out32(TXbarbase+TX_CONFIG_ADDRESS, 0);
-#ifndef XAUI
-    XIo_Out32(TXbarbase+RX_CONFIG_ADDRESS, 0);
-#endif
+    if(dev->Stream == 0)
+    {
+        XIo_Out32(dev->TXbarbase+DevTxConfig(dev), 0);
+        if(!dev->Xaui)
+            XIo_Out32(dev->TXbarbase+RX_CONFIG_ADDRESS, 0);
+    }
 
-    spin_unlock_bh(&RawLock);
+    spin_unlock_bh(&dev->RawLock);
 
     return 0;
 }
 
 int myPutRxPkt(void * hndl, PktBuf * vaddr, int numpkts, unsigned int privdata)
 {
+    RawDev * dev = PrivDev(privdata);
     int i, unused=0;
     unsigned int flags;
-		int num_buf_index;
+    int num_buf_index;
+    BufDesc * desc;
+    u64 bytes;
+    u32 stamp = 0;
 
     //printk("Reached myPutRxPkt with handle %p, VA %x, size %d, privdata %x\n",
     //            hndl, (u32)vaddr, size, privdata);
 
     /* Check driver state */
-    if(DriverState != REGISTERED)
+    if((dev == NULL) || (dev->DriverState != REGISTERED))
     {
         printk("Driver does not seem to be ready\n");
         return -1;
     }
 
     /* Check handle value */
-    if(hndl != handle[2])
+    if(hndl != dev->handle[2])
     {
         log_normal("PutRxPkt: Came with wrong handle %x\n", (u32)hndl);
         return -1;
@@ -992,20 +2341,14 @@ int myPutRxPkt(void * hndl, PktBuf * vaddr, int numpkts, unsigned int privdata)
 		}
 #endif
 
-#ifdef WY_NEW_LOCK
-//    spin_lock_bh(&RawLock);
-    spin_lock_bh(&RawReadLock);
-#else
-    while (spin_trylock_bh(&RawReadLock) == 0) {
-      udelay(10);
-    }
-    while (is_read_busy) {
-      udelay(10);
-    }
-    is_read_busy = true;
-    spin_unlock_bh(&RawReadLock);
-#endif    
+    /* Stamp the completions with the FPGA clock. One register read covers
+     * the whole batch, which completed within one poll.
+     */
+    if(DevHasRf(dev))
+        stamp = XIo_In32(dev->TXbarbase+TIMING_STATUS);
 
+    /* RxQueue is only written from this side, no lock needed */
+    bytes = dev->RxBytesProduced;
     for(i=0; i<numpkts; i++)
     {
         flags = vaddr->flags;
@@ -1018,44 +2361,57 @@ int myPutRxPkt(void * hndl, PktBuf * vaddr, int numpkts, unsigned int privdata)
         if(flags & PKT_EOP)
         {
 #ifdef DATA_VERIFY
-            VerifyBuffer((unsigned char *)(vaddr->bufInfo), (vaddr->size), (vaddr->userInfo));
+            VerifyBuffer(dev, ((BufDesc *)vaddr->bufInfo)->VA, (vaddr->size), (vaddr->userInfo));
 #endif
 //            CheckBuffer(vaddr->pktBuf, vaddr->size);
-            RxSeqNo++;
+            dev->RxSeqNo++;
         }
 
-				num_buf_index = RxBufs.AllocPtr + RxBufs.RxNum;
-				if (num_buf_index >= RxBufs.TotalNum)
-				{
-					num_buf_index -= RxBufs.TotalNum;
-				}
-        RxBufs.RxTotalBytes += vaddr->size;
-        RxBufs.rxBytes[num_buf_index] = vaddr->size;
-        RxBufs.RxNum++;
-        RxBufCnt++;
+        desc = (BufDesc *)vaddr->bufInfo;
+        desc->Len = vaddr->size;
+        desc->Stamp = stamp;
+        num_buf_index = RxSlot(dev, dev->RxBufs.RxProduced + i);
+        dev->RxBufs.RxQueue[num_buf_index] = desc;
+        if(dev->RxRing != NULL)
+        {
+            dev->RxRing->desc[num_buf_index].page = desc->Index;
+            dev->RxRing->desc[num_buf_index].len = vaddr->size;
+            dev->RxRing->desc[num_buf_index].timestamp = stamp;
+        }
+        dev->RxBytesProduced += vaddr->size;
         vaddr++;
     }
+    RawStatAdd(dev, Rx.Bufs, i);
+    RawStatAdd(dev, Rx.Bytes, (u64)(dev->RxBytesProduced - bytes));
+
+    /* Publish the new pages to readers. Lengths must be visible before
+     * the producer counter moves.
+     */
+    if(i)
+    {
+        smp_wmb();
+        dev->RxBufs.RxProduced += i;
+        if(dev->RxRing != NULL)
+            dev->RxRing->producer = dev->RxBufs.RxProduced;
+    }
 
-    /* Return packet buffers to free pool */
+    /* Return unused packet buffers to free pool. The others are freed once
+     * the reader has consumed them.
+     */
 
     //printk("PutRxPkt: Freeing %d packets unused %d\n", numpkts, unused);
     if(unused)
-        FreeUnusedBuf(&RxBufs, numpkts);
-//    else
-//        FreeUsedBuf(&RxBufs, numpkts);
+        FreePktBufs(&dev->RxBufs, vaddr, numpkts - i);
 
-#ifdef WY_NEW_LOCK
-//  	spin_unlock_bh(&RawLock);
-  	spin_unlock_bh(&RawReadLock);
-#else
-    is_read_busy = false;
-#endif
+    if(i)
+        wake_up_interruptible(&dev->RawWaitQueue);
 
     return 0;
 }
 
 int myGetRxPkt(void * hndl, PktBuf * vaddr, unsigned int size, int numpkts, unsigned int privdata)
 {
+    RawDev * dev = PrivDev(privdata);
     unsigned char * bufVA;
     PktBuf * pbuf;
     int i;
@@ -1064,17 +2420,17 @@ int myGetRxPkt(void * hndl, PktBuf * vaddr, unsigned int size, int numpkts, unsi
     //                        hndl, size, privdata);
 
     /* Check driver state */
-    if(DriverState != REGISTERED)
+    if((dev == NULL) || (dev->DriverState != REGISTERED))
     {
         printk("Driver does not seem to be ready\n");
         return 0;
     }
 
     /* Check handle value */
-    if(hndl != handle[2])
+    if(hndl != dev->handle[2])
     {
         printk("GetRxPkt: Came with wrong handle %lx\n", (unsigned long)hndl);
-        printk("Should be %lx\n", (unsigned long)handle[2]);
+        printk("Should be %lx\n", (unsigned long)dev->handle[2]);
         return 0;
     }
 #ifdef WY_TEST
@@ -1089,44 +2445,29 @@ int myGetRxPkt(void * hndl, PktBuf * vaddr, unsigned int size, int numpkts, unsi
         printk("myGetRxPkt: Requested size %d does not match mine %d\n",
                                 size, (u32)BUFSIZE);
 
-#ifdef WY_NEW_LOCK
-//    spin_lock_bh(&RawLock);
-    spin_lock_bh(&RawReadLock);
-#else
-    while (spin_trylock_bh(&RawReadLock) == 0) {
-      udelay(10);
-    }
-    while (is_read_busy) {
-      udelay(10);
-    }
-    is_read_busy = true;
-    spin_unlock_bh(&RawReadLock);
-#endif    
+    /* Reclaim pages consumed by read() or the zero-copy ring */
+    RxRingSync(dev, numpkts);
 
     for(i=0; i<numpkts; i++)
     {
         pbuf = &(vaddr[i]);
-        /* Allocate a buffer. DMA driver will map to PCI space. */
-        bufVA = AllocBuf(&RxBufs);
+        /* Allocate a buffer. It is already mapped for DMA. */
+        bufVA = AllocBuf(&dev->RxBufs, pbuf);
         log_verbose(KERN_INFO "myGetRxPkt: The buffer after alloc is at address %x size %d\n",
                             (u32) bufVA, (u32) BUFSIZE);
         if (bufVA == NULL)
         {
-            log_normal(KERN_ERR "RX: AllocBuf failed\n");
+            log_verbose(KERN_ERR "RX: AllocBuf failed\n");
             break;
         }
 
-        pbuf->pktBuf = bufVA;
-        pbuf->bufInfo = bufVA;
         pbuf->size = BUFSIZE;
+        pbuf->flags = PKT_MAPPED;
     }
 
-#ifdef WY_NEW_LOCK
-//  	spin_unlock_bh(&RawLock);
-  	spin_unlock_bh(&RawReadLock);
-#else
-    is_read_busy = false;
-#endif
+    /* Readers holding every buffer keep DMA from being refilled */
+    RawStatStarve(&dev->Stats->Rx, &dev->RxStarved, &dev->RxStarvedSince, i < numpkts);
+    RawStatWater(&dev->Stats->Rx, BufAllocNum(&dev->RxBufs));
 
     log_verbose(KERN_INFO "Requested %d, allocated %d buffers\n", numpkts, i);
     return i;
@@ -1134,22 +2475,24 @@ int myGetRxPkt(void * hndl, PktBuf * vaddr, unsigned int size, int numpkts, unsi
 
 int myPutTxPkt(void * hndl, PktBuf * vaddr, int numpkts, unsigned int privdata)
 {
+    RawDev * dev = PrivDev(privdata);
     int nomore=0;
     int i;
     unsigned int flags;
+    u64 bytes = 0;
 
     log_verbose(KERN_INFO "Reached myPutTxPkt with handle %p, numpkts %d, privdata %x\n",
                 hndl, numpkts, privdata);
 
     /* Check driver state */
-    if(DriverState != REGISTERED)
+    if((dev == NULL) || (dev->DriverState != REGISTERED))
     {
         printk("Driver does not seem to be ready\n");
         return -1;
     }
 
     /* Check handle value */
-    if(hndl != handle[0])
+    if(hndl != dev->handle[0])
     {
         printk("PutTxPkt: Came with wrong handle\n");
         return -1;
@@ -1164,189 +2507,191 @@ int myPutTxPkt(void * hndl, PktBuf * vaddr, int numpkts, unsigned int privdata)
     /* Just check if we are on the way out */
     for(i=0; i<numpkts; i++)
     {
-        flags = vaddr->flags;
+        flags = vaddr[i].flags;
         //printk("TX pkt flags %x\n", flags);
         if(flags & PKT_UNUSED)
         {
             nomore = 1;
             break;
         }
-        vaddr++;
+        bytes += vaddr[i].size;
     }
+    RawStatAdd(dev, Tx.Bufs, i);
+    RawStatAdd(dev, Tx.Bytes, bytes);
+    RawStatAdd(dev, Tx.Drops, numpkts - i);
 
-    spin_lock_bh(&RawLock);
-
-    /* Return packet buffer to free pool */
+    /* Return packet buffers to free pool, used or not */
     //printk("PutTxPkt: Freed %d packets nomore %d\n", numpkts, nomore);
     if(nomore)
-        FreeUnusedBuf(&TxBufs, numpkts);
-    else
-        FreeUsedBuf(&TxBufs, numpkts);
-    spin_unlock_bh(&RawLock);
+        log_normal(KERN_INFO "PutTxPkt: %d unused buffers returned\n", numpkts);
+    dev->TxZcDone += FreeTxPkts(dev, vaddr, numpkts);
+
+    /* Writers polling for POLLOUT wait on free Tx buffers, zero-copy
+     * senders on their pages
+     */
+    wake_up_interruptible(&dev->RawWaitQueue);
 
     return 0;
 }
 
 int mySetState(void * hndl, UserState * ustate, unsigned int privdata)
 {
+    RawDev * dev = PrivDev(privdata);
     int val;
-    static unsigned int testmode;
 
     log_verbose(KERN_INFO "Reached mySetState with privdata %x\n", privdata);
 
     /* Check driver state */
-    if(DriverState != REGISTERED)
+    if((dev == NULL) || (dev->DriverState != REGISTERED))
     {
         printk("Driver does not seem to be ready\n");
         return EFAULT;
     }
 
     /* Check handle value */
-    if((hndl != handle[0]) && (hndl != handle[2]))
+    if((hndl != dev->handle[0]) && (hndl != dev->handle[2]))
     {
         printk("SetState: Came with wrong handle\n");
         return EBADF;
     }
 
     /* Valid only for TX engine */
-    if(privdata == 0x54545454)
+    if(PRIV_IS_TX(privdata))
     {
-        spin_lock_bh(&RawLock);
+        spin_lock_bh(&dev->RawLock);
 
         /* Set up the value to be written into the register */
-        RawTestMode = ustate->TestMode;
+        dev->RawTestMode = ustate->TestMode;
 
-        if(RawTestMode & TEST_START)
+        if(dev->RawTestMode & TEST_START)
         {
-            testmode = 0;
-            if(RawTestMode & ENABLE_LOOPBACK) testmode |= LOOPBACK;
-#ifndef XAUI
-            if(RawTestMode & ENABLE_PKTCHK) testmode |= PKTCHKR;
-            if(RawTestMode & ENABLE_PKTGEN) testmode |= PKTGENR;
-#endif
+            dev->HwTestMode = 0;
+            if(dev->RawTestMode & ENABLE_LOOPBACK) dev->HwTestMode |= DevLoopback(dev);
+            if(!dev->Xaui)
+            {
+                if(dev->RawTestMode & ENABLE_PKTCHK) dev->HwTestMode |= PKTCHKR;
+                if(dev->RawTestMode & ENABLE_PKTGEN) dev->HwTestMode |= PKTGENR;
+            }
         }
-        else
+        else if(!dev->Xaui)
         {
             /* Deliberately not clearing the loopback bit, incase a
              * loopback test was going on - allows the loopback path
              * to drain off packets. Just stopping the source of packets.
              */
-#ifndef XAUI
-            if(RawTestMode & ENABLE_PKTCHK) testmode &= ~PKTCHKR;
-            if(RawTestMode & ENABLE_PKTGEN) testmode &= ~PKTGENR;
-#endif
+            if(dev->RawTestMode & ENABLE_PKTCHK) dev->HwTestMode &= ~PKTCHKR;
+            if(dev->RawTestMode & ENABLE_PKTGEN) dev->HwTestMode &= ~PKTGENR;
         }
 
         printk("SetState TX with RawTestMode %x, reg value %x\n",
-                                                    RawTestMode, testmode);
+                                                    dev->RawTestMode, dev->HwTestMode);
 
         /* Now write the registers */
-        if(RawTestMode & TEST_START)
+        if(dev->RawTestMode & TEST_START)
         {
 #if 0        
-#ifndef XAUI
-            if(!(RawTestMode & (ENABLE_PKTCHK|ENABLE_PKTGEN|ENABLE_LOOPBACK)))
+            if(!dev->Xaui &&
+               !(dev->RawTestMode & (ENABLE_PKTCHK|ENABLE_PKTGEN|ENABLE_LOOPBACK)))
             {
                 printk("%s Driver: TX Test Start with wrong mode %x\n",
-                                                MYNAME, testmode);
-                RawTestMode = 0;
-                spin_unlock_bh(&RawLock);
+                                                DevName(dev), dev->HwTestMode);
+                dev->RawTestMode = 0;
+                spin_unlock_bh(&dev->RawLock);
                 return EBADRQC;
             }
-#endif
 #endif
 
             printk("%s Driver: Starting the test - mode %x, reg %x\n",
-                                            MYNAME, RawTestMode, testmode);
+                                            DevName(dev), dev->RawTestMode, dev->HwTestMode);
 
             /* Next, set packet sizes. Ensure they don't exceed PKTSIZEs */
-            RawMinPktSize = ustate->MinPktSize;
-            RawMaxPktSize = ustate->MaxPktSize;
-
-#ifndef XAUI
-            /* Set RX packet size for memory path */
-            val = RawMaxPktSize;
-            if(val % BYTEMULTIPLE)
-                val -= (val % BYTEMULTIPLE);
-            printk("Reg %x = %x\n", PKT_SIZE_ADDRESS, val);
-            RawMinPktSize = RawMaxPktSize = val;
-
-            /* Now ensure the sizes remain within bounds */
-            if(RawMaxPktSize > MAXPKTSIZE)
-                RawMinPktSize = RawMaxPktSize = MAXPKTSIZE;
-            if(RawMinPktSize < MINPKTSIZE)
-                RawMinPktSize = RawMaxPktSize = MINPKTSIZE;
-            if(RawMinPktSize > RawMaxPktSize)
-                RawMinPktSize = RawMaxPktSize;
-            val = RawMaxPktSize;
-
-            printk("========Reg %x = %d\n", PKT_SIZE_ADDRESS, val);
-            XIo_Out32(TXbarbase+PKT_SIZE_ADDRESS, val);
-            printk("RxPktSize %d\n", val);
-#else
-            /* Now ensure the sizes remain within bounds */
-            if(RawMaxPktSize > MAXPKTSIZE)
-                RawMaxPktSize = MAXPKTSIZE;
-            if(RawMinPktSize < MINPKTSIZE)
-                RawMinPktSize = MINPKTSIZE;
-            if(RawMinPktSize > RawMaxPktSize)
-                RawMinPktSize = RawMaxPktSize;
-
-            printk("MinPktSize %d MaxPktSize %d\n",
-                                RawMinPktSize, RawMaxPktSize);
-#endif
+            dev->RawMinPktSize = ustate->MinPktSize;
+            dev->RawMaxPktSize = ustate->MaxPktSize;
 
-/* Incase the last test was a loopback test, that bit may not be cleared. */
-            XIo_Out32(TXbarbase+TX_CONFIG_ADDRESS, 0);
-            if(RawTestMode & (ENABLE_PKTCHK|ENABLE_LOOPBACK))
+            if(!dev->Xaui)
             {
-                TxSeqNo = 0;
-#ifdef XAUI
-                RxSeqNo = 0;
-#endif
-                if(RawTestMode & ENABLE_LOOPBACK)
-                    RxSeqNo = 0;
-                printk("========Reg %x = %x\n", TX_CONFIG_ADDRESS, testmode);
-                XIo_Out32(TXbarbase+TX_CONFIG_ADDRESS, testmode);
+                /* Set RX packet size for memory path */
+                val = dev->RawMaxPktSize;
+                if(val % BYTEMULTIPLE)
+                    val -= (val % BYTEMULTIPLE);
+                printk("Reg %x = %x\n", PKT_SIZE_ADDRESS, val);
+                dev->RawMinPktSize = dev->RawMaxPktSize = val;
+
+                /* Now ensure the sizes remain within bounds */
+                if(dev->RawMaxPktSize > MAXPKTSIZE)
+                    dev->RawMinPktSize = dev->RawMaxPktSize = MAXPKTSIZE;
+                if(dev->RawMinPktSize < MINPKTSIZE)
+                    dev->RawMinPktSize = dev->RawMaxPktSize = MINPKTSIZE;
+                if(dev->RawMinPktSize > dev->RawMaxPktSize)
+                    dev->RawMinPktSize = dev->RawMaxPktSize;
+                val = dev->RawMaxPktSize;
+
+                printk("========Reg %x = %d\n", PKT_SIZE_ADDRESS, val);
+                XIo_Out32(dev->TXbarbase+PKT_SIZE_ADDRESS, val);
+                printk("RxPktSize %d\n", val);
             }
-#ifndef XAUI
-            if(RawTestMode & ENABLE_PKTGEN)
+            else
             {
-                RxSeqNo = 0;
-                printk("========Reg %x = %x\n", RX_CONFIG_ADDRESS, testmode);
-                XIo_Out32(TXbarbase+RX_CONFIG_ADDRESS, testmode);
+                /* Now ensure the sizes remain within bounds */
+                if(dev->RawMaxPktSize > XAUI_MAXPKTSIZE)
+                    dev->RawMaxPktSize = XAUI_MAXPKTSIZE;
+                if(dev->RawMinPktSize < MINPKTSIZE)
+                    dev->RawMinPktSize = MINPKTSIZE;
+                if(dev->RawMinPktSize > dev->RawMaxPktSize)
+                    dev->RawMinPktSize = dev->RawMaxPktSize;
+
+                printk("MinPktSize %d MaxPktSize %d\n",
+                                    dev->RawMinPktSize, dev->RawMaxPktSize);
             }
-#endif
 
-#ifdef XAUI
-            /* Wait for the link status to be established */
-            mdelay(300);
+/* Incase the last test was a loopback test, that bit may not be cleared. */
+            XIo_Out32(dev->TXbarbase+DevTxConfig(dev), 0);
+            if(dev->RawTestMode & (ENABLE_PKTCHK|ENABLE_LOOPBACK))
+            {
+                dev->TxSeqNo = 0;
+                if(dev->Xaui || (dev->RawTestMode & ENABLE_LOOPBACK))
+                    dev->RxSeqNo = 0;
+                printk("========Reg %x = %x\n", DevTxConfig(dev), dev->HwTestMode);
+                XIo_Out32(dev->TXbarbase+DevTxConfig(dev), dev->HwTestMode);
+            }
+            if(!dev->Xaui && (dev->RawTestMode & ENABLE_PKTGEN))
+            {
+                dev->RxSeqNo = 0;
+                printk("========Reg %x = %x\n", RX_CONFIG_ADDRESS, dev->HwTestMode);
+                XIo_Out32(dev->TXbarbase+RX_CONFIG_ADDRESS, dev->HwTestMode);
+            }
 
-            /* Now, check if the link status is fine */
-            val = XIo_In32(TXbarbase+LINK_STATUS_ADDRESS);
-            printk("Link status is %x\n", val);
-            if(!(val & (RX_LINK_UP|RX_ALIGNED)))
+            if(dev->Xaui)
             {
-                printk(KERN_ERR "Link status is down %x\n", val);
-                XIo_Out32(TXbarbase+TX_CONFIG_ADDRESS, 0);
-                RawTestMode = 0;
-                spin_unlock_bh(&RawLock);
-                return ENOLINK;
+                /* Wait for the link status to be established */
+                mdelay(300);
+
+                /* Now, check if the link status is fine */
+                val = XIo_In32(dev->TXbarbase+XAUI_LINK_STATUS_ADDRESS);
+                printk("Link status is %x\n", val);
+                if(!(val & (RX_LINK_UP|RX_ALIGNED)))
+                {
+                    printk(KERN_ERR "Link status is down %x\n", val);
+                    XIo_Out32(dev->TXbarbase+XAUI_TX_CONFIG_ADDRESS, 0);
+                    dev->RawTestMode = 0;
+                    spin_unlock_bh(&dev->RawLock);
+                    return ENOLINK;
+                }
             }
-#endif
         }
         /* Else, stop the test. Do not remove any loopback here because
          * the DMA queues and hardware FIFOs must drain first.
          */
         else
         {
-            printk("%s Driver: Stopping the test, mode %x\n", MYNAME, testmode);
-            printk("========Reg %x = %x\n", TX_CONFIG_ADDRESS, testmode);
-            XIo_Out32(TXbarbase+TX_CONFIG_ADDRESS, testmode);
-#ifndef XAUI
-            printk("========Reg %x = %x\n", RX_CONFIG_ADDRESS, testmode);
-            XIo_Out32(TXbarbase+RX_CONFIG_ADDRESS, testmode);
-#endif
+            printk("%s Driver: Stopping the test, mode %x\n", DevName(dev), dev->HwTestMode);
+            printk("========Reg %x = %x\n", DevTxConfig(dev), dev->HwTestMode);
+            XIo_Out32(dev->TXbarbase+DevTxConfig(dev), dev->HwTestMode);
+            if(!dev->Xaui)
+            {
+                printk("========Reg %x = %x\n", RX_CONFIG_ADDRESS, dev->HwTestMode);
+                XIo_Out32(dev->TXbarbase+RX_CONFIG_ADDRESS, dev->HwTestMode);
+            }
 
             /* Not resetting sequence numbers here - causes problems
              * in debugging. Instead, reset the sequence numbers when
@@ -1354,8 +2699,8 @@ int mySetState(void * hndl, UserState * ustate, unsigned int privdata)
              */
         }
 
-        PrintSummary();
-        spin_unlock_bh(&RawLock);
+        PrintSummary(dev);
+        spin_unlock_bh(&dev->RawLock);
     }
 
     return 0;
@@ -1363,25 +2708,29 @@ int mySetState(void * hndl, UserState * ustate, unsigned int privdata)
 
 int myGetState(void * hndl, UserState * ustate, unsigned int privdata)
 {
+    RawDev * dev = PrivDev(privdata);
     static int iter=0;
 
     log_verbose("Reached myGetState with privdata %x\n", privdata);
 
+    if(dev == NULL)
+        return EFAULT;
+
     /* Same state is being returned for both engines */
 
     ustate->LinkState = LINK_UP;
     ustate->Errors = 0;
-    ustate->MinPktSize = RawMinPktSize;
-    ustate->MaxPktSize = RawMaxPktSize;
-    ustate->TestMode = RawTestMode;
-    if(privdata == 0x54545454)
-        ustate->Buffers = TxBufs.TotalNum;
+    ustate->MinPktSize = dev->RawMinPktSize;
+    ustate->MaxPktSize = dev->RawMaxPktSize;
+    ustate->TestMode = dev->RawTestMode;
+    if(PRIV_IS_TX(privdata))
+        ustate->Buffers = dev->TxBufs.TotalNum;
     else
-        ustate->Buffers = RxBufs.TotalNum;
+        ustate->Buffers = dev->RxBufs.TotalNum;
 
     if(iter++ >= 4)
     {
-        PrintSummary();
+        PrintSummary(dev);
 
         iter = 0;
     }
@@ -1390,7 +2739,7 @@ int myGetState(void * hndl, UserState * ustate, unsigned int privdata)
 }
 
 #ifndef USER_DATA
-static int DmaSetupTransmit(void * hndl, int num)
+static int DmaSetupTransmit(RawDev * dev, void * hndl, int num)
 {
     int i, result;
     static int pktsize=0;
@@ -1404,14 +2753,14 @@ static int DmaSetupTransmit(void * hndl, int num)
     log_verbose("Reached DmaSetupTransmit with handle %p, num %d\n", hndl, num);
 
     /* Check driver state */
-    if(DriverState != REGISTERED)
+    if(dev->DriverState != REGISTERED)
     {
         printk("Driver does not seem to be ready\n");
         return 0;
     }
 
     /* Check handle value */
-    if(hndl != handle[0])
+    if(hndl != dev->handle[0])
     {
         printk("Came with wrong handle\n");
         return 0;
@@ -1425,26 +2774,24 @@ static int DmaSetupTransmit(void * hndl, int num)
     }
 
     /* Hold the spinlock only when calling the buffer management APIs. */
-    spin_lock_bh(&RawLock);
-    origseqno = TxSeqNo;
+    spin_lock_bh(&dev->RawLock);
+    origseqno = dev->TxSeqNo;
     for(i=0, bufindex=0; i<num; i++)            /* Total packets loop */
     {
         //printk("i %d bufindex %d\n", i, bufindex);
 
-#ifdef XAUI
         /* Generate a random number in-between min and max */
-        if(RawMinPktSize != RawMaxPktSize)
+        if(dev->Xaui && (dev->RawMinPktSize != dev->RawMaxPktSize))
         {
             pktsize += BYTEMULTIPLE;
             if(pktsize % BYTEMULTIPLE)
                 pktsize -= (pktsize % BYTEMULTIPLE);
-            if(pktsize < RawMinPktSize) pktsize = RawMinPktSize;
-            if(pktsize > RawMaxPktSize) pktsize = RawMaxPktSize;
+            if(pktsize < dev->RawMinPktSize) pktsize = dev->RawMinPktSize;
+            if(pktsize > dev->RawMaxPktSize) pktsize = dev->RawMaxPktSize;
         }
         else
-#endif
             /* Fix the packet size to be the maximum entered in GUI */
-            pktsize = RawMaxPktSize;
+            pktsize = dev->RawMaxPktSize;
 
         //printk("pktsize is %d\n", pktsize);
 
@@ -1454,10 +2801,10 @@ static int DmaSetupTransmit(void * hndl, int num)
         {
             //printk("Buf loop total %d bufindex %d\n", total, bufindex);
 
-            pbuf = &(pkts[bufindex]);
+            pbuf = &(dev->pkts[bufindex]);
 
-            /* Allocate a buffer. DMA driver will map to PCI space. */
-            bufVA = AllocBuf(&TxBufs);
+            /* Allocate a buffer. It is already mapped for DMA. */
+            bufVA = AllocBuf(&dev->TxBufs, pbuf);
 
             log_verbose(KERN_INFO "TX: The buffer after alloc is at address %x size %d\n",
                                 (u32) bufVA, (u32) BUFSIZE);
@@ -1467,8 +2814,6 @@ static int DmaSetupTransmit(void * hndl, int num)
                 //printk("[%d]", (num-i-1));
                 break;
             }
-            pbuf->pktBuf = bufVA;
-            pbuf->bufInfo = bufVA;
             bufsize = ((total + BUFSIZE) > pktsize) ?
                                         (pktsize - total) : BUFSIZE ;
             total += bufsize;
@@ -1477,19 +2822,18 @@ static int DmaSetupTransmit(void * hndl, int num)
 
             log_verbose(KERN_INFO "Calling FormatBuffer pktsize %d bufsize %d fragment %d\n",
                                 pktsize, bufsize, fragment);
-            FormatBuffer(bufVA, pktsize, bufsize, fragment);
+            FormatBuffer(dev, bufVA, pktsize, bufsize, fragment);
 
             pbuf->size = bufsize;
-            pbuf->userInfo = TxSeqNo;
-            pbuf->flags = PKT_ALL;
+            pbuf->userInfo = dev->TxSeqNo;
+            pbuf->flags = PKT_ALL | PKT_MAPPED;
             if(!fragment)
                 pbuf->flags |= PKT_SOP;
             if(total == pktsize)
             {
                 pbuf->flags |= PKT_EOP;
-#ifdef XAUI
-                pbuf->size = bufsize - 4;
-#endif
+                if(dev->Xaui)
+                    pbuf->size = bufsize - 4;
             }
 
             //printk("flags %x\n", pbuf->flags);
@@ -1515,22 +2859,20 @@ static int DmaSetupTransmit(void * hndl, int num)
                  */
                 log_normal(KERN_ERR "Tried to send pkt of size %d, only %d fragments possible\n",
                                                 pktsize, fragment);
-                FreeUnusedBuf(&TxBufs, fragment);
+                FreePktBufs(&dev->TxBufs, &dev->pkts[bufindex], fragment);
             }
             break;
         }
 
-#ifdef XAUI
         /* Reset size so that next time it starts from a low value */
-        if(pktsize >= RawMaxPktSize) pktsize = 0;
-#endif
+        if(dev->Xaui && (pktsize >= dev->RawMaxPktSize)) pktsize = 0;
 
         /* Increment packet sequence number */
         //if(lastno != TxSeqNo) printk(" %u-%u.", lastno, TxSeqNo);
-        TxSeqNo++;
+        dev->TxSeqNo++;
         //lastno = TxSeqNo;
     }
-    spin_unlock_bh(&RawLock);
+    spin_unlock_bh(&dev->RawLock);
 
     //printk("[p%d-%d-%d] ", num, i, bufindex);
 
@@ -1539,53 +2881,234 @@ static int DmaSetupTransmit(void * hndl, int num)
         return 0;
 
     log_verbose("%s: Sending packet length %d seqno %d\n",
-                                        MYNAME, pktsize, TxSeqNo);
-    result = DmaSendPkt(hndl, pkts, bufindex);
-    TxBufCnt += result;
+                                        MYNAME, pktsize, dev->TxSeqNo);
+    result = DmaSendPkt(hndl, dev->pkts, bufindex);
     if(result != bufindex)
     {
+        RawStatAdd(dev, Tx.Drops, bufindex - result);
         log_normal(KERN_ERR "Tried to send %d pkts in %d buffers, sent only %d\n",
                                     num, bufindex, result);
         //printk("[s%d-%d,%d-%d]", bufindex, result, TxSeqNo, origseqno);
-        if(result) TxSeqNo = pkts[result].userInfo;
-        else TxSeqNo = origseqno;
+        if(result) dev->TxSeqNo = dev->pkts[result].userInfo;
+        else dev->TxSeqNo = origseqno;
         //printk("-%u-", TxSeqNo);
         //lastno = TxSeqNo;
 
-        spin_lock_bh(&RawLock);
-        FreeUnusedBuf(&TxBufs, (bufindex-result));
-        spin_unlock_bh(&RawLock);
+        FreePktBufs(&dev->TxBufs, &dev->pkts[result], (bufindex-result));
         return 0;
     }
     else return 1;
 }
 #endif
 
+/* Set up the state of one Rx stream of a board, or of its XAUI engine
+ * pair, before it is registered with DMA. Only stream 0 and XAUI get Tx
+ * buffers; txdev is the board's stream 0, or NULL for those two.
+ */
+static RawDev * InitRawDev(int board, int stream, int xaui, RawDev * txdev)
+{
+    RawDev * dev;
+
+    if((dev = vmalloc(sizeof(RawDev))) == NULL)
+    {
+        printk("InitRawDev: Unable to allocate board %d\n", board);
+        return NULL;
+    }
+    memset(dev, 0, sizeof(RawDev));
+
+    if((txdev == NULL) && (dev->pkts = vmalloc(num_bufs * sizeof(PktBuf))) == NULL)
+    {
+        printk("InitRawDev: Unable to allocate packets for board %d\n", board);
+        vfree(dev);
+        return NULL;
+    }
+
+    if((dev->Stats = alloc_percpu(RawStats)) == NULL)
+    {
+        printk("InitRawDev: Unable to allocate counters for board %d\n", board);
+        vfree(dev->pkts);
+        vfree(dev);
+        return NULL;
+    }
+
+    /* Without these, RD_CMD_TX_ZERO_COPY is refused and write() still works */
+    if(txdev == NULL)
+    {
+        dev->TxPins = vmalloc(num_bufs * sizeof(TxPin));
+        dev->TxPinPages = vmalloc(num_bufs * sizeof(struct page *));
+        if((dev->TxPins == NULL) || (dev->TxPinPages == NULL))
+        {
+            printk("InitRawDev: No zero-copy Tx for board %d\n", board);
+            vfree(dev->TxPins);
+            vfree(dev->TxPinPages);
+            dev->TxPins = NULL;
+            dev->TxPinPages = NULL;
+        }
+        else
+            memset(dev->TxPins, 0, num_bufs * sizeof(TxPin));
+    }
+
+    dev->Board = board;
+    dev->Stream = stream;
+    dev->Xaui = xaui;
+    dev->TxDev = (txdev != NULL) ? txdev : dev;
+    dev->DriverState = INITIALIZED;
+    dev->RawTestMode = TEST_STOP;
+    dev->RawMinPktSize = MINPKTSIZE;
+    dev->RawMaxPktSize = DevMaxPktSize(dev);
+    INIT_LIST_HEAD(&dev->Readers);
+    spin_lock_init(&dev->RawLock);
+    spin_lock_init(&dev->RxReaderLock);
+    mutex_init(&dev->TxMutex);
+    spin_lock_init(&dev->RfCmdLock);
+    hrtimer_init(&dev->RfCmdTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev->RfCmdTimer.function = RfCmdTimerFn;
+    init_waitqueue_head(&dev->RawWaitQueue);
+
+    /* First allocate the buffer pool and set the driver state
+     * because GetPkt routine can potentially be called immediately
+     * after Register is done.
+     */
+    if(((txdev == NULL) && InitBuffers(&dev->TxBufs, board, PCI_DMA_TODEVICE)) ||
+       InitBuffers(&dev->RxBufs, board, PCI_DMA_FROMDEVICE) ||
+       InitRxRing(dev) || InitStatusPage(dev))
+    {
+        /* Without buffers the device is of no use; leave it out */
+        printk("InitRawDev: Unable to set up board %d stream %d\n", board, stream);
+        DmaPoolDestroy(dev->TxBufs.Pool);
+        DmaPoolDestroy(dev->RxBufs.Pool);
+        FreeBufferState(&dev->TxBufs);
+        FreeBufferState(&dev->RxBufs);
+        vfree(dev->RxRing);
+        vfree(dev->StatusPage);
+        vfree(dev->TxPins);
+        vfree(dev->TxPinPages);
+        free_percpu(dev->Stats);
+        vfree(dev->pkts);
+        vfree(dev);
+        return NULL;
+    }
+
+    return dev;
+}
+
 static int __init rawdata_init(void)
 {
     dev_t rawdataDev;  /* Just register the driver. No kernel boot options used. */
     static struct file_operations rawdataDevFileOps;
+    static struct file_operations rawdataStatsFileOps;
+    char name[16];
     int chrRet;
+    int registered;
+    int i, s;
 
     printk(KERN_INFO "%s Init: Inserting Xilinx driver in kernel.\n",
                                         MYNAME);
 
-    DriverState = INITIALIZED;
-    spin_lock_init(&RawLock);
-
-    /* First allocate the buffer pool and set the driver state
-     * because GetPkt routine can potentially be called immediately
-     * after Register is done.
-     */
     printk("PAGE_SIZE is %ld\n", PAGE_SIZE);
     msleep(5);
 
-    InitBuffers(&TxBufs);
-    InitBuffers(&RxBufs);
+    if((num_bufs < NUM_BUFS_MIN) || (num_bufs > NUM_BUFS_MAX) ||
+       (buf_pages < 1) || (buf_pages > MAXPKTSIZE/PAGE_SIZE))
+    {
+        printk(KERN_ERR "%s Init: num_bufs %d or buf_pages %d out of range\n",
+                                        MYNAME, num_bufs, buf_pages);
+        return -EINVAL;
+    }
+    if((rx_streams < 1) || (rx_streams > ML605_MAX_STREAMS))
+    {
+        printk(KERN_ERR "%s Init: rx_streams %d not in 1..%d\n",
+                                        MYNAME, rx_streams, ML605_MAX_STREAMS);
+        return -EINVAL;
+    }
+    printk("%d buffers of %d bytes per direction\n", num_bufs, BUFSIZE);
+
+    /* One RawDev, and one device minor, per Rx stream of each board found
+     * by xdma
+     */
+    NumRawDevs = DmaNumBoards();
+    if(NumRawDevs > MAX_BOARDS)
+        NumRawDevs = MAX_BOARDS;
+    if(NumRawDevs == 0)
+    {
+        printk(KERN_ERR "%s Init: no DMA boards found\n", MYNAME);
+        return -ENODEV;
+    }
+
+    for(i=0; i<NumRawDevs; i++)
+    {
+        if((RawDevs[i] = InitRawDev(i, 0, 0, NULL)) == NULL)
+        {
+            NumRawDevs = i;
+            break;
+        }
+        for(s=1; s<rx_streams; s++)
+            RawDevs[RAW_MINOR(i, s)] = InitRawDev(i, s, 0, RawDevs[i]);
+        if(xaui)
+            RawDevs[RAW_MINOR(i, XAUI_SLOT)] = InitRawDev(i, 0, 1, NULL);
+    }
+    if(NumRawDevs == 0)
+        return -ENOMEM;
+    NumRawMinors = xaui ? RAW_MINOR(NumRawDevs, XAUI_SLOT) :
+                          RAW_MINOR(NumRawDevs, rx_streams - 1);
+    printk(KERN_INFO "%s Init: %d board(s), %d stream(s) each%s\n",
+                MYNAME, NumRawDevs, rx_streams, xaui ? ", and XAUI" : "");
+
+    /* Register with DMA before the device can be opened. A device that
+     * fails stays UNINITIALIZED and refuses I/O, and so do the streams
+     * that send through it; stream 0 comes first in minor order.
+     */
+    registered = 0;
+    for(i=0; i<MAX_RAW_DEVS; i++)
+    {
+        if(RawDevs[i] == NULL)
+            continue;
+        if((RawDevs[i]->TxDev != RawDevs[i]) &&
+           (RawDevs[i]->TxDev->DriverState != REGISTERED))
+        {
+            printk(KERN_ERR "%s Init: board %d stream %d has no Tx, not registered\n",
+                        MYNAME, RawDevs[i]->Board, RawDevs[i]->Stream);
+            continue;
+        }
+        if(RegisterBoard(RawDevs[i]) == 0)
+            registered++;
+    }
+    if(registered == 0)
+    {
+        printk(KERN_ERR "%s Init: no device could register with DMA\n", MYNAME);
+        CleanupRawDevs();
+        NumRawDevs = NumRawMinors = 0;
+        return -ENODEV;
+    }
+
+    /* Counters can also be read from debugfs; it is fine if that fails */
+    rawdataStatsFileOps.owner = THIS_MODULE;
+    rawdataStatsFileOps.open = RawStatsOpen;
+    rawdataStatsFileOps.read = seq_read;
+    rawdataStatsFileOps.llseek = seq_lseek;
+    rawdataStatsFileOps.release = single_release;
+    RawDebugDir = debugfs_create_dir("ml605_raw_data", NULL);
+    if(!IS_ERR_OR_NULL(RawDebugDir))
+    {
+        for(i=0; i<MAX_RAW_DEVS; i++)
+        {
+            if(RawDevs[i] == NULL)
+                continue;
+            if(RawDevs[i]->Xaui)
+                snprintf(name, sizeof(name), "xaui%d", RawDevs[i]->Board);
+            else if(RawDevs[i]->Stream)
+                snprintf(name, sizeof(name), "board%d_%d",
+                         RawDevs[i]->Board, RawDevs[i]->Stream);
+            else
+                snprintf(name, sizeof(name), "board%d", RawDevs[i]->Board);
+            debugfs_create_file(name, S_IRUGO, RawDebugDir, RawDevs[i],
+                                &rawdataStatsFileOps);
+        }
+    }
 
     rawdataDev = 0;
     // Register a char device number
-    chrRet = alloc_chrdev_region(&rawdataDev, 0, 1, "ml605_raw_data");
+    chrRet = alloc_chrdev_region(&rawdataDev, 0, NumRawMinors, "ml605_raw_data");
     if (chrRet < 0)
     {
       log_normal(KERN_ERR "Error allocating ml605_raw_data char device region\n");
@@ -1598,7 +3121,7 @@ static int __init rawdata_init(void)
       {
         log_normal(KERN_ERR "Alloc error registering ml605_raw_data device driver\n");
         // Return the device number
-        unregister_chrdev_region(rawdataDev, 1);
+        unregister_chrdev_region(rawdataDev, NumRawMinors);
         chrRet = -1;
       }
       else
@@ -1613,81 +3136,138 @@ static int __init rawdata_init(void)
 #endif
         rawdataDevFileOps.open = rawdata_dev_open;
         rawdataDevFileOps.release = rawdata_dev_release;
+        rawdataDevFileOps.mmap = rawdata_dev_mmap;
+        rawdataDevFileOps.poll = rawdata_dev_poll;
 
         rawdataCdev->owner = THIS_MODULE;
         rawdataCdev->ops = &rawdataDevFileOps;
         rawdataCdev->dev = rawdataDev;
 
         // Add the char device (rawdata) to system
-        chrRet = cdev_add(rawdataCdev, rawdataDev, 1);
+        chrRet = cdev_add(rawdataCdev, rawdataDev, NumRawMinors);
         if (chrRet < 0)
         {
           log_normal(KERN_ERR "Add error registering ml605_raw_data device driver\n");
-          unregister_chrdev_region(rawdataDev, 1);
+          unregister_chrdev_region(rawdataDev, NumRawMinors);
         }
       }
     }
 
-    /* Start polling routine - change later !!!! */
-    printk(KERN_INFO "%s Init: Starting poll routine with %x\n",
-                                        MYNAME, polldata);
-    init_timer(&poll_timer);
-    poll_timer.expires=jiffies+(HZ/5);
-    poll_timer.data=(unsigned long) polldata;
-    poll_timer.function = poll_routine;
-    add_timer(&poll_timer);
-
     return 0;
 }
 
-static void __exit rawdata_cleanup(void)
+/* Bring one board down and free everything InitRawDev set up */
+static void CleanupRawDev(RawDev * dev)
 {
+    ML605Stats st;
     int i;
 
-    /* Stop the polling routine */
-    del_timer_sync(&poll_timer);
-    //DriverState = CLOSED;
+    /* Drop queued RF commands; the send signal is cleared below */
+    hrtimer_cancel(&dev->RfCmdTimer);
 
     /* Stop any running tests, else the hardware's packet checker &
-     * generator will continue to run.
+     * generator will continue to run. The BAR is only known once myInit
+     * has run.
      */
-    XIo_Out32(TXbarbase+TX_CONFIG_ADDRESS, 0);
-
-#ifndef XAUI
-    XIo_Out32(TXbarbase+RX_CONFIG_ADDRESS, 0);
-#endif
+    if((dev->Stream == 0) && dev->TXbarbase)
+    {
+        XIo_Out32(dev->TXbarbase+DevTxConfig(dev), 0);
+        if(!dev->Xaui)
+            XIo_Out32(dev->TXbarbase+RX_CONFIG_ADDRESS, 0);
+    }
 
-    printk(KERN_INFO "%s: Unregistering Xilinx driver from kernel.\n", MYNAME);
-    if (TxBufCnt != RxBufCnt)
+    printk(KERN_INFO "%s: Unregistering board %d stream %d from kernel.\n",
+                                        MYNAME, dev->Board, dev->Stream);
+    RawGetStats(dev, &st);
+    if ((dev->Stream == 0) && (st.tx.bufs != st.rx.bufs))
     {
-        printk("%s: Buffers Transmitted %u Received %u\n", MYNAME, TxBufCnt, RxBufCnt);
-        printk("TxSeqNo = %u, RxSeqNo = %u\n", TxSeqNo, RxSeqNo);
+        printk("%s: Buffers Transmitted %llu Received %llu\n", MYNAME, st.tx.bufs, st.rx.bufs);
+        printk("TxSeqNo = %u, RxSeqNo = %u\n", dev->TxSeqNo, dev->RxSeqNo);
         mdelay(1);
     }
-    DmaUnregister(handle[0]);
-    DmaUnregister(handle[2]);
+    if((dev->Stream == 0) && (dev->handle[0] != NULL))
+        DmaUnregister(dev->handle[0]);
+    if(dev->handle[2] != NULL)
+        DmaUnregister(dev->handle[2]);
 
-    PrintSummary();
+    PrintSummary(dev);
 
     mdelay(1000);
 
-    /* Not sure if free_page() sleeps or not. */
-    spin_lock_bh(&RawLock);
+    /* Both engines are unregistered, so no buffer is queued for DMA */
     printk("Freeing user buffers\n");
-    for(i=0; i<TxBufs.TotalNum; i++)
-        //kfree(TxBufs.origVA[i]);
-        free_page((unsigned long)(TxBufs.origVA[i]));
-    for(i=0; i<RxBufs.TotalNum; i++)
-        //kfree(RxBufs.origVA[i]);
-        free_page((unsigned long)(RxBufs.origVA[i]));
-    spin_unlock_bh(&RawLock);
+    DmaPoolDestroy(dev->TxBufs.Pool);
+    DmaPoolDestroy(dev->RxBufs.Pool);
+    dev->TxBufs.Pool = dev->RxBufs.Pool = NULL;
+    FreeBufferState(&dev->TxBufs);
+    FreeBufferState(&dev->RxBufs);
+    vfree(dev->pkts);
+
+    /* Pages that never came back through myPutTxPkt are still pinned */
+    if(dev->TxPins != NULL)
+    {
+        for(i = 0; i < num_bufs; i++)
+            if(dev->TxPins[i].Page != NULL)
+                TxPinRelease(dev, &dev->TxPins[i]);
+        vfree(dev->TxPins);
+        vfree(dev->TxPinPages);
+        dev->TxPins = NULL;
+        dev->TxPinPages = NULL;
+    }
+
+    if(dev->RxRing != NULL)
+    {
+        vfree(dev->RxRing);
+        dev->RxRing = NULL;
+    }
+
+    if(dev->StatusPage != NULL)
+    {
+        hrtimer_cancel(&dev->StatusTimer);
+        vfree(dev->StatusPage);
+        dev->StatusPage = NULL;
+    }
+
+    free_percpu(dev->Stats);
+    vfree(dev);
+}
+
+/* Bring every device down. Streams above 0 send through stream 0, so they
+ * go first.
+ */
+static void CleanupRawDevs(void)
+{
+    int i;
+
+    for(i=MAX_RAW_DEVS-1; i>=0; i--)
+    {
+        if(RawDevs[i] == NULL)
+            continue;
+        CleanupRawDev(RawDevs[i]);
+        RawDevs[i] = NULL;
+    }
+}
+
+static void __exit rawdata_cleanup(void)
+{
+    dev_t rawdataDev;
 
+    if(!IS_ERR_OR_NULL(RawDebugDir))
+        debugfs_remove_recursive(RawDebugDir);
+    RawDebugDir = NULL;
+
+    /* No new open() may find a device once it is freed */
     if(rawdataCdev != NULL)
     {
         printk("Unregistering rawdata char device driver\n");
+        rawdataDev = rawdataCdev->dev;
         cdev_del(rawdataCdev);
-        unregister_chrdev_region(rawdataCdev->dev, 1);
+        unregister_chrdev_region(rawdataDev, NumRawMinors);
+        rawdataCdev = NULL;
     }
+
+    CleanupRawDevs();
+    NumRawDevs = NumRawMinors = 0;
 }
 
 module_init(rawdata_init);